@@ -11,6 +11,14 @@
 #include <sstream>
 
 #include "model.hpp"
+#include "stream.hpp"
+#include "scheduler.hpp"
+#include "pipeline.hpp"
+#include "bake.hpp"
+#include "pick.hpp"
+#include "benchmark.hpp"
+#include "library.hpp"
+#include "pose.hpp"
 
 
 using namespace ci;
@@ -48,15 +56,43 @@ class AssimpApp : public AppNative {
   float z_distance;
 
   Model model;
+  // 複数のモデルで共有するアニメーション
+  AnimLibrary anim_library;
   Vec3f offset;
 
+  // 読み込んだファイルと読み込み設定
+  std::string model_path;
+  int import_preset;
+
   double prev_elapsed_time;
 
   bool do_animetion;
   bool no_animation;
+
+  // ファイルからのストリーミング再生
+  bool use_stream;
+  StreamClip stream_clip;
   double current_animation_time;
   double animation_speed;
 
+  // 更新頻度の制御
+  AnimScheduler scheduler;
+  float update_budget;
+
+  // 頂点アニメーションのベイク結果で再生
+  bool use_bake;
+  VertexBake vertex_bake;
+
+  // 視錐台の外にあるメッシュのスキニングと描画を省く
+  bool use_culling;
+
+  // 更新を別スレッドで行う
+  bool use_pipeline;
+  AnimPipeline pipeline;
+
+  // テクスチャの段階的な読み込み
+  TextureStreamer texture_streamer;
+
   bool do_disp_grid;
   float grid_scale;
 
@@ -67,6 +103,9 @@ class AssimpApp : public AppNative {
   gl::Texture bg_image;
 
   std::string settings;
+  std::string alloc_info;
+  std::string memory_info;
+  std::string pick_info;
 
 #if !defined (CINDER_COCOA_TOUCH)
   // iOS版はダイアログの実装が無い
@@ -76,10 +115,17 @@ class AssimpApp : public AppNative {
   
   float getVerticalFov();
   void setupCamera();
+  void loadModelFile(const std::string& path);
+  void updateAnimation(const AnimRequest& request);
+  Matrix44f getModelMatrix();
+  Frustum getFrustum();
+  void pickModelAt(const Vec2i& pos);
   void drawGrid();
 
   // ダイアログ関連
   void makeSettinsText();
+  void makeModelInfoText();
+  void makePickText(const PickResult& result);
   void createDialog();
   void drawDialog();
 
@@ -160,6 +206,40 @@ void AssimpApp::setupCamera() {
   camera_persp.setFarClip(far_z);
 }
 
+// モデルを読み込み直して表示を初期化
+void AssimpApp::loadModelFile(const std::string& path) {
+  ScopedAnimPipelinePause pause(pipeline);
+
+  model_path = path;
+  model = loadModel(model_path, import_preset, &texture_streamer);
+  bindAnimLibrary(anim_library, model);
+
+  // 読み込んだモデルがなんとなく中心に表示されるよう調整
+  offset = -model.aabb.getCenter();
+
+  // FIXME:モデルのAABBを計算する時にアニメーションを適用している
+  //       そのままだとアニメーションの情報が残ってしまっているので
+  //       一旦リセット
+  if (no_animation) resetModelNodes(model);
+
+  setupCamera();
+  current_animation_time = 0.0;
+  touch_num = 0;
+  disp_reverse = false;
+
+  use_stream  = false;
+  stream_clip = StreamClip();
+
+  use_bake    = false;
+  vertex_bake = VertexBake();
+
+  for (auto& instance : scheduler.instance) {
+    resetAnimInstance(instance);
+  }
+
+  makeModelInfoText();
+}
+
 // グリッド描画
 void AssimpApp::drawGrid() {
   gl::lineWidth(1.0f);
@@ -186,6 +266,8 @@ void AssimpApp::drawGrid() {
 
 // iOS版はダイアログ関連の実装が無い
 void AssimpApp::makeSettinsText() {}
+void AssimpApp::makeModelInfoText() {}
+void AssimpApp::makePickText(const PickResult& result) {}
 void AssimpApp::createDialog() {}
 void AssimpApp::drawDialog() {}
 
@@ -198,6 +280,11 @@ void AssimpApp::makeSettinsText() {
   str << (two_sided    ? "D" : " ") << " "
       << (do_animetion ? "A" : " ") << " "
       << (no_animation ? "M" : " ") << " "
+      << (use_stream   ? "S" : " ") << " "
+      << (use_pipeline ? "P" : " ") << " "
+      << (use_bake     ? "B" : " ") << " "
+      << (use_culling  ? "U" : " ") << " "
+      << ((model.has_anim && model.animation[0].palette) ? "C" : " ") << " "
       << (disp_reverse ? "F" : " ");
 
   settings = str.str();
@@ -205,6 +292,49 @@ void AssimpApp::makeSettinsText() {
   params->addParam("Settings", &settings, true);
 }
 
+// 読み込んだモデルの情報をテキスト化
+void AssimpApp::makeModelInfoText() {
+  std::ostringstream str;
+
+  // 読み込み時のヒープ確保回数とサイズ、アリーナの使用量
+  auto total = getAllocTotal(model.alloc_stat);
+  str << total.count << " / " << (total.bytes + 1023) / 1024 << "KB";
+  if (model.arena) {
+    str << " (" << (model.arena->getUsedBytes() + 1023) / 1024 << "KB)";
+  }
+
+  alloc_info = str.str();
+  params->removeParam("Alloc");
+  params->addParam("Alloc", &alloc_info, true);
+
+  // メモリ使用量の合計と、大きいものの内訳
+  auto report = getModelMemory(model);
+  std::ostringstream memory;
+  memory << (getMemoryTotal(report) + 1023) / 1024 << "KB"
+         << " (M:" << (report.bytes[MEMORY_MESH] + 1023) / 1024
+         << " K:" << (report.bytes[MEMORY_KEYFRAME] + 1023) / 1024
+         << " T:" << (report.bytes[MEMORY_TEXTURE] + 1023) / 1024 << ")";
+
+  memory_info = memory.str();
+  params->removeParam("Memory");
+  params->addParam("Memory", &memory_info, true);
+}
+
+// ピッキング結果をテキスト化
+void AssimpApp::makePickText(const PickResult& result) {
+  std::ostringstream str;
+
+  if (result.hit) {
+    const auto& node = model.node_list[result.node];
+    str << node->name << " #" << result.triangle;
+    if (!result.bone_name.empty()) str << " " << result.bone_name;
+  }
+
+  pick_info = str.str();
+  params->removeParam("Pick");
+  params->addParam("Pick", &pick_info, true);
+}
+
 // ダイアログ作成
 void AssimpApp::createDialog() {
 	// 各種パラメーター設定
@@ -228,8 +358,28 @@ void AssimpApp::createDialog() {
   params->addSeparator();
 
   params->addParam("Speed", &animation_speed).min(0.1).max(10.0).precision(2).step(0.05);
+  params->addParam("Budget(ms)", &update_budget).min(0.1f).max(33.0f).precision(1).step(0.1f).updateFn([this]() {
+      // ワーカースレッドが読むので止めてから書き換える
+      ScopedAnimPipelinePause pause(pipeline);
+      scheduler.budget = update_budget / 1000.0;
+    });
+
+  params->addSeparator();
+
+  // 読み込み設定を変えたら読み込み直す
+  params->addParam("Preset", getImportPresetNames(), &import_preset);
+  params->addButton("Reload", [this]() { loadModelFile(model_path); });
+
+  // メモリ使用量を集計用にJSONで出力
+  params->addButton("Memory JSON", [this]() {
+      ScopedAnimPipelinePause pause(pipeline);
+      writeMemoryReportJson(console(), getModelMemory(model));
+      console() << std::endl;
+    });
 
   makeSettinsText();
+  makeModelInfoText();
+  makePickText(PickResult());
 }
 
 // ダイアログ表示
@@ -260,16 +410,61 @@ void AssimpApp::setup() {
   // アクティブになった時にタッチ情報を初期化
   getSignalDidBecomeActive().connect([this](){ touch_num = 0; });
 
+#if !defined (CINDER_COCOA_TOUCH)
+  // ベンチマークだけ行って終了
+  //   遅くなったものがあれば終了コード1
+  {
+    BenchOptions options;
+    if (parseBenchOptions(getArgs(), options)) {
+      u_int regression = runBenchmarkSuite(options);
+      std::exit(regression ? 1 : 0);
+    }
+  }
+
+  // テクスチャを圧縮済みのKTXへ変換して終了
+  //   --convert-texture 元画像 出力先 (複数指定可)
+  {
+    const auto& args = getArgs();
+    bool convert = false;
+    bool success = true;
+    for (size_t i = 0; i + 2 < args.size(); ++i) {
+      if (args[i] != "--convert-texture") continue;
+
+      convert = true;
+      if (!convertTexture(args[i + 1], args[i + 2])) {
+        console() << "Texture convert failed:" << args[i + 1] << std::endl;
+        success = false;
+      }
+      i += 2;
+    }
+    if (convert) std::exit(success ? 0 : 1);
+  }
+#endif
+
+  // テクスチャは別スレッドで読み込み、届いたものから差し替える
+  startTextureStreamer(texture_streamer);
+
   // モデルデータ読み込み
-  model = loadModel(getAssetPath("astroboy_walk.dae").string());
+  import_preset = IMPORT_PRESET_STANDARD;
+  model_path = getAssetPath("astroboy_walk.dae").string();
+  model = loadModel(model_path, import_preset, &texture_streamer);
 
   prev_elapsed_time = 0.0;
 
   do_animetion = true;
   no_animation = false;
+  use_stream   = false;
   current_animation_time = 0.0f;
   animation_speed = 1.0f;
 
+  use_pipeline = true;
+  use_bake     = false;
+  use_culling  = true;
+
+  update_budget = 4.0f;
+  scheduler.budget = update_budget / 1000.0;
+  addAnimInstance(scheduler, &model, 0, 0.0f);
+
   do_disp_grid = true;
   grid_scale = 1.0f;
 
@@ -342,6 +537,8 @@ void AssimpApp::setup() {
 
   // ダイアログ作成
   createDialog();
+
+  startAnimPipeline(pipeline, model, [this](const AnimRequest& request) { updateAnimation(request); });
   
   gl::enableAlphaBlending();
   gl::enable(GL_CULL_FACE);
@@ -349,6 +546,8 @@ void AssimpApp::setup() {
 }
 
 void AssimpApp::shutdown() {
+  stopAnimPipeline(pipeline);
+  stopTextureStreamer(texture_streamer);
   delete light;
 }
 
@@ -363,20 +562,12 @@ void AssimpApp::fileDrop(FileDropEvent event) {
   const auto& path = event.getFiles();
   console() << "Load: " << path[0] << std::endl;
 
-  model = loadModel(path[0].string());
-
-  // 読み込んだモデルがなんとなく中心に表示されるよう調整
-  offset = -model.aabb.getCenter();
-
-  // FIXME:モデルのAABBを計算する時にアニメーションを適用している
-  //       そのままだとアニメーションの情報が残ってしまっているので
-  //       一旦リセット
-  if (no_animation) resetModelNodes(model);
+  // 二つ目以降のファイルはアニメーションライブラリとして読み込む
+  for (size_t i = 1; i < path.size(); ++i) {
+    loadAnimLibrary(anim_library, path[i].string(), import_preset);
+  }
 
-  setupCamera();
-  current_animation_time = 0.0;
-  touch_num = 0;
-  disp_reverse = false;
+  loadModelFile(path[0].string());
 }
 
 
@@ -388,6 +579,9 @@ void AssimpApp::mouseDown(MouseEvent event) {
     auto pos = event.getPos();
     mouse_prev_pos = pos;
   }
+  else if (event.isRight()) {
+    pickModelAt(event.getPos());
+  }
 }
 
 void AssimpApp::mouseDrag(MouseEvent event) {
@@ -461,6 +655,8 @@ void AssimpApp::keyDown(KeyEvent event) {
 
   case KeyEvent::KEY_m:
     {
+      ScopedAnimPipelinePause pause(pipeline);
+
       no_animation = !no_animation;
       if (no_animation) {
         resetModelNodes(model);
@@ -469,6 +665,88 @@ void AssimpApp::keyDown(KeyEvent event) {
     }
     break;
 
+  case KeyEvent::KEY_s:
+    {
+      // 最初のアニメーションをブロック分割して書き出し、そこから再生する
+      if (!model.has_anim) break;
+
+      ScopedAnimPipelinePause pause(pipeline);
+
+      use_stream = !use_stream;
+      for (auto& instance : scheduler.instance) {
+        resetAnimInstance(instance);
+      }
+      if (use_stream && stream_clip.path.empty()) {
+        auto anim = getAnimation(model, 0);
+        std::string path = model_path + ".skas";
+        writeStreamClip(*anim, path, anim->duration / 16.0);
+        stream_clip = openStreamClip(path);
+      }
+      makeSettinsText();
+    }
+    break;
+
+  case KeyEvent::KEY_b:
+    {
+      // 最初のアニメーションを頂点アニメーションとしてベイクし、そこから再生する
+      if (!model.has_anim) break;
+
+      ScopedAnimPipelinePause pause(pipeline);
+
+      use_bake = !use_bake;
+      for (auto& instance : scheduler.instance) {
+        resetAnimInstance(instance);
+      }
+      if (use_bake && !vertex_bake.frame_num) {
+        vertex_bake = bakeVertexAnimation(model, 0, 30.0);
+        printVertexBakeInfo(vertex_bake);
+      }
+      makeSettinsText();
+    }
+    break;
+
+  case KeyEvent::KEY_c:
+    {
+      // 最初のアニメーションのボーン行列をベイクする(もう一度押すと破棄)
+      if (!model.has_anim) break;
+
+      ScopedAnimPipelinePause pause(pipeline);
+
+      auto& clip = model.animation[0];
+      if (clip.palette) {
+        clip.palette.reset();
+      }
+      else {
+        bakeBonePalette(model, 0, 30.0);
+      }
+      for (auto& instance : scheduler.instance) {
+        resetAnimInstance(instance);
+      }
+      makeSettinsText();
+      makeModelInfoText();
+    }
+    break;
+
+  case KeyEvent::KEY_u:
+    {
+      use_culling = !use_culling;
+      makeSettinsText();
+    }
+    break;
+
+  case KeyEvent::KEY_p:
+    {
+      use_pipeline = !use_pipeline;
+      if (use_pipeline) {
+        startAnimPipeline(pipeline, model, [this](const AnimRequest& request) { updateAnimation(request); });
+      }
+      else {
+        stopAnimPipeline(pipeline);
+      }
+      makeSettinsText();
+    }
+    break;
+
   case KeyEvent::KEY_g:
     {
       do_disp_grid = !do_disp_grid;
@@ -487,9 +765,48 @@ void AssimpApp::keyDown(KeyEvent event) {
 
   case KeyEvent::KEY_f:
     {
+      ScopedAnimPipelinePause pause(pipeline);
+
       reverseModelNode(model);
       disp_reverse = !disp_reverse;
+
+      // 頂点アニメーションのベイク結果は node_list、Node::mesh 順なので捨てる
+      use_bake    = false;
+      vertex_bake = VertexBake();
+
+      // 記録した姿勢は node_list 順なので、評価し直させる
+      for (auto& instance : scheduler.instance) {
+        resetAnimInstance(instance);
+      }
       makeSettinsText();
+      // ボーン行列のベイク結果も捨てている
+      makeModelInfoText();
+    }
+    break;
+
+  case KeyEvent::KEY_w:
+    {
+      // 姿勢の問い合わせが updateModel と同じ行列を返すか調べる
+      if (!model.has_anim) break;
+
+      ScopedAnimPipelinePause pause(pipeline);
+
+      float diff = checkWorldTransform(model, 0, current_animation_time);
+      console() << "worldTransform diff:" << diff
+                << (model.animation[0].palette ? " (palette baked)" : "") << std::endl;
+
+      // ノードを書き換えたので評価し直させる
+      for (auto& instance : scheduler.instance) {
+        resetAnimInstance(instance);
+      }
+    }
+    break;
+
+  case KeyEvent::KEY_h:
+    {
+      // ハードウェアカウンタの集計を表示して、計測し直す
+      printPerfProfile(console());
+      resetPerfProfile();
     }
     break;
 
@@ -575,15 +892,104 @@ void AssimpApp::touchesEnded(TouchEvent event) {
 }
 
 
+// アニメーション更新
+//   ワーカースレッドから呼ばれる場合もあるので、request以外のメンバは書き換えない
+void AssimpApp::updateAnimation(const AnimRequest& request) {
+  model.frustum = request.frustum;
+
+  if (!request.animate) {
+    // 止まっている間はカリングだけ
+  }
+  else if (use_bake) {
+    playVertexBake(model, vertex_bake, request.time);
+  }
+  else if (use_stream) {
+    updateModel(model, request.time, stream_clip);
+  }
+  else {
+    for (auto& instance : scheduler.instance) {
+      instance.time        = request.time;
+      instance.speed       = request.speed;
+      instance.screen_size = request.screen_size;
+    }
+    updateAnimScheduler(scheduler, request.delta);
+  }
+
+  cullModel(model, request.frustum);
+}
+
+// 描画時のモデル行列
+//   draw()で積んでいる行列と同じ順番で求める
+Matrix44f AssimpApp::getModelMatrix() {
+  Matrix44f matrix = camera_matrix;
+  matrix.translate(Vec3f(0, 0.0, -z_distance));
+  matrix.translate(translate);
+  matrix *= rotate.toMatrix44();
+  matrix.translate(offset);
+
+  return matrix;
+}
+
+// モデル空間の視錐台
+Frustum AssimpApp::getFrustum() {
+  if (!use_culling) return Frustum();
+
+  return createFrustum(camera_persp.getProjectionMatrix() * camera_persp.getModelViewMatrix() * getModelMatrix());
+}
+
+// 画面上の位置にあるメッシュを調べる
+void AssimpApp::pickModelAt(const Vec2i& pos) {
+  // ワーカースレッドがモデルを書き換えている最中には調べられない
+  ScopedAnimPipelinePause pause(pipeline);
+
+  float u = pos.x / float(getWindowWidth());
+  float v = 1.0f - pos.y / float(getWindowHeight());
+  Ray ray = camera_persp.generateRay(u, v, camera_persp.getAspectRatio());
+
+  // 光線をモデル空間へ
+  Matrix44f matrix = getModelMatrix().inverted();
+  Vec3f origin    = matrix.transformPointAffine(ray.getOrigin());
+  Vec3f direction = matrix.transformVec(ray.getDirection());
+
+  auto start = std::chrono::steady_clock::now();
+  auto result = pickModel(model, origin, direction);
+  std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+
+  printPickResult(model, result);
+  console() << "  time:" << dt.count() * 1000.0 << " ms" << std::endl;
+  makePickText(result);
+}
+
 void AssimpApp::update() {
   double elapsed_time = getElapsedSeconds();
   double delta_time   = elapsed_time - prev_elapsed_time;
 
-  if (do_animetion && !no_animation) {
-    current_animation_time += delta_time * animation_speed;
-    updateModel(model, current_animation_time, 0);
+  bool animate = do_animetion && !no_animation;
+  if (animate) current_animation_time += delta_time * animation_speed;
+
+  // 画面に占める大きさは、視点からの距離とfovから大まかに求める
+  float view_size = 2.0f * std::tan(toRadians(fov / 2.0f)) * z_distance;
+
+  // アニメーションを止めていても、カリングのために毎フレーム依頼する
+  AnimRequest request;
+  request.animate     = animate;
+  request.time        = current_animation_time;
+  request.delta       = delta_time;
+  request.speed       = animation_speed;
+  request.screen_size = std::min(model.aabb.getSize().length() / view_size, 1.0f);
+  request.frustum     = getFrustum();
+
+  // ワーカースレッドが動いていれば、描画と並行して次のフレームを計算させる
+  if (pipeline.running) {
+    requestAnimPipeline(pipeline, request);
+  }
+  else {
+    updateAnimation(request);
   }
 
+  // 届いたテクスチャを転送する
+  updateTextureStreamer(texture_streamer);
+
   prev_elapsed_time = elapsed_time;
 }
 
@@ -621,7 +1027,14 @@ void AssimpApp::draw() {
   gl::multModelView(rotate.toMatrix44());
 
   gl::translate(offset);
-  drawModel(model);
+  if (pipeline.running) {
+    drawModel(model, acquireAnimFrame(pipeline));
+  }
+  else {
+    // 更新後にカメラが動いて見えるようになったメッシュは、ここでスキニングされる
+    cullModel(model, getFrustum());
+    drawModel(model);
+  }
 
   gl::disable(GL_LIGHTING);
   light->disable();
@@ -0,0 +1,168 @@
+﻿#pragma once
+
+//
+// アフィン変換行列(3x4)
+//   最下行が(0, 0, 0, 1)の行列は、上3行だけあれば表現できる
+//   アニメーションの計算はこれで行い、OpenGLへ渡す時だけ4x4に変換する
+//
+
+#include <cinder/Vector.h>
+#include <cinder/Quaternion.h>
+#include <cinder/Matrix44.h>
+#include <assimp/scene.h>
+#include <cmath>
+
+
+struct Affine {
+  // m[行][列] 列3が平行移動成分
+  float m[3][4];
+
+  static Affine identity() {
+    Affine a = {{
+      { 1.0f, 0.0f, 0.0f, 0.0f },
+      { 0.0f, 1.0f, 0.0f, 0.0f },
+      { 0.0f, 0.0f, 1.0f, 0.0f },
+    }};
+    return a;
+  }
+
+  // 座標変換
+  ci::Vec3f transformPoint(const ci::Vec3f& v) const {
+    return ci::Vec3f{ m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z + m[0][3],
+                      m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z + m[1][3],
+                      m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z + m[2][3] };
+  }
+
+  // 方向ベクトルの変換(平行移動を含めない)
+  ci::Vec3f transformVec(const ci::Vec3f& v) const {
+    return ci::Vec3f{ m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                      m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                      m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z };
+  }
+
+  ci::Vec3f getTranslate() const {
+    return ci::Vec3f{ m[0][3], m[1][3], m[2][3] };
+  }
+
+  // 逆行列
+  //   3x3部分の逆行列と、平行移動を打ち消す成分から求める
+  Affine inverted() const {
+    float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+
+    float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    if (det == 0.0f) return identity();
+    float inv_det = 1.0f / det;
+
+    Affine r;
+    r.m[0][0] = c00 * inv_det;
+    r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    r.m[1][0] = c01 * inv_det;
+    r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    r.m[2][0] = c02 * inv_det;
+    r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+    for (int i = 0; i < 3; ++i) {
+      r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] + r.m[i][2] * m[2][3]);
+    }
+
+    return r;
+  }
+
+  // OpenGLへ渡す時用
+  ci::Matrix44f toMatrix44() const {
+    ci::Matrix44f r;
+    for (int row = 0; row < 3; ++row) {
+      for (int col = 0; col < 4; ++col) {
+        r.at(row, col) = m[row][col];
+      }
+    }
+    r.at(3, 0) = 0.0f;
+    r.at(3, 1) = 0.0f;
+    r.at(3, 2) = 0.0f;
+    r.at(3, 3) = 1.0f;
+
+    return r;
+  }
+};
+
+// 合成
+//   3x3部分の積と、平行移動の変換だけで済む
+Affine operator*(const Affine& a, const Affine& b) {
+  Affine r;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+    }
+    r.m[i][3] += a.m[i][3];
+  }
+
+  return r;
+}
+
+// 平行移動、回転、スケーリングから直接作る
+//   translate * rotation * scale と同じ結果
+Affine composeAffine(const ci::Vec3f& t, const ci::Quatf& q, const ci::Vec3f& s) {
+  float x = q.v.x;
+  float y = q.v.y;
+  float z = q.v.z;
+  float w = q.w;
+
+  float xx = x * x * 2.0f;
+  float yy = y * y * 2.0f;
+  float zz = z * z * 2.0f;
+  float xy = x * y * 2.0f;
+  float xz = x * z * 2.0f;
+  float yz = y * z * 2.0f;
+  float wx = w * x * 2.0f;
+  float wy = w * y * 2.0f;
+  float wz = w * z * 2.0f;
+
+  Affine r = {{
+    { (1.0f - (yy + zz)) * s.x, (xy - wz) * s.y,          (xz + wy) * s.z,          t.x },
+    { (xy + wz) * s.x,          (1.0f - (xx + zz)) * s.y, (yz - wx) * s.z,          t.y },
+    { (xz - wy) * s.x,          (yz + wx) * s.y,          (1.0f - (xx + yy)) * s.z, t.z },
+  }};
+
+  return r;
+}
+
+// 成分ごとの直線補間
+//   差が小さい二つの姿勢の間を埋めるのに使う
+Affine lerpAffine(const Affine& a, const Affine& b, const float t) {
+  Affine r;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      r.m[i][j] = a.m[i][j] + (b.m[i][j] - a.m[i][j]) * t;
+    }
+  }
+
+  return r;
+}
+
+// 全ての成分の差が epsilon 以下か
+bool isNearlyEqual(const Affine& a, const Affine& b, const float epsilon) {
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      if (std::abs(a.m[i][j] - b.m[i][j]) > epsilon) return false;
+    }
+  }
+
+  return true;
+}
+
+// assimp -> Affine
+//   aiMatrix4x4は行優先
+Affine fromAssimp(const aiMatrix4x4& mat) {
+  Affine r = {{
+    { mat.a1, mat.a2, mat.a3, mat.a4 },
+    { mat.b1, mat.b2, mat.b3, mat.b4 },
+    { mat.c1, mat.c2, mat.c3, mat.c4 },
+  }};
+
+  return r;
+}
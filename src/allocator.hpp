@@ -0,0 +1,246 @@
+﻿#pragma once
+
+//
+// メモリ確保
+//   モデル単位のアリーナと、読み込み段階ごとの確保回数・サイズ計測
+//
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <ostream>
+#include "misc.hpp"
+
+
+// モデル単位のアリーナ
+//   確保はブロックを先頭から切り出すだけで、個別の解放はしない
+//   アリーナが破棄された時にまとめて解放される
+class Arena {
+  struct Block {
+    char*  top;
+    size_t size;
+    size_t used;
+  };
+
+  std::vector<Block> blocks;
+  size_t block_size;
+
+  size_t used_bytes;
+  size_t reserved_bytes;
+  size_t alloc_count;
+
+  void addBlock(const size_t size) {
+    Block block;
+    block.top  = static_cast<char*>(std::malloc(size));
+    if (!block.top) throw std::bad_alloc();
+    block.size = size;
+    block.used = 0;
+
+    blocks.push_back(block);
+    reserved_bytes += size;
+  }
+
+public:
+  explicit Arena(const size_t initial_size = 0, const size_t block_size_ = 64 * 1024)
+    : block_size(block_size_),
+      used_bytes(0),
+      reserved_bytes(0),
+      alloc_count(0)
+  {
+    if (initial_size > 0) addBlock(initial_size);
+  }
+
+  ~Arena() {
+    for (auto& block : blocks) {
+      std::free(block.top);
+    }
+  }
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  void* allocate(const size_t size, const size_t alignment) {
+    if (blocks.empty()) addBlock(std::max(size + alignment, block_size));
+
+    auto* block = &blocks.back();
+    size_t offset = (block->used + alignment - 1) & ~(alignment - 1);
+    if (offset + size > block->size) {
+      // 収まらなければ新しいブロックを追加
+      addBlock(std::max(size + alignment, block_size));
+      block  = &blocks.back();
+      offset = 0;
+    }
+
+    block->used = offset + size;
+    used_bytes += size;
+    alloc_count += 1;
+
+    return block->top + offset;
+  }
+
+  size_t getUsedBytes() const { return used_bytes; }
+  size_t getReservedBytes() const { return reserved_bytes; }
+  size_t getBlockNum() const { return blocks.size(); }
+  size_t getAllocCount() const { return alloc_count; }
+};
+
+using ArenaRef = std::shared_ptr<Arena>;
+
+
+// アリーナから確保するアロケーター
+//   アリーナを共有所有するので、確保したコンテナが全て破棄されるまでアリーナは生きている
+//   アリーナ未指定の場合は通常のヒープを使う
+template <typename T>
+struct ArenaAllocator {
+  using value_type = T;
+
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap            = std::true_type;
+
+  ArenaRef arena;
+
+  ArenaAllocator() = default;
+  explicit ArenaAllocator(const ArenaRef& arena_)
+    : arena(arena_)
+  {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& rhs)
+    : arena(rhs.arena)
+  {}
+
+  T* allocate(const size_t n) {
+    if (!arena) return static_cast<T*>(::operator new(n * sizeof(T)));
+    return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, const size_t) {
+    // アリーナから確保した領域はアリーナごと解放する
+    if (!arena) ::operator delete(p);
+  }
+
+  // コピーしたコンテナは元のモデルの寿命に縛られないようヒープを使う
+  ArenaAllocator select_on_container_copy_construction() const {
+    return ArenaAllocator();
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) { return lhs.arena == rhs.arena; }
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) { return lhs.arena != rhs.arena; }
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+
+// 読み込み段階
+enum LoadStage {
+  LOAD_STAGE_IMPORT,
+  LOAD_STAGE_MATERIAL,
+  LOAD_STAGE_TEXTURE,
+  LOAD_STAGE_NODE,
+  LOAD_STAGE_ANIMATION,
+  LOAD_STAGE_POSTPROCESS,
+
+  LOAD_STAGE_NUM
+};
+
+const char* getLoadStageName(const int stage) {
+  static const char* const names[] = {
+    "Import",
+    "Material",
+    "Texture",
+    "Node",
+    "Animation",
+    "Postprocess",
+  };
+
+  return names[stage];
+}
+
+struct AllocStat {
+  size_t count;
+  size_t bytes;
+};
+
+// 段階ごとの確保回数とサイズ
+//   計測中の段階はスレッドごとに持つので、読み込みスレッド以外の確保は数えない
+thread_local int alloc_stage = -1;
+thread_local AllocStat alloc_stat[LOAD_STAGE_NUM];
+
+void resetAllocStat() {
+  for (auto& stat : alloc_stat) {
+    stat.count = 0;
+    stat.bytes = 0;
+  }
+}
+
+// スコープ内の確保を指定段階として数える
+struct ScopedAllocStage {
+  int prev;
+
+  explicit ScopedAllocStage(const int stage)
+    : prev(alloc_stage)
+  {
+    alloc_stage = stage;
+  }
+
+  ~ScopedAllocStage() {
+    alloc_stage = prev;
+  }
+};
+
+// 全段階の合計
+AllocStat getAllocTotal(const AllocStat* stat) {
+  AllocStat total{ 0, 0 };
+  for (int i = 0; i < LOAD_STAGE_NUM; ++i) {
+    total.count += stat[i].count;
+    total.bytes += stat[i].bytes;
+  }
+
+  return total;
+}
+
+void printAllocStat(std::ostream& out, const AllocStat* stat) {
+  for (int i = 0; i < LOAD_STAGE_NUM; ++i) {
+    out << "  " << getLoadStageName(i) << ": " << stat[i].count << " allocs " << stat[i].bytes << " bytes" << std::endl;
+  }
+
+  auto total = getAllocTotal(stat);
+  out << "  Total: " << total.count << " allocs " << total.bytes << " bytes" << std::endl;
+}
+
+
+#if defined (ALLOC_COUNTER)
+
+// グローバルなnew/deleteを置き換えて確保を数える
+// FIXME:アプリ全体で一度だけ定義されるよう、このヘッダは一つの翻訳単位からのみ読み込むこと
+void* operator new(size_t size) {
+  if (alloc_stage >= 0) {
+    alloc_stat[alloc_stage].count += 1;
+    alloc_stat[alloc_stage].bytes += size;
+  }
+
+  void* p = std::malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  std::free(p);
+}
+
+#endif
@@ -4,6 +4,9 @@
 // アニメーション
 //
 
+#include <atomic>
+#include <set>
+
 struct VectorKey {
   double time;
   ci::Vec3f value;
@@ -14,18 +17,65 @@ struct QuatKey {
   ci::Quatf value;
 };
 
+struct WeightKey {
+  double time;
+  float value;
+};
+
 
+// キーフレームはモデルのアリーナから確保する
 struct NodeAnim {
+  explicit NodeAnim(const ArenaRef& arena = ArenaRef())
+    : translate(ArenaAllocator<VectorKey>(arena)),
+      scaling(ArenaAllocator<VectorKey>(arena)),
+      rotation(ArenaAllocator<QuatKey>(arena))
+  {}
+
   std::string node_name;
 
-  std::vector<VectorKey> translate;
-  std::vector<VectorKey> scaling;
-  std::vector<QuatKey>   rotation;
+  ArenaVector<VectorKey> translate;
+  ArenaVector<VectorKey> scaling;
+  ArenaVector<QuatKey>   rotation;
+};
+
+// モーフターゲット一つ分のウェイト
+struct MorphTrack {
+  explicit MorphTrack(const ArenaRef& arena = ArenaRef())
+    : target(0),
+      keys(ArenaAllocator<WeightKey>(arena))
+  {}
+
+  // Mesh::morph の位置
+  u_int target;
+  ArenaVector<WeightKey> keys;
+};
+
+// メッシュに付随するアニメーション
+struct MeshAnim {
+  explicit MeshAnim(const ArenaRef& arena = ArenaRef())
+    : track(ArenaAllocator<MorphTrack>(arena))
+  {}
+
+  std::string mesh_name;
+  ArenaVector<MorphTrack> track;
 };
 
+// 生成したアニメーションの通し番号
+//   展開し直したアニメーションが同じアドレスに置かれても区別できるようにする
+std::atomic<u_int> anim_serial_count(0);
+
 struct Anim {
+  explicit Anim(const ArenaRef& arena = ArenaRef())
+    : serial(++anim_serial_count),
+      body(ArenaAllocator<NodeAnim>(arena)),
+      mesh_body(ArenaAllocator<MeshAnim>(arena))
+  {}
+
+  u_int serial;
+
   double duration;
-  std::vector<NodeAnim> body;
+  ArenaVector<NodeAnim> body;
+  ArenaVector<MeshAnim> mesh_body;
 };
 
 
@@ -54,7 +104,7 @@ struct Comp {
 
 
 // キーフレームから直線補間した値を取り出す
-ci::Vec3f getLerpValue(const double time, const std::vector<VectorKey>& values) {
+ci::Vec3f getLerpValue(const double time, const ArenaVector<VectorKey>& values) {
   // 適用キー位置を探す
   auto result = std::upper_bound(values.begin(), values.end(),
                                  time, Comp<VectorKey>());
@@ -78,7 +128,7 @@ ci::Vec3f getLerpValue(const double time, const std::vector<VectorKey>& values)
   return value;
 }
 
-ci::Quatf getLerpValue(const double time, const std::vector<QuatKey>& values) {
+ci::Quatf getLerpValue(const double time, const ArenaVector<QuatKey>& values) {
   auto result = std::upper_bound(values.begin(), values.end(),
                                  time, Comp<QuatKey>());
 
@@ -102,12 +152,40 @@ ci::Quatf getLerpValue(const double time, const std::vector<QuatKey>& values) {
 }
 
 
+float getLerpValue(const double time, const ArenaVector<WeightKey>& values) {
+  auto result = std::upper_bound(values.begin(), values.end(),
+                                 time, Comp<WeightKey>());
+
+  float value;
+  if (result == values.begin()) {
+    // 先頭より小さい時間
+    value = result->value;
+  }
+  else if (result == values.end()) {
+    // 最後尾より大きい時間
+    value = (result - 1)->value;
+  }
+  else {
+    // 直線補間
+    double dt = result->time - (result - 1)->time;
+    double t  = time - (result - 1)->time;
+    value = (result - 1)->value + ((result->value - (result - 1)->value) * float(t / dt));
+  }
+
+  return value;
+}
+
+
 // ノードに付随するアニメーション情報を作成
-NodeAnim createNodeAnim(const aiNodeAnim* anim) {
-  NodeAnim animation;
+NodeAnim createNodeAnim(const aiNodeAnim* anim, const ArenaRef& arena) {
+  NodeAnim animation(arena);
 
   animation.node_name = anim->mNodeName.C_Str();
 
+  animation.translate.reserve(anim->mNumPositionKeys);
+  animation.scaling.reserve(anim->mNumScalingKeys);
+  animation.rotation.reserve(anim->mNumRotationKeys);
+
   // 平行移動
   for (u_int i = 0; i < anim->mNumPositionKeys; ++i) {
     animation.translate.push_back(fromAssimp(anim->mPositionKeys[i]));
@@ -126,9 +204,66 @@ NodeAnim createNodeAnim(const aiNodeAnim* anim) {
   return animation;
 }
 
+// メッシュに付随するアニメーション情報を作成
+//   各キーは表示するモーフターゲットを一つ指定するので
+//   指定されたターゲットのウェイトが1、それ以外が0のウェイトトラックに変換する
+//   キーの間は直線補間されるので、ターゲット同士がクロスフェードする
+MeshAnim createMeshAnim(const aiMeshAnim* anim, const ArenaRef& arena) {
+  MeshAnim animation(arena);
+
+  animation.mesh_name = anim->mName.C_Str();
+
+  std::set<u_int> targets;
+  for (u_int i = 0; i < anim->mNumKeys; ++i) {
+    targets.insert(anim->mKeys[i].mValue);
+  }
+
+  animation.track.reserve(targets.size());
+  for (auto target : targets) {
+    MorphTrack track(arena);
+    track.target = target;
+
+    track.keys.reserve(anim->mNumKeys);
+    for (u_int i = 0; i < anim->mNumKeys; ++i) {
+      const auto& key = anim->mKeys[i];
+      track.keys.push_back({ key.mTime, (key.mValue == target) ? 1.0f : 0.0f });
+    }
+    animation.track.push_back(std::move(track));
+  }
+
+  return animation;
+}
+
+// 展開後のキーフレームに必要なサイズを見積もる
+size_t estimateAnimationSize(const aiAnimation* anim) {
+  // アラインメントの分、少し多めに取っておく
+  const size_t margin = 64;
+
+  size_t size = anim->mNumChannels * sizeof(NodeAnim) + margin;
+  for (u_int i = 0; i < anim->mNumChannels; ++i) {
+    const aiNodeAnim* node_anim = anim->mChannels[i];
+    size += (node_anim->mNumPositionKeys + node_anim->mNumScalingKeys) * sizeof(VectorKey)
+          + node_anim->mNumRotationKeys * sizeof(QuatKey)
+          + margin * 3;
+  }
+
+  size += anim->mNumMeshChannels * sizeof(MeshAnim) + margin;
+  for (u_int i = 0; i < anim->mNumMeshChannels; ++i) {
+    // ターゲットごとに全キー分のウェイトを持つ
+    const aiMeshAnim* mesh_anim = anim->mMeshChannels[i];
+    std::set<u_int> targets;
+    for (u_int k = 0; k < mesh_anim->mNumKeys; ++k) {
+      targets.insert(mesh_anim->mKeys[k].mValue);
+    }
+    size += targets.size() * (sizeof(MorphTrack) + mesh_anim->mNumKeys * sizeof(WeightKey) + margin) + margin;
+  }
+
+  return size;
+}
+
 // アニメーション情報を作成
-Anim createAnimation(const aiAnimation* anim) {
-  Anim animation;
+Anim createAnimation(const aiAnimation* anim, const ArenaRef& arena) {
+  Anim animation(arena);
 
   animation.duration = anim->mDuration;
 
@@ -137,8 +272,9 @@ Anim createAnimation(const aiAnimation* anim) {
     ci::app::console() << "Node anim:" << anim->mNumChannels << std::endl;
 
     aiNodeAnim** node_anim = anim->mChannels;
+    animation.body.reserve(anim->mNumChannels);
     for (u_int i = 0; i < anim->mNumChannels; ++i) {
-      animation.body.push_back(createNodeAnim(node_anim[i]));
+      animation.body.push_back(createNodeAnim(node_anim[i], arena));
     }
   }
 
@@ -146,13 +282,130 @@ Anim createAnimation(const aiAnimation* anim) {
     // メッシュアニメーション
     ci::app::console() << "Mesh anim:" << anim->mNumMeshChannels << std::endl;
 
-#if 0
     aiMeshAnim** mesh_anim = anim->mMeshChannels;
+    animation.mesh_body.reserve(anim->mNumMeshChannels);
     for (u_int i = 0; i < anim->mNumMeshChannels; ++i) {
-
+      animation.mesh_body.push_back(createMeshAnim(mesh_anim[i], arena));
     }
-#endif
   }
 
   return animation;
 }
+
+
+// 最終的なボーン行列を一定間隔でベイクしたもの
+//   再生時は前後のフレームの行列を補間してそのままスキニングに使う
+//   ノード階層の計算が不要になる
+struct PaletteBake {
+  PaletteBake()
+    : duration(0.0),
+      rate(30.0),
+      frame_num(0),
+      bone_num(0),
+      morph_num(0),
+      bytes(0)
+  {}
+
+  double duration;
+  // 単位時間あたりのフレーム数
+  double rate;
+  u_int frame_num;
+
+  // 1フレームあたりの行列数(スキニングする全メッシュのボーン数の合計)
+  u_int bone_num;
+
+  // メッシュを持つノード(Model::node_list の位置)と、その行列 [フレーム][ノード]
+  std::vector<u_int> node;
+  std::vector<Affine> node_matrix;
+
+  // ボーン行列 [フレーム][ボーン]
+  //   node_list、Node::mesh、Mesh::bones 順
+  std::vector<Affine> palette;
+
+  // モーフターゲットのウェイト [フレーム][ターゲット]
+  //   node_list、Node::mesh、Mesh::morph 順
+  u_int morph_num;
+  std::vector<float> morph_weight;
+
+  size_t bytes;
+};
+
+// 一定間隔のフレームから、補間する二つのフレームと割合を求める
+//   最後のフレームの次は先頭に戻る
+void getBakedFrame(const double duration, const double rate, const u_int frame_num, const double time,
+                   u_int& frame0, u_int& frame1, float& alpha) {
+  double current_time = std::fmod(time, duration);
+  if (current_time < 0.0) current_time += duration;
+
+  frame0 = std::min(u_int(current_time * rate), frame_num - 1);
+  frame1 = (frame0 + 1) % frame_num;
+
+  double begin_time = frame0 / rate;
+  double end_time   = std::min((frame0 + 1) / rate, duration);
+  alpha = (end_time > begin_time) ? float((current_time - begin_time) / (end_time - begin_time)) : 0.0f;
+}
+
+
+// 登録済みのアニメーション
+//   読み込み時は情報だけを登録しておき、初めて使う時に展開する
+//   展開したデータはアニメーションごとのアリーナに置くので、追い出す時はまとめて解放される
+struct AnimClip {
+  AnimClip()
+    : duration(0.0),
+      channel_num(0),
+      bytes(0),
+      source(nullptr),
+      last_use(0)
+  {}
+
+  std::string name;
+  double duration;
+  u_int channel_num;
+
+  // 展開後のサイズ(見積もり)
+  size_t bytes;
+
+  // 展開元(モデルが保持しているaiSceneの一部)
+  const aiAnimation* source;
+  // 展開結果を他のモデルと共有する時のキー(空なら共有しない)
+  std::string cache_key;
+  // 展開元を持つaiScene(ライブラリから束縛したアニメーションの場合)
+  std::shared_ptr<const aiScene> owner;
+
+  // チャンネルが書き換えるノード(Model::node_list の位置)
+  //   骨格が同じモデル同士では同じ表を共有する(nullなら名前で探す)
+  std::shared_ptr<const std::vector<u_int> > channel_node;
+
+  // 展開済みのデータ(未展開ならnull)
+  std::shared_ptr<const Anim> body;
+  u_int last_use;
+
+  // ボーン行列のベイク結果(無ければnull)
+  //   キーフレームを追い出しても残す
+  std::shared_ptr<const PaletteBake> palette;
+};
+
+// アニメーションを登録
+AnimClip registerAnimation(const aiAnimation* anim) {
+  AnimClip clip;
+
+  clip.name        = anim->mName.C_Str();
+  clip.duration    = anim->mDuration;
+  clip.channel_num = anim->mNumChannels;
+  clip.bytes       = estimateAnimationSize(anim);
+  clip.source      = anim;
+
+  ci::app::console() << "Anim:" << clip.name
+                     << " duration:" << clip.duration
+                     << " channels:" << clip.channel_num << std::endl;
+
+  return clip;
+}
+
+// アニメーションを展開
+void decodeAnimation(AnimClip& clip) {
+  if (clip.body) return;
+
+  auto arena = std::make_shared<Arena>(clip.bytes);
+  clip.body = std::make_shared<Anim>(createAnimation(clip.source, arena));
+}
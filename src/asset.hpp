@@ -0,0 +1,281 @@
+﻿#pragma once
+
+//
+// 複数のモデルで共有する素材
+//   同じファイルから作ったテクスチャ、マテリアル、アニメーションを使い回す
+//   キーはファイルの正規化したパスと内容のハッシュ値なので、書き換えられたファイルは別物として扱う
+//   キャッシュは弱参照だけを持つので、最後の利用者が手放した時点で解放される
+//
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <memory>
+#include <sstream>
+#include <ostream>
+#include <cstdint>
+#include <cinder/Filesystem.h>
+#include <cinder/gl/Texture.h>
+#include <assimp/scene.h>
+#include "misc.hpp"
+#include "allocator.hpp"
+#include "affine.hpp"
+#include "compressed.hpp"
+#include "texture.hpp"
+#include "material.hpp"
+#include "animation.hpp"
+
+
+struct AssetCache {
+  AssetCache()
+    : hit(0),
+      miss(0)
+  {}
+
+  // パイプラインのスレッドからもアニメーションを展開するので、排他する
+  std::mutex mutex;
+
+  std::map<std::string, std::weak_ptr<TextureSlot> > texture;
+  std::map<std::string, std::weak_ptr<const Material> > material;
+  std::map<std::string, std::weak_ptr<const Anim> > anim;
+  // アニメーションの展開元
+  std::map<std::string, std::weak_ptr<const aiScene> > scene;
+
+  u_int hit;
+  u_int miss;
+};
+
+// プロセスで一つだけ
+AssetCache& getAssetCache() {
+  static AssetCache cache;
+  return cache;
+}
+
+
+// ファイルの内容のハッシュ値(FNV-1a 64bit)
+//   読めなければ0
+uint64_t hashFileContent(const std::string& path) {
+  MappedFile file(path);
+  if (!file.isValid()) return 0;
+
+  uint64_t hash = 14695981039346656037ULL;
+  const uint8_t* p = file.data();
+  for (size_t i = 0; i < file.getSize(); ++i) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+// キャッシュのキー
+//   ex) /abs/path/hoge.png#0123456789abcdef
+//   ファイルが無ければ空(キャッシュしない)
+std::string getAssetKey(const std::string& path) {
+  uint64_t hash = hashFileContent(path);
+  if (!hash) return std::string();
+
+  ci::fs::path canonical_path = ci::fs::absolute(ci::fs::path(path));
+  try {
+    canonical_path = ci::fs::canonical(canonical_path);
+  }
+  catch (...) {
+    // 正規化できなくても、絶対パスのまま使う
+  }
+
+  std::ostringstream key;
+  key << canonical_path.string() << '#' << std::hex;
+  key.width(16);
+  key.fill('0');
+  key << hash;
+  return key.str();
+}
+
+// モデルファイルのキー
+//   Assimpの後処理によってマテリアルやアニメーションの並びが変わるので、後処理の指定も含める
+//   ex) /abs/path/hoge.fbx#0123456789abcdef@0008a84b
+std::string getSceneKey(const std::string& path, const u_int flags) {
+  std::string key = getAssetKey(path);
+  if (key.empty()) return key;
+
+  std::ostringstream scene_key;
+  scene_key << key << '@' << std::hex;
+  scene_key.width(8);
+  scene_key.fill('0');
+  scene_key << flags;
+  return scene_key.str();
+}
+
+// 生きていれば共有ポインタを返す
+//   利用者がいなくなったものはここで取り除く
+template <typename T>
+std::shared_ptr<T> findAsset(std::map<std::string, std::weak_ptr<T> >& assets, const std::string& key) {
+  auto it = assets.find(key);
+  if (it == assets.end()) return std::shared_ptr<T>();
+
+  auto asset = it->second.lock();
+  if (!asset) assets.erase(it);
+  return asset;
+}
+
+// 利用者がいなくなったものをまとめて取り除く
+template <typename Map>
+void pruneAssets(Map& assets) {
+  for (auto it = assets.begin(); it != assets.end(); ) {
+    if (it->second.expired()) {
+      it = assets.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+void pruneAssetCache() {
+  auto& cache = getAssetCache();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+
+  pruneAssets(cache.texture);
+  pruneAssets(cache.material);
+  pruneAssets(cache.anim);
+  pruneAssets(cache.scene);
+}
+
+
+// テクスチャのキー
+//   path は loadModelTexture と同じ指定
+std::string getTextureKey(const std::string& path) {
+#if defined (USE_FULL_PATH)
+  return getAssetKey(path);
+#else
+  return getAssetKey(ci::app::getAssetPath(path).string());
+#endif
+}
+
+// 共有しているテクスチャを探す
+TextureSlotRef findSharedTexture(const std::string& key) {
+  if (key.empty()) return TextureSlotRef();
+
+  auto& cache = getAssetCache();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  auto slot = findAsset(cache.texture, key);
+  if (slot) cache.hit += 1;
+  return slot;
+}
+
+void storeSharedTexture(const std::string& key, const TextureSlotRef& slot) {
+  if (key.empty()) return;
+
+  auto& cache = getAssetCache();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  cache.miss += 1;
+  cache.texture[key] = slot;
+}
+
+// テクスチャを共有して読み込む
+//   path は loadModelTexture と同じ指定
+TextureSlotRef loadSharedTexture(const std::string& path) {
+  std::string key = getTextureKey(path);
+  auto slot = findSharedTexture(key);
+  if (slot) {
+    ci::app::console() << "Texture shared:" << path << std::endl;
+    return slot;
+  }
+
+  slot = std::make_shared<TextureSlot>();
+  slot->texture  = loadModelTexture(path, slot->bytes);
+  slot->resident = true;
+  storeSharedTexture(key, slot);
+
+  return slot;
+}
+
+// マテリアルを共有して作る
+//   model_key はマテリアルを持つモデルファイルのキー
+std::shared_ptr<const Material> createSharedMaterial(const std::string& model_key, const u_int index,
+                                                     const aiMaterial* const mat) {
+  std::string key = model_key.empty() ? std::string() : model_key + "/material" + std::to_string(index);
+  auto& cache = getAssetCache();
+
+  if (!key.empty()) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto material = findAsset(cache.material, key);
+    if (material) {
+      cache.hit += 1;
+      return material;
+    }
+  }
+
+  auto material = std::make_shared<Material>(createMaterial(mat));
+  if (!key.empty()) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.miss += 1;
+    cache.material[key] = material;
+  }
+
+  return material;
+}
+
+// アニメーションの展開元を共有する
+//   既に同じファイルを読んだモデルがあればそれを返し、無ければ scene を登録する
+std::shared_ptr<const aiScene> shareAnimationSource(const std::string& model_key,
+                                                    const std::shared_ptr<const aiScene>& scene) {
+  if (model_key.empty()) return scene;
+
+  auto& cache = getAssetCache();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  auto shared = findAsset(cache.scene, model_key);
+  if (shared) {
+    cache.hit += 1;
+    return shared;
+  }
+
+  cache.miss += 1;
+  cache.scene[model_key] = scene;
+  return scene;
+}
+
+// アニメーションを展開
+//   同じファイルの同じアニメーションを展開済みのモデルがあれば、それを共有する
+void decodeSharedAnimation(AnimClip& clip) {
+  if (clip.body) return;
+
+  auto& cache = getAssetCache();
+  if (!clip.cache_key.empty()) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto body = findAsset(cache.anim, clip.cache_key);
+    if (body) {
+      cache.hit += 1;
+      clip.body = body;
+      return;
+    }
+  }
+
+  // 展開には時間がかかるので、排他の外で行う
+  decodeAnimation(clip);
+  if (!clip.cache_key.empty()) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.miss += 1;
+    cache.anim[clip.cache_key] = clip.body;
+  }
+}
+
+
+void printAssetCache(std::ostream& out) {
+  pruneAssetCache();
+
+  auto& cache = getAssetCache();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+
+  size_t texture_bytes = 0;
+  for (const auto& it : cache.texture) {
+    auto slot = it.second.lock();
+    if (slot) texture_bytes += slot->bytes;
+  }
+
+  out << "Asset cache: texture " << cache.texture.size() << " (" << texture_bytes << " bytes)"
+      << " material " << cache.material.size()
+      << " anim " << cache.anim.size()
+      << " scene " << cache.scene.size()
+      << " hit " << cache.hit << " miss " << cache.miss << std::endl;
+}
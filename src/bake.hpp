@@ -0,0 +1,288 @@
+﻿#pragma once
+
+//
+// 頂点アニメーションのベイク
+//   一定間隔でアニメーションを評価し、スキニング結果をフレームごとに保存しておく
+//   再生時は前後のフレームを補間するだけなので、階層の計算もスキニングも不要になる
+//   座標はクリップ全体のAABB基準、法線は-1〜1を、それぞれ16bitに量子化する
+//
+// 頂点数が少なく、短いループを大量に配置する場合に向いている
+// メモリ使用量と処理時間の比較を出力するので、アセットごとに使うか判断する
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "model.hpp"
+
+
+// スキニングするメッシュ一つ分
+struct BakedMesh {
+  u_int vertex_begin;
+  u_int vertex_end;
+  bool has_normal;
+
+  // 量子化の基準
+  ci::Vec3f bounds_min;
+  ci::Vec3f bounds_scale;
+
+  // [フレーム][頂点][xyz]
+  std::vector<uint16_t> position;
+  std::vector<int16_t>  normal;
+};
+
+struct VertexBake {
+  VertexBake()
+    : clip(0),
+      duration(0.0),
+      rate(30.0),
+      frame_num(0),
+      bytes(0),
+      source_bytes(0),
+      bake_seconds(0.0),
+      eval_seconds(0.0),
+      play_seconds(0.0),
+      max_error(0.0f)
+  {}
+
+  size_t clip;
+  double duration;
+  // 単位時間あたりのフレーム数(アニメーションと同じ時間単位)
+  double rate;
+  u_int frame_num;
+
+  // メッシュを持つノードの行列 [フレーム][ノード]
+  std::vector<u_int> node;
+  std::vector<Affine> node_matrix;
+
+  // スキニングするメッシュを node_list、Node::mesh 順に並べたもの
+  std::vector<BakedMesh> mesh;
+
+  // 統計
+  size_t bytes;
+  size_t source_bytes;
+  double bake_seconds;
+  // 1フレームあたりの処理時間(通常の評価、ベイク結果の再生)
+  double eval_seconds;
+  double play_seconds;
+  // 座標の量子化誤差の最大値
+  float max_error;
+};
+
+
+uint16_t quantizeUnsigned(const float value, const float scale) {
+  if (scale <= 0.0f) return 0;
+  float q = std::round(value / scale);
+  return uint16_t(std::min(std::max(q, 0.0f), 65535.0f));
+}
+
+int16_t quantizeSigned(const float value) {
+  float q = std::round(value * 32767.0f);
+  return int16_t(std::min(std::max(q, -32767.0f), 32767.0f));
+}
+
+// ベイク結果で頂点とノードを更新する
+//   結果はSkinBufferに書き出すので、描画はそのまま行える
+void playVertexBake(Model& model, const VertexBake& bake, const double time) {
+  u_int frame0;
+  u_int frame1;
+  float alpha;
+  getBakedFrame(bake.duration, bake.rate, bake.frame_num, time, frame0, frame1, alpha);
+
+  size_t node_num = bake.node.size();
+  for (size_t i = 0; i < node_num; ++i) {
+    model.node_list[bake.node[i]]->global_matrix = lerpAffine(bake.node_matrix[frame0 * node_num + i],
+                                                              bake.node_matrix[frame1 * node_num + i],
+                                                              alpha);
+  }
+
+  size_t mesh_index = 0;
+  for (const auto& node : model.node_list) {
+    for (auto& mesh : node->mesh) {
+      if (!isDynamicMesh(mesh)) continue;
+
+      // ベイクした時とメッシュの並びが変わっていないこと
+      assert(mesh_index < bake.mesh.size());
+      const auto& baked = bake.mesh[mesh_index];
+      mesh_index += 1;
+      assert(baked.vertex_end <= mesh.skin.getBack().size());
+
+      // 頂点の無い範囲では配列が空なので、添字ではなく先頭からのオフセットで指す
+      u_int vertex_num = baked.vertex_end - baked.vertex_begin;
+      const uint16_t* p0 = baked.position.data() + size_t(frame0) * vertex_num * 3;
+      const uint16_t* p1 = baked.position.data() + size_t(frame1) * vertex_num * 3;
+
+      auto& skin_vtx = mesh.skin.getBack();
+      for (u_int v = 0; v < vertex_num; ++v) {
+        auto& dst = skin_vtx[baked.vertex_begin + v];
+        for (int j = 0; j < 3; ++j) {
+          float q = p0[v * 3 + j] + (p1[v * 3 + j] - p0[v * 3 + j]) * alpha;
+          dst.position[j] = baked.bounds_min[j] + q * baked.bounds_scale[j];
+        }
+      }
+
+      if (baked.has_normal) {
+        const int16_t* n0 = baked.normal.data() + size_t(frame0) * vertex_num * 3;
+        const int16_t* n1 = baked.normal.data() + size_t(frame1) * vertex_num * 3;
+        for (u_int v = 0; v < vertex_num; ++v) {
+          auto& dst = skin_vtx[baked.vertex_begin + v];
+          for (int j = 0; j < 3; ++j) {
+            float q = n0[v * 3 + j] + (n1[v * 3 + j] - n0[v * 3 + j]) * alpha;
+            dst.normal[j] = q * (1.0f / 32767.0f);
+          }
+        }
+      }
+
+      // クリップ全体の範囲をそのまま使う
+      mesh.bounds.min = baked.bounds_min;
+      mesh.bounds.max = baked.bounds_min + baked.bounds_scale * 65535.0f;
+      mesh.skin_pending = false;
+
+      mesh.skin.use_blend = false;
+      mesh.skin_history[mesh.skin.front ^ 1].valid = false;
+      mesh.skin.swap(baked.vertex_begin, baked.vertex_end);
+    }
+  }
+}
+
+
+// ベイク
+//   updateModelで全フレームを評価し、その結果を量子化して保存する
+//   モデルのノードとスキニング結果は書き換わる
+VertexBake bakeVertexAnimation(Model& model, const size_t clip, const double rate) {
+  assert(model.has_anim);
+  assert(rate > 0.0);
+
+  auto start = std::chrono::steady_clock::now();
+
+  VertexBake bake;
+  bake.clip      = clip;
+  bake.duration  = getAnimation(model, clip)->duration;
+  bake.rate      = rate;
+  bake.frame_num = std::max(u_int(std::ceil(bake.duration * rate)), u_int(1));
+
+  for (u_int i = 0; i < model.node_list.size(); ++i) {
+    if (!model.node_list[i]->mesh.empty()) bake.node.push_back(i);
+  }
+
+  // 量子化の前に、一旦浮動小数のまま全フレーム分を集める
+  std::vector<std::vector<SkinVertex> > frames;
+  for (const auto& node : model.node_list) {
+    for (const auto& mesh : node->mesh) {
+      if (!isDynamicMesh(mesh)) continue;
+
+      BakedMesh baked;
+      baked.vertex_begin = mesh.skin_begin;
+      baked.vertex_end   = mesh.skin_end;
+      baked.has_normal   = mesh.body.hasNormals();
+      bake.mesh.push_back(baked);
+      frames.emplace_back();
+      frames.back().reserve(size_t(mesh.skin_end - mesh.skin_begin) * bake.frame_num);
+    }
+  }
+
+  // 全てのメッシュをスキニングさせる
+  Frustum frustum = model.frustum;
+  model.frustum = Frustum();
+
+  double eval_seconds = 0.0;
+  for (u_int f = 0; f < bake.frame_num; ++f) {
+    auto eval_start = std::chrono::steady_clock::now();
+    updateModel(model, f / rate, clip);
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - eval_start;
+    eval_seconds += dt.count();
+
+    for (auto i : bake.node) {
+      bake.node_matrix.push_back(model.node_list[i]->global_matrix);
+    }
+
+    size_t mesh_index = 0;
+    for (const auto& node : model.node_list) {
+      for (const auto& mesh : node->mesh) {
+        if (!isDynamicMesh(mesh)) continue;
+
+        const auto& skin_vtx = mesh.skin.getFront();
+        frames[mesh_index].insert(frames[mesh_index].end(),
+                                  skin_vtx.begin() + mesh.skin_begin, skin_vtx.begin() + mesh.skin_end);
+        mesh_index += 1;
+      }
+    }
+  }
+  bake.eval_seconds = eval_seconds / bake.frame_num;
+  model.frustum = frustum;
+
+  // 量子化
+  for (size_t m = 0; m < bake.mesh.size(); ++m) {
+    auto& baked = bake.mesh[m];
+    const auto& src = frames[m];
+    if (src.empty()) continue;
+
+    ci::Vec3f min_pos = src[0].position;
+    ci::Vec3f max_pos = src[0].position;
+    for (const auto& v : src) {
+      for (int j = 0; j < 3; ++j) {
+        min_pos[j] = std::min(min_pos[j], v.position[j]);
+        max_pos[j] = std::max(max_pos[j], v.position[j]);
+      }
+    }
+    baked.bounds_min   = min_pos;
+    baked.bounds_scale = (max_pos - min_pos) / 65535.0f;
+
+    baked.position.reserve(src.size() * 3);
+    if (baked.has_normal) baked.normal.reserve(src.size() * 3);
+    for (const auto& v : src) {
+      for (int j = 0; j < 3; ++j) {
+        uint16_t q = quantizeUnsigned(v.position[j] - min_pos[j], baked.bounds_scale[j]);
+        baked.position.push_back(q);
+
+        float error = std::abs(min_pos[j] + q * baked.bounds_scale[j] - v.position[j]);
+        bake.max_error = std::max(bake.max_error, error);
+      }
+
+      if (baked.has_normal) {
+        ci::Vec3f n = v.normal.safeNormalized();
+        for (int j = 0; j < 3; ++j) {
+          baked.normal.push_back(quantizeSigned(n[j]));
+        }
+      }
+    }
+
+    bake.bytes += baked.position.size() * sizeof(uint16_t) + baked.normal.size() * sizeof(int16_t);
+    bake.source_bytes += src.size() * sizeof(SkinVertex);
+  }
+  bake.bytes += bake.node_matrix.size() * sizeof(Affine);
+
+  // 再生の処理時間
+  auto play_start = std::chrono::steady_clock::now();
+  for (u_int f = 0; f < bake.frame_num; ++f) {
+    playVertexBake(model, bake, (f + 0.5) / rate);
+  }
+  std::chrono::duration<double> play_dt = std::chrono::steady_clock::now() - play_start;
+  bake.play_seconds = play_dt.count() / bake.frame_num;
+
+  std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+  bake.bake_seconds = dt.count();
+
+  return bake;
+}
+
+// メモリと処理時間の比較を出力
+void printVertexBakeInfo(const VertexBake& bake) {
+  size_t vertex_num = 0;
+  for (const auto& mesh : bake.mesh) {
+    vertex_num += mesh.vertex_end - mesh.vertex_begin;
+  }
+
+  ci::app::console() << "Vertex bake: clip:" << bake.clip
+                     << " frames:" << bake.frame_num
+                     << " rate:" << bake.rate
+                     << " vertices:" << vertex_num << std::endl
+                     << "  memory:" << bake.bytes << " bytes"
+                     << " (float:" << bake.source_bytes << " bytes)" << std::endl
+                     << "  eval:" << bake.eval_seconds * 1000.0 << " ms/frame"
+                     << " play:" << bake.play_seconds * 1000.0 << " ms/frame" << std::endl
+                     << "  max error:" << bake.max_error
+                     << " bake time:" << bake.bake_seconds << " s" << std::endl;
+}
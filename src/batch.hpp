@@ -0,0 +1,107 @@
+﻿#pragma once
+
+//
+// 静的メッシュのまとめ描画
+//   アニメーションで動かないノードの、骨もモーフターゲットも持たないメッシュを
+//   読み込み時にモデル空間へ変換して、マテリアルごとに大きなメッシュへまとめる
+//   ノードごとの行列の積み下ろしと描画命令が、まとめた数だけで済む
+//   ピッキング用に、三角形の範囲から元のノードとメッシュを引けるようにしておく
+//
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "misc.hpp"
+#include "affine.hpp"
+#include "mesh.hpp"
+
+
+// 一つにまとめる頂点数の上限
+//   大きすぎるとカリングが効かなくなる
+const u_int STATIC_BATCH_VERTEX_MAX = 65536;
+
+
+// まとめる前のメッシュ
+struct BatchSource {
+  // Model::node_list の位置と、まとめる前の Node::mesh の位置
+  u_int node;
+  u_int mesh;
+  std::string name;
+
+  // まとめたメッシュでの三角形の範囲 [begin, end)
+  u_int triangle_begin;
+  u_int triangle_end;
+};
+
+struct StaticBatch {
+  // 頂点はモデル空間
+  Mesh mesh;
+
+  // 三角形の並び順
+  std::vector<BatchSource> source;
+};
+
+
+// まとめられるメッシュの種類
+//   マテリアルと、頂点が持つ要素が同じものだけを一つにできる
+u_int getBatchKey(const Mesh& mesh) {
+  return (mesh.material_index << 3)
+         | (mesh.body.hasNormals()     ? 1 : 0)
+         | (mesh.body.hasTexCoords()   ? 2 : 0)
+         | (mesh.body.hasColorsRGBA()  ? 4 : 0);
+}
+
+// 法線の変換
+//   拡大縮小が均一でなくても垂直を保つよう、逆行列の転置を掛ける
+ci::Vec3f transformNormal(const Affine& invert, const ci::Vec3f& n) {
+  ci::Vec3f r{ invert.m[0][0] * n.x + invert.m[1][0] * n.y + invert.m[2][0] * n.z,
+               invert.m[0][1] * n.x + invert.m[1][1] * n.y + invert.m[2][1] * n.z,
+               invert.m[0][2] * n.x + invert.m[1][2] * n.y + invert.m[2][2] * n.z };
+  float length = r.length();
+  return (length > 0.0f) ? r / length : r;
+}
+
+// 行列で変換したメッシュを末尾へ追加する
+//   invert は matrix の逆行列
+//   鏡像になる行列では三角形の向きが裏返るので、頂点の順番を入れ替える
+void appendBatchMesh(StaticBatch& batch, const Mesh& src, const Affine& matrix, const Affine& invert,
+                     const BatchSource& source) {
+  auto& dst = batch.mesh.body;
+  u_int base = u_int(dst.getNumVertices());
+
+  for (const auto& v : src.body.getVertices()) {
+    dst.getVertices().push_back(matrix.transformPoint(v));
+  }
+  for (const auto& n : src.body.getNormals()) {
+    dst.getNormals().push_back(transformNormal(invert, n));
+  }
+  const auto& uv = src.body.getTexCoords();
+  dst.getTexCoords().insert(dst.getTexCoords().end(), uv.begin(), uv.end());
+  const auto& color = src.body.getColorsRGBA();
+  dst.getColorsRGBA().insert(dst.getColorsRGBA().end(), color.begin(), color.end());
+
+  float det = matrix.m[0][0] * (matrix.m[1][1] * matrix.m[2][2] - matrix.m[1][2] * matrix.m[2][1])
+            - matrix.m[0][1] * (matrix.m[1][0] * matrix.m[2][2] - matrix.m[1][2] * matrix.m[2][0])
+            + matrix.m[0][2] * (matrix.m[1][0] * matrix.m[2][1] - matrix.m[1][1] * matrix.m[2][0]);
+
+  const auto& indices = src.body.getIndices();
+  auto& dst_indices = dst.getIndices();
+  for (size_t i = 0; (i + 2) < indices.size(); i += 3) {
+    dst_indices.push_back(base + indices[i]);
+    dst_indices.push_back(base + indices[(det < 0.0f) ? (i + 2) : (i + 1)]);
+    dst_indices.push_back(base + indices[(det < 0.0f) ? (i + 1) : (i + 2)]);
+  }
+
+  BatchSource s = source;
+  s.triangle_end = u_int(dst_indices.size() / 3);
+  s.triangle_begin = s.triangle_end - u_int(indices.size() / 3);
+  batch.source.push_back(s);
+}
+
+// 三角形を含む元のメッシュ
+const BatchSource& findBatchSource(const StaticBatch& batch, const u_int triangle) {
+  auto it = std::upper_bound(batch.source.begin(), batch.source.end(), triangle,
+                             [](const u_int t, const BatchSource& s) { return t < s.triangle_end; });
+  assert(it != batch.source.end());
+  return *it;
+}
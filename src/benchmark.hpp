@@ -0,0 +1,425 @@
+﻿#pragma once
+
+//
+// アニメーションと読み込み処理のベンチマーク
+//   ボーン数、頂点数、キー数、1頂点あたりのウェイト数を変えた合成モデルで各処理を計測する
+//   GLは使わないので、描画とは無関係に実行できる
+//   結果はJSONで書き出し、以前の結果(ベースライン)と比べて遅くなったものを報告する
+//
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "model.hpp"
+
+
+// 合成モデルの規模
+struct BenchWorkload {
+  u_int bones;
+  u_int vertices;
+  u_int keys;
+  u_int influences;
+};
+
+std::vector<BenchWorkload> getBenchWorkloads() {
+  return std::vector<BenchWorkload>{
+    {  16,   2000,  30, 2 },
+    {  64,  20000, 120, 4 },
+    { 128, 100000, 480, 4 },
+  };
+}
+
+std::string getBenchWorkloadName(const BenchWorkload& workload) {
+  std::ostringstream str;
+  str << "b" << workload.bones
+      << "_v" << workload.vertices
+      << "_k" << workload.keys
+      << "_i" << workload.influences;
+  return str.str();
+}
+
+struct BenchResult {
+  std::string name;
+  std::string workload;
+
+  // 1回あたりの処理時間(秒)
+  double seconds;
+  u_int iterations;
+};
+
+struct BenchOptions {
+  BenchOptions()
+    : threshold(0.1)
+  {}
+
+  // 結果の書き出し先(空なら書き出さない)
+  std::string output;
+  // 比較するベースライン(空なら比較しない)
+  std::string baseline;
+  // この割合を超えて遅くなったら報告する
+  double threshold;
+
+  // loadModelを計測するモデル(空なら計測しない)
+  std::string model_path;
+};
+
+
+// 合成モデルを作る
+//   ボーンは二分木に並べ、全ボーンを持つメッシュを一つルートに置く
+//   キーフレームは全ボーン、全チャンネルに同じ数だけ打つ
+Model createBenchModel(const BenchWorkload& workload) {
+  assert(workload.bones > 0);
+  assert(workload.influences > 0);
+
+  Model model;
+  model.arena = std::make_shared<Arena>();
+
+  model.node = std::allocate_shared<Node>(ArenaAllocator<Node>(model.arena));
+  model.node->name = "root";
+
+  std::vector<std::shared_ptr<Node> > bone_node;
+  for (u_int i = 0; i < workload.bones; ++i) {
+    auto node = std::allocate_shared<Node>(ArenaAllocator<Node>(model.arena));
+    node->name   = "bone" + std::to_string(i);
+    node->matrix = composeAffine(ci::Vec3f{ 0.0f, 1.0f, 0.0f }, ci::Quatf::identity(), ci::Vec3f::one());
+    node->matrix_orig = node->matrix;
+
+    auto& parent = i ? bone_node[(i - 1) / 2] : model.node;
+    parent->children.push_back(node);
+    bone_node.push_back(node);
+  }
+
+  createNodeInfo(model.node, model.node_index, model.node_list);
+  model.node_parent = createNodeParent(model.node_list);
+  updateNodeDerivedMatrix(model.node, Affine::identity());
+
+  // 頂点は格子状に並べ、隣り合う頂点で三角形を作る
+  Mesh mesh;
+  mesh.name = "bench";
+  u_int width = std::max(u_int(std::sqrt(double(workload.vertices))), u_int(2));
+  for (u_int v = 0; v < workload.vertices; ++v) {
+    mesh.body.appendVertex(ci::Vec3f{ float(v % width), float(v / width), 0.0f });
+    mesh.body.appendNormal(ci::Vec3f{ 0.0f, 0.0f, 1.0f });
+  }
+  for (u_int v = 0; v + width + 1 < workload.vertices; ++v) {
+    if ((v % width) == width - 1) continue;
+    mesh.body.appendTriangle(v, v + 1, v + width);
+    mesh.body.appendTriangle(v + 1, v + width + 1, v + width);
+  }
+
+  mesh.has_bone = true;
+  for (u_int i = 0; i < workload.bones; ++i) {
+    Bone bone(model.arena);
+    bone.name   = bone_node[i]->name;
+    bone.offset = bone_node[i]->global_matrix.inverted();
+    mesh.bones.push_back(bone);
+  }
+
+  u_int influences = std::min(workload.influences, workload.bones);
+  for (u_int v = 0; v < workload.vertices; ++v) {
+    for (u_int k = 0; k < influences; ++k) {
+      // 同じ頂点に同じボーンが重ならないようにずらす
+      u_int bone = (v + k * 7) % workload.bones;
+      if (k && (bone == (v % workload.bones))) bone = (bone + 1) % workload.bones;
+      mesh.bones[bone].weights.push_back(Weight{ v, 1.0f / influences });
+    }
+  }
+  setupMesh(mesh);
+  model.node->mesh.push_back(std::move(mesh));
+
+  // アニメーション
+  auto animation = std::make_shared<Anim>(model.arena);
+  animation->duration = double(workload.keys);
+  for (u_int i = 0; i < workload.bones; ++i) {
+    NodeAnim node_anim(model.arena);
+    node_anim.node_name = bone_node[i]->name;
+    for (u_int k = 0; k < workload.keys; ++k) {
+      float t = float(k) / workload.keys;
+      node_anim.translate.push_back(VectorKey{ double(k), ci::Vec3f{ 0.0f, 1.0f + 0.1f * t, 0.0f } });
+      node_anim.scaling.push_back(VectorKey{ double(k), ci::Vec3f::one() });
+      node_anim.rotation.push_back(QuatKey{ double(k), ci::Quatf(ci::Vec3f::zAxis(), t) });
+    }
+    animation->body.push_back(node_anim);
+  }
+
+  AnimClip clip;
+  clip.name        = "bench";
+  clip.duration    = animation->duration;
+  clip.channel_num = workload.bones;
+  clip.body        = animation;
+  model.animation.push_back(clip);
+  model.has_anim = true;
+
+  return model;
+}
+
+
+// 計測
+//   1回の処理時間から、1回の計測が min_seconds 以上になるよう回数を決めて
+//   repeat 回計測したうちの最短を採用する
+//   ハードウェアカウンタの読み出しは時間に含めない
+template <typename Func>
+BenchResult runBench(const std::string& name, const std::string& workload, Func func,
+                     const double min_seconds = 0.02, const int repeat = 5) {
+  typedef std::chrono::steady_clock clock;
+  ScopedPerfSuspend suspend;
+
+  auto start = clock::now();
+  func();
+  std::chrono::duration<double> first = clock::now() - start;
+
+  u_int iterations = u_int(std::min(std::max(min_seconds / std::max(first.count(), 1.0e-9), 1.0), 1.0e6));
+
+  double best = std::numeric_limits<double>::max();
+  for (int r = 0; r < repeat; ++r) {
+    start = clock::now();
+    for (u_int i = 0; i < iterations; ++i) {
+      func();
+    }
+    std::chrono::duration<double> dt = clock::now() - start;
+    best = std::min(best, dt.count() / iterations);
+  }
+
+  ci::app::console() << "  " << name << " [" << workload << "]: "
+                     << best * 1000.0 << " ms (x" << iterations << ")" << std::endl;
+
+  return BenchResult{ name, workload, best, iterations };
+}
+
+// 合成モデルで各処理を計測
+void runModelBench(const BenchWorkload& workload, std::vector<BenchResult>& results) {
+  std::string name = getBenchWorkloadName(workload);
+  Model model = createBenchModel(workload);
+  const auto& animation = *model.animation[0].body;
+
+  {
+    // 時間は毎回ずらして、探索位置が偏らないようにする
+    const auto& keys = animation.body[0].rotation;
+    double time = 0.0;
+    volatile float sink = 0.0f;
+    results.push_back(runBench("getLerpValue", name, [&]() {
+          for (int i = 0; i < 1024; ++i) {
+            time = std::fmod(time + 0.37, animation.duration);
+            sink = sink + getLerpValue(time, keys).w;
+          }
+        }));
+  }
+
+  double time = 0.0;
+  results.push_back(runBench("updateNodeMatrix", name, [&]() {
+        time = std::fmod(time + 0.37, animation.duration);
+        updateNodeMatrix(model, time, animation);
+      }));
+
+  results.push_back(runBench("updateNodeDerivedMatrix", name, [&]() {
+        updateNodeDerivedMatrix(model.node, Affine::identity());
+      }));
+
+  // 全頂点のスキニング(差分スキニングを使わせない)
+  auto& mesh = model.node->mesh[0];
+  results.push_back(runBench("updateMesh", name, [&]() {
+        mesh.skin_history[0].valid = mesh.skin_history[1].valid = false;
+        updateMesh(model);
+      }));
+
+#if defined (USE_DELTA_SKINNING)
+  {
+    // 末端のボーンを一つだけ動かし続ける
+    auto& leaf = model.node_index.at(mesh.bones.back().name)->global_matrix;
+    float base = leaf.m[0][3];
+    u_int count = 0;
+    results.push_back(runBench("updateMesh(delta)", name, [&]() {
+          count = (count + 1) % 1000;
+          leaf.m[0][3] = base + 0.001f * count;
+          updateMesh(model);
+        }));
+  }
+#endif
+
+#if defined (WEIGHT_WORKAROUND)
+  results.push_back(runBench("normalizeMeshWeight", name, [&]() {
+        normalizeMeshWeight(model);
+      }));
+#endif
+
+  results.push_back(runBench("calcAABB", name, [&]() {
+        model.aabb = calcAABB(model);
+      }));
+}
+
+// 読み込みの段階ごとの処理時間
+//   読み込み自体が重いので、回数を決めて各段階の最短を採用する
+//   テクスチャは画像の展開までを計測し、GLへの転送は含めない
+void runLoadBench(const std::string& path, std::vector<BenchResult>& results, const int repeat = 3) {
+  std::string name = getFilename(path);
+  ScopedPerfSuspend suspend;
+
+  double best[LOAD_STAGE_NUM];
+  std::fill(std::begin(best), std::end(best), std::numeric_limits<double>::max());
+  for (int r = 0; r < repeat; ++r) {
+    Model model = loadModel(path, IMPORT_PRESET_STANDARD, nullptr, true);
+    for (int i = 0; i < LOAD_STAGE_NUM; ++i) {
+      best[i] = std::min(best[i], model.load_time[i]);
+    }
+  }
+
+  for (int i = 0; i < LOAD_STAGE_NUM; ++i) {
+    results.push_back(BenchResult{ std::string("loadModel/") + getLoadStageName(i), name, best[i], u_int(repeat) });
+    ci::app::console() << "  " << results.back().name << " [" << name << "]: " << best[i] * 1000.0 << " ms" << std::endl;
+  }
+}
+
+
+// { "benchmark": [ { "name": "...", "workload": "...", "seconds": n, "iterations": n }, ... ] }
+void writeBenchResultsJson(std::ostream& out, const std::vector<BenchResult>& results) {
+  // 読み込み直しても値が変わらない桁数で書き出す
+  auto precision = out.precision(9);
+
+  out << "{\"benchmark\":[" << std::endl;
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    out << "{\"name\":";
+    writeJsonString(out, r.name);
+    out << ",\"workload\":";
+    writeJsonString(out, r.workload);
+    out << ",\"seconds\":" << r.seconds
+        << ",\"iterations\":" << r.iterations << "}"
+        << ((i + 1 < results.size()) ? "," : "") << std::endl;
+  }
+  out << "]}" << std::endl;
+  out.precision(precision);
+}
+
+// "key" の後ろの値の位置を探す
+size_t findJsonValue(const std::string& text, const size_t pos, const std::string& key) {
+  size_t p = text.find("\"" + key + "\"", pos);
+  if (p == std::string::npos) return p;
+
+  p = text.find(':', p + key.size() + 2);
+  if (p == std::string::npos) return p;
+
+  return text.find_first_not_of(" \t\r\n", p + 1);
+}
+
+// writeBenchResultsJsonの出力を読み込む
+//   エスケープを含まない名前だけを想定した簡易的なもの
+std::vector<BenchResult> readBenchResultsJson(const std::string& text) {
+  std::vector<BenchResult> results;
+
+  size_t pos = 0;
+  while (true) {
+    size_t name = findJsonValue(text, pos, "name");
+    if ((name == std::string::npos) || (text[name] != '"')) break;
+    size_t name_end = text.find('"', name + 1);
+
+    size_t workload = findJsonValue(text, name_end, "workload");
+    if ((workload == std::string::npos) || (text[workload] != '"')) break;
+    size_t workload_end = text.find('"', workload + 1);
+
+    size_t seconds = findJsonValue(text, workload_end, "seconds");
+    if (seconds == std::string::npos) break;
+
+    BenchResult r;
+    r.name       = text.substr(name + 1, name_end - name - 1);
+    r.workload   = text.substr(workload + 1, workload_end - workload - 1);
+    r.seconds    = std::strtod(text.c_str() + seconds, nullptr);
+    r.iterations = 0;
+    results.push_back(r);
+
+    pos = seconds;
+  }
+
+  return results;
+}
+
+// ベースラインと比べる
+//   threshold を超えて遅くなったものの数を返す
+u_int compareBenchResults(const std::vector<BenchResult>& results, const std::vector<BenchResult>& baseline,
+                          const double threshold) {
+  u_int regression = 0;
+  for (const auto& r : results) {
+    auto it = std::find_if(baseline.begin(), baseline.end(),
+                           [&r](const BenchResult& b) { return (b.name == r.name) && (b.workload == r.workload); });
+    if ((it == baseline.end()) || (it->seconds <= 0.0)) {
+      ci::app::console() << "  " << r.name << " [" << r.workload << "]: no baseline" << std::endl;
+      continue;
+    }
+
+    double ratio = r.seconds / it->seconds;
+    bool slow = ratio > 1.0 + threshold;
+    if (slow) regression += 1;
+
+    ci::app::console() << (slow ? "! " : "  ") << r.name << " [" << r.workload << "]: "
+                       << (ratio - 1.0) * 100.0 << "%" << std::endl;
+  }
+
+  return regression;
+}
+
+
+// コマンドライン引数から設定を読み取る
+//   --benchmark 出力先 [--baseline ファイル] [--threshold 割合] [--bench-model モデル]
+//   --benchmark が無ければfalse
+bool parseBenchOptions(const std::vector<std::string>& args, BenchOptions& options) {
+  bool enable = false;
+  for (size_t i = 0; i + 1 < args.size(); ++i) {
+    const auto& arg   = args[i];
+    const auto& value = args[i + 1];
+    if (arg == "--benchmark") {
+      enable = true;
+      options.output = value;
+    }
+    else if (arg == "--baseline") {
+      options.baseline = value;
+    }
+    else if (arg == "--threshold") {
+      options.threshold = std::strtod(value.c_str(), nullptr);
+    }
+    else if (arg == "--bench-model") {
+      options.model_path = value;
+    }
+  }
+
+  return enable;
+}
+
+// 全て計測して、書き出しと比較を行う
+//   遅くなったものの数を返す
+u_int runBenchmarkSuite(const BenchOptions& options) {
+  ci::app::console() << "Benchmark:" << std::endl;
+
+  std::vector<BenchResult> results;
+  for (const auto& workload : getBenchWorkloads()) {
+    runModelBench(workload, results);
+  }
+  if (!options.model_path.empty()) runLoadBench(options.model_path, results);
+
+  if (!options.output.empty()) {
+    std::ofstream out(options.output);
+    writeBenchResultsJson(out, results);
+    ci::app::console() << "Benchmark write:" << options.output << std::endl;
+  }
+
+  if (options.baseline.empty()) return 0;
+
+  std::ifstream in(options.baseline);
+  if (!in) {
+    ci::app::console() << "Benchmark baseline not found:" << options.baseline << std::endl;
+    return 0;
+  }
+  std::stringstream text;
+  text << in.rdbuf();
+
+  ci::app::console() << "Compare with:" << options.baseline
+                     << " threshold:" << options.threshold * 100.0 << "%" << std::endl;
+  u_int regression = compareBenchResults(results, readBenchResultsJson(text.str()), options.threshold);
+  ci::app::console() << "Regression:" << regression << std::endl;
+
+  return regression;
+}
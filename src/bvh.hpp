@@ -0,0 +1,237 @@
+﻿#pragma once
+
+//
+// メッシュ単位のBVH(ピッキング用)
+//   読み込み時に初期姿勢で構築し、以降は木の形を変えずに箱だけを作り直す(refit)
+//   子は必ず親より後ろに並べてあるので、後ろから順に処理すれば線形時間で終わる
+//
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "misc.hpp"
+#include "frustum.hpp"
+
+
+struct BvhNode {
+  Bounds bounds;
+
+  // 葉: 三角形の先頭位置と数
+  // 節: 左の子の位置(右の子はその次)と 0
+  u_int first;
+  u_int count;
+};
+
+struct MeshBvh {
+  std::vector<BvhNode> node;
+
+  // 葉から参照する三角形の番号
+  std::vector<u_int> triangle;
+};
+
+// 葉に入れる三角形の数の上限
+const u_int BVH_LEAF_SIZE = 4;
+
+
+// 三角形の範囲
+template <typename Position>
+Bounds getTriangleBounds(const std::vector<u_int>& indices, const u_int tri, Position position) {
+  Bounds b = Bounds::empty();
+  for (u_int i = 0; i < 3; ++i) {
+    b.include(position(indices[tri * 3 + i]));
+  }
+  return b;
+}
+
+// 構築
+//   重心の範囲が一番大きい軸で、重心の中央値で二分する
+//   position(頂点番号) で頂点座標を取り出す
+template <typename Position>
+MeshBvh buildMeshBvh(const std::vector<u_int>& indices, Position position) {
+  MeshBvh bvh;
+
+  u_int tri_num = u_int(indices.size() / 3);
+  if (!tri_num) return bvh;
+
+  std::vector<ci::Vec3f> centroid(tri_num);
+  bvh.triangle.resize(tri_num);
+  for (u_int i = 0; i < tri_num; ++i) {
+    centroid[i] = (position(indices[i * 3]) + position(indices[i * 3 + 1]) + position(indices[i * 3 + 2])) / 3.0f;
+    bvh.triangle[i] = i;
+  }
+
+  bvh.node.reserve(tri_num * 2 / BVH_LEAF_SIZE + 1);
+  bvh.node.push_back(BvhNode{ Bounds::empty(), 0, tri_num });
+
+  // 分割待ちの節
+  std::vector<u_int> stack;
+  stack.push_back(0);
+  while (!stack.empty()) {
+    u_int index = stack.back();
+    stack.pop_back();
+
+    u_int first = bvh.node[index].first;
+    u_int count = bvh.node[index].count;
+    if (count <= BVH_LEAF_SIZE) continue;
+
+    Bounds center = Bounds::empty();
+    for (u_int i = first; i < first + count; ++i) {
+      center.include(centroid[bvh.triangle[i]]);
+    }
+    ci::Vec3f size = center.max - center.min;
+    int axis = (size.x > size.y) ? ((size.x > size.z) ? 0 : 2) : ((size.y > size.z) ? 1 : 2);
+
+    // 全て同じ位置なら分けられない
+    if (size[axis] <= 0.0f) continue;
+
+    auto begin = bvh.triangle.begin() + first;
+    u_int half = count / 2;
+    std::nth_element(begin, begin + half, begin + count,
+                     [&centroid, axis](const u_int a, const u_int b) { return centroid[a][axis] < centroid[b][axis]; });
+
+    u_int child = u_int(bvh.node.size());
+    bvh.node.push_back(BvhNode{ Bounds::empty(), first, half });
+    bvh.node.push_back(BvhNode{ Bounds::empty(), first + half, count - half });
+    bvh.node[index].first = child;
+    bvh.node[index].count = 0;
+
+    stack.push_back(child);
+    stack.push_back(child + 1);
+  }
+
+  return bvh;
+}
+
+// 箱の作り直し
+//   木の形は変えないので、姿勢が大きく変わると箱同士の重なりが増えて遅くなる
+template <typename Position>
+void refitMeshBvh(MeshBvh& bvh, const std::vector<u_int>& indices, Position position) {
+  for (size_t n = bvh.node.size(); n > 0; --n) {
+    auto& node = bvh.node[n - 1];
+
+    if (node.count) {
+      node.bounds = Bounds::empty();
+      for (u_int i = node.first; i < node.first + node.count; ++i) {
+        node.bounds.include(getTriangleBounds(indices, bvh.triangle[i], position));
+      }
+    }
+    else {
+      node.bounds = bvh.node[node.first].bounds;
+      node.bounds.include(bvh.node[node.first + 1].bounds);
+    }
+  }
+}
+
+
+// 光線と箱の交差
+//   inv_dir は方向の逆数、交差した場合は入る位置までの距離を返す
+bool intersectBounds(const Bounds& b, const ci::Vec3f& origin, const ci::Vec3f& inv_dir,
+                     const float max_t, float& t) {
+  float t_min = 0.0f;
+  float t_max = max_t;
+  for (int i = 0; i < 3; ++i) {
+    float t0 = (b.min[i] - origin[i]) * inv_dir[i];
+    float t1 = (b.max[i] - origin[i]) * inv_dir[i];
+    if (t0 > t1) std::swap(t0, t1);
+
+    t_min = std::max(t_min, t0);
+    t_max = std::min(t_max, t1);
+    if (t_min > t_max) return false;
+  }
+
+  t = t_min;
+  return true;
+}
+
+// 光線と三角形の交差(両面)
+//   u, v は2番目と3番目の頂点の重み
+bool intersectTriangle(const ci::Vec3f& origin, const ci::Vec3f& dir,
+                       const ci::Vec3f& p0, const ci::Vec3f& p1, const ci::Vec3f& p2,
+                       float& t, float& u, float& v) {
+  const float epsilon = 1.0e-8f;
+
+  ci::Vec3f e1 = p1 - p0;
+  ci::Vec3f e2 = p2 - p0;
+  ci::Vec3f p  = dir.cross(e2);
+  float det = e1.dot(p);
+  if (std::abs(det) < epsilon) return false;
+
+  float inv_det = 1.0f / det;
+  ci::Vec3f s = origin - p0;
+  u = s.dot(p) * inv_det;
+  if ((u < 0.0f) || (u > 1.0f)) return false;
+
+  ci::Vec3f q = s.cross(e1);
+  v = dir.dot(q) * inv_det;
+  if ((v < 0.0f) || (u + v > 1.0f)) return false;
+
+  t = e2.dot(q) * inv_det;
+  return t > 0.0f;
+}
+
+// 一番近い交点を探す
+//   交差した場合、max_t を交点までの距離に書き換える
+template <typename Position>
+bool intersectMeshBvh(const MeshBvh& bvh, const std::vector<u_int>& indices, Position position,
+                      const ci::Vec3f& origin, const ci::Vec3f& dir,
+                      float& max_t, u_int& hit_tri, float& hit_u, float& hit_v) {
+  if (bvh.node.empty()) return false;
+
+  const float inf = std::numeric_limits<float>::max();
+  ci::Vec3f inv_dir{ (dir.x != 0.0f) ? 1.0f / dir.x : inf,
+                     (dir.y != 0.0f) ? 1.0f / dir.y : inf,
+                     (dir.z != 0.0f) ? 1.0f / dir.z : inf };
+
+  bool hit = false;
+  float t;
+
+  u_int stack[64];
+  u_int stack_num = 0;
+  stack[stack_num++] = 0;
+  while (stack_num) {
+    const auto& node = bvh.node[stack[--stack_num]];
+    if (!intersectBounds(node.bounds, origin, inv_dir, max_t, t)) continue;
+
+    if (node.count) {
+      for (u_int i = node.first; i < node.first + node.count; ++i) {
+        u_int tri = bvh.triangle[i];
+        float u, v;
+        if (intersectTriangle(origin, dir,
+                              position(indices[tri * 3]), position(indices[tri * 3 + 1]), position(indices[tri * 3 + 2]),
+                              t, u, v) && (t < max_t)) {
+          max_t   = t;
+          hit_tri = tri;
+          hit_u   = u;
+          hit_v   = v;
+          hit     = true;
+        }
+      }
+    }
+    else if (stack_num + 2 <= 64) {
+      // 近い方を先に調べる
+      float t0 = inf;
+      float t1 = inf;
+      bool hit0 = intersectBounds(bvh.node[node.first].bounds, origin, inv_dir, max_t, t0);
+      bool hit1 = intersectBounds(bvh.node[node.first + 1].bounds, origin, inv_dir, max_t, t1);
+      if (hit0 && hit1) {
+        if (t0 < t1) {
+          stack[stack_num++] = node.first + 1;
+          stack[stack_num++] = node.first;
+        }
+        else {
+          stack[stack_num++] = node.first;
+          stack[stack_num++] = node.first + 1;
+        }
+      }
+      else if (hit0) {
+        stack[stack_num++] = node.first;
+      }
+      else if (hit1) {
+        stack[stack_num++] = node.first + 1;
+      }
+    }
+  }
+
+  return hit;
+}
@@ -0,0 +1,655 @@
+﻿#pragma once
+
+//
+// 圧縮済みテクスチャ(KTX/DDS)
+//   BCn/ETCのデータとミップマップをそのまま持つファイルを読み、CPUでの展開やリサイズをせずに転送する
+//   ファイルはmmapで一度に割り当てて、各レベルのデータはその中を直接参照する
+//
+//   既存のPNG/JPEGから作る変換処理(BC1/BC3、ミップマップ付きKTX)も用意している
+//
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+#if defined (_MSC_VER)
+#if !defined (NOMINMAX)
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <cinder/Surface.h>
+#include <cinder/ImageIo.h>
+#include <cinder/gl/Texture.h>
+#include <cinder/ip/Resize.h>
+#include "misc.hpp"
+
+
+// 使う圧縮形式(GLのヘッダによっては定義されていないので、ここで定義しておく)
+enum : uint32_t {
+  TEXTURE_RGB_DXT1       = 0x83F0,
+  TEXTURE_RGBA_DXT1      = 0x83F1,
+  TEXTURE_RGBA_DXT3      = 0x83F2,
+  TEXTURE_RGBA_DXT5      = 0x83F3,
+  TEXTURE_RED_RGTC1      = 0x8DBB,
+  TEXTURE_RG_RGTC2       = 0x8DBD,
+  TEXTURE_RGBA_BPTC      = 0x8E8C,
+  TEXTURE_ETC1_RGB8      = 0x8D64,
+  TEXTURE_RGB8_ETC2      = 0x9274,
+  TEXTURE_RGBA8_ETC2_EAC = 0x9278,
+
+  TEXTURE_BASE_RGB  = 0x1907,
+  TEXTURE_BASE_RGBA = 0x1908,
+};
+
+// 4x4ブロック一つのバイト数(対応していない形式は0)
+u_int getCompressedBlockBytes(const uint32_t format) {
+  switch (format) {
+  case TEXTURE_RGB_DXT1:
+  case TEXTURE_RGBA_DXT1:
+  case TEXTURE_RED_RGTC1:
+  case TEXTURE_ETC1_RGB8:
+  case TEXTURE_RGB8_ETC2:
+    return 8;
+
+  case TEXTURE_RGBA_DXT3:
+  case TEXTURE_RGBA_DXT5:
+  case TEXTURE_RG_RGTC2:
+  case TEXTURE_RGBA_BPTC:
+  case TEXTURE_RGBA8_ETC2_EAC:
+    return 16;
+
+  default:
+    return 0;
+  }
+}
+
+size_t getCompressedLevelBytes(const uint32_t format, const u_int width, const u_int height) {
+  return size_t(std::max((width + 3) / 4, 1u)) * std::max((height + 3) / 4, 1u) * getCompressedBlockBytes(format);
+}
+
+
+// 読み込み専用でファイル全体を割り当てる
+class MappedFile {
+  const uint8_t* top;
+  size_t size;
+
+#if defined (_MSC_VER)
+  HANDLE file;
+  HANDLE mapping;
+#endif
+
+public:
+  explicit MappedFile(const std::string& path)
+    : top(nullptr),
+      size(0)
+  {
+#if defined (_MSC_VER)
+    mapping = nullptr;
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || !file_size.QuadPart) return;
+
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) return;
+
+    top  = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    size = top ? size_t(file_size.QuadPart) : 0;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if ((::fstat(fd, &st) == 0) && (st.st_size > 0)) {
+      void* p = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        top  = static_cast<const uint8_t*>(p);
+        size = size_t(st.st_size);
+      }
+    }
+    // 割り当て後は閉じても良い
+    ::close(fd);
+#endif
+  }
+
+  ~MappedFile() {
+#if defined (_MSC_VER)
+    if (top) UnmapViewOfFile(top);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (top) ::munmap(const_cast<uint8_t*>(top), size);
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data() const { return top; }
+  size_t getSize() const { return size; }
+  bool isValid() const { return top != nullptr; }
+};
+
+
+struct CompressedLevel {
+  u_int width;
+  u_int height;
+
+  // MappedFile内を直接指す
+  const uint8_t* data;
+  size_t size;
+};
+
+struct CompressedImage {
+  CompressedImage()
+    : format(0),
+      base_format(TEXTURE_BASE_RGBA),
+      width(0),
+      height(0)
+  {}
+
+  uint32_t format;
+  uint32_t base_format;
+  u_int width;
+  u_int height;
+
+  std::vector<CompressedLevel> level;
+
+  // levelが参照している領域を保持する
+  std::shared_ptr<MappedFile> file;
+};
+
+size_t getCompressedImageBytes(const CompressedImage& image) {
+  size_t bytes = 0;
+  for (const auto& level : image.level) {
+    bytes += level.size;
+  }
+  return bytes;
+}
+
+
+uint32_t readU32(const uint8_t* p, const bool swap = false) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  if (swap) {
+    v = ((v & 0xff) << 24) | ((v & 0xff00) << 8) | ((v >> 8) & 0xff00) | (v >> 24);
+  }
+  return v;
+}
+
+const uint8_t ktx_identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+// KTX(バージョン1)
+//   2Dテクスチャ一枚だけに対応
+bool parseKtx(const uint8_t* data, const size_t size, CompressedImage& image) {
+  const size_t header_size = 64;
+  if ((size < header_size) || std::memcmp(data, ktx_identifier, sizeof(ktx_identifier))) return false;
+
+  uint32_t endianness = readU32(data + 12);
+  if ((endianness != 0x04030201) && (endianness != 0x01020304)) return false;
+  bool swap = endianness == 0x01020304;
+
+  uint32_t gl_type        = readU32(data + 16, swap);
+  uint32_t internal       = readU32(data + 28, swap);
+  uint32_t base           = readU32(data + 32, swap);
+  uint32_t width          = readU32(data + 36, swap);
+  uint32_t height         = readU32(data + 40, swap);
+  uint32_t depth          = readU32(data + 44, swap);
+  uint32_t array_elements = readU32(data + 48, swap);
+  uint32_t faces          = readU32(data + 52, swap);
+  uint32_t levels         = readU32(data + 56, swap);
+  uint32_t key_value      = readU32(data + 60, swap);
+
+  // 圧縮形式はglTypeが0
+  if (gl_type || !getCompressedBlockBytes(internal)) return false;
+  if (!width || !height || depth || array_elements || (faces != 1)) return false;
+
+  image.format      = internal;
+  image.base_format = base;
+  image.width       = width;
+  image.height      = height;
+  image.level.clear();
+
+  size_t pos = header_size + key_value;
+  levels = std::max(levels, 1u);
+  for (uint32_t i = 0; i < levels; ++i) {
+    if (pos + 4 > size) return false;
+    uint32_t image_size = readU32(data + pos, swap);
+    pos += 4;
+
+    u_int w = std::max(width >> i, 1u);
+    u_int h = std::max(height >> i, 1u);
+    if ((image_size != getCompressedLevelBytes(internal, w, h)) || (pos + image_size > size)) return false;
+
+    image.level.push_back(CompressedLevel{ w, h, data + pos, image_size });
+    pos += (image_size + 3) & ~size_t(3);
+  }
+
+  return true;
+}
+
+// DDS
+//   BCnのみ。DX10拡張ヘッダにも対応する
+bool parseDds(const uint8_t* data, const size_t size, CompressedImage& image) {
+  const size_t header_size = 4 + 124;
+  if ((size < header_size) || std::memcmp(data, "DDS ", 4)) return false;
+
+  const uint8_t* header = data + 4;
+  if (readU32(header) != 124) return false;
+
+  uint32_t height  = readU32(header + 8);
+  uint32_t width   = readU32(header + 12);
+  uint32_t levels  = readU32(header + 24);
+  uint32_t fourcc  = readU32(header + 80);
+
+  auto makeFourCC = [](const char* s) {
+    return uint32_t(uint8_t(s[0])) | (uint32_t(uint8_t(s[1])) << 8) | (uint32_t(uint8_t(s[2])) << 16) | (uint32_t(uint8_t(s[3])) << 24);
+  };
+
+  size_t pos = header_size;
+  uint32_t format = 0;
+  uint32_t base   = TEXTURE_BASE_RGBA;
+  if (fourcc == makeFourCC("DXT1")) {
+    format = TEXTURE_RGBA_DXT1;
+  }
+  else if (fourcc == makeFourCC("DXT3")) {
+    format = TEXTURE_RGBA_DXT3;
+  }
+  else if (fourcc == makeFourCC("DXT5")) {
+    format = TEXTURE_RGBA_DXT5;
+  }
+  else if ((fourcc == makeFourCC("ATI1")) || (fourcc == makeFourCC("BC4U"))) {
+    format = TEXTURE_RED_RGTC1;
+  }
+  else if ((fourcc == makeFourCC("ATI2")) || (fourcc == makeFourCC("BC5U"))) {
+    format = TEXTURE_RG_RGTC2;
+  }
+  else if (fourcc == makeFourCC("DX10")) {
+    if (size < header_size + 20) return false;
+
+    switch (readU32(data + header_size)) {
+    case 71: case 72: format = TEXTURE_RGBA_DXT1; break;
+    case 74: case 75: format = TEXTURE_RGBA_DXT3; break;
+    case 77: case 78: format = TEXTURE_RGBA_DXT5; break;
+    case 80:          format = TEXTURE_RED_RGTC1; break;
+    case 83:          format = TEXTURE_RG_RGTC2;  break;
+    case 98: case 99: format = TEXTURE_RGBA_BPTC; break;
+    default: return false;
+    }
+    pos += 20;
+  }
+  if (!format || !width || !height) return false;
+
+  image.format      = format;
+  image.base_format = base;
+  image.width       = width;
+  image.height      = height;
+  image.level.clear();
+
+  levels = std::max(levels, 1u);
+  for (uint32_t i = 0; i < levels; ++i) {
+    u_int w = std::max(width >> i, 1u);
+    u_int h = std::max(height >> i, 1u);
+    size_t level_size = getCompressedLevelBytes(format, w, h);
+    if (pos + level_size > size) return false;
+
+    image.level.push_back(CompressedLevel{ w, h, data + pos, level_size });
+    pos += level_size;
+  }
+
+  return true;
+}
+
+// ファイルを割り当てて読む
+bool loadCompressedImage(const std::string& path, CompressedImage& image) {
+  auto file = std::make_shared<MappedFile>(path);
+  if (!file->isValid()) return false;
+
+  if (!parseKtx(file->data(), file->getSize(), image)
+      && !parseDds(file->data(), file->getSize(), image)) {
+    ci::app::console() << "Compressed texture unsupported:" << path << std::endl;
+    return false;
+  }
+
+  image.file = file;
+  return true;
+}
+
+// 元の画像の隣にある圧縮済みファイルを探す
+//   ex) hoge/piyo.png -> hoge/piyo.ktx, hoge/piyo.dds
+std::string findCompressedTexture(const std::string& path) {
+  size_t dot   = path.rfind('.');
+  size_t slash = path.find_last_of("/\\");
+  std::string stem = ((dot != std::string::npos) && ((slash == std::string::npos) || (dot > slash))) ? path.substr(0, dot) : path;
+
+  for (const char* ext : { ".ktx", ".dds" }) {
+    std::ifstream file(stem + ext, std::ios::binary);
+    if (file) return stem + ext;
+  }
+
+  return std::string();
+}
+
+// GLへ転送
+//   ドライバが対応していない形式の場合はnullを返す
+ci::gl::TextureRef createCompressedTexture(const CompressedImage& image) {
+  if (image.level.empty()) return ci::gl::TextureRef();
+
+  GLuint id;
+  glGenTextures(1, &id);
+  glBindTexture(GL_TEXTURE_2D, id);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+  // 残っているエラーを捨てておく
+  while (glGetError() != GL_NO_ERROR) {}
+
+  for (size_t i = 0; i < image.level.size(); ++i) {
+    const auto& level = image.level[i];
+    glCompressedTexImage2D(GL_TEXTURE_2D, GLint(i), image.format,
+                           level.width, level.height, 0, GLsizei(level.size), level.data);
+  }
+
+  if (glGetError() != GL_NO_ERROR) {
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDeleteTextures(1, &id);
+    return ci::gl::TextureRef();
+  }
+
+  bool has_mipmap = image.level.size() > 1;
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, has_mipmap ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+#if !defined (CINDER_COCOA_TOUCH)
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, GLint(image.level.size() - 1));
+#elif defined (GL_TEXTURE_MAX_LEVEL_APPLE)
+  // OpenGL ESは拡張でのみ指定できる
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL_APPLE, GLint(image.level.size() - 1));
+#endif
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  // テクスチャの破棄はCinderに任せる
+  return ci::gl::Texture::create(GL_TEXTURE_2D, id, image.width, image.height, false);
+}
+
+
+// 以下、変換処理
+
+// 画像をRGBA8で取り出す
+std::vector<uint8_t> getSurfaceRGBA(const ci::Surface& surface) {
+  int w = surface.getWidth();
+  int h = surface.getHeight();
+  int pixel_bytes = surface.getPixelBytes();
+  int r = surface.getRedOffset();
+  int g = surface.getGreenOffset();
+  int b = surface.getBlueOffset();
+  int a = surface.hasAlpha() ? surface.getAlphaOffset() : -1;
+
+  std::vector<uint8_t> rgba(size_t(w) * h * 4);
+  for (int y = 0; y < h; ++y) {
+    const uint8_t* src = surface.getData() + size_t(y) * surface.getRowBytes();
+    uint8_t* dst = &rgba[size_t(y) * w * 4];
+    for (int x = 0; x < w; ++x) {
+      dst[0] = src[r];
+      dst[1] = src[g];
+      dst[2] = src[b];
+      dst[3] = (a >= 0) ? src[a] : 255;
+      src += pixel_bytes;
+      dst += 4;
+    }
+  }
+
+  return rgba;
+}
+
+// 縦横半分に縮小(2x2の平均)
+std::vector<uint8_t> downsampleRGBA(const std::vector<uint8_t>& src, const u_int width, const u_int height) {
+  u_int w = std::max(width / 2, 1u);
+  u_int h = std::max(height / 2, 1u);
+
+  std::vector<uint8_t> dst(size_t(w) * h * 4);
+  for (u_int y = 0; y < h; ++y) {
+    for (u_int x = 0; x < w; ++x) {
+      u_int x0 = std::min(x * 2, width - 1);
+      u_int x1 = std::min(x * 2 + 1, width - 1);
+      u_int y0 = std::min(y * 2, height - 1);
+      u_int y1 = std::min(y * 2 + 1, height - 1);
+      for (int c = 0; c < 4; ++c) {
+        u_int sum = src[(size_t(y0) * width + x0) * 4 + c] + src[(size_t(y0) * width + x1) * 4 + c]
+                  + src[(size_t(y1) * width + x0) * 4 + c] + src[(size_t(y1) * width + x1) * 4 + c];
+        dst[(size_t(y) * w + x) * 4 + c] = uint8_t((sum + 2) / 4);
+      }
+    }
+  }
+
+  return dst;
+}
+
+uint16_t packRGB565(const int r, const int g, const int b) {
+  return uint16_t(((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | ((b * 31 + 127) / 255));
+}
+
+void unpackRGB565(const uint16_t c, int rgb[3]) {
+  rgb[0] = ((c >> 11) & 31) * 255 / 31;
+  rgb[1] = ((c >> 5) & 63) * 255 / 63;
+  rgb[2] = (c & 31) * 255 / 31;
+}
+
+// BC1のカラーブロック
+//   各成分の最小値と最大値を端点にする簡易的なもの
+//   block は4x4ピクセルのRGBA
+void encodeColorBlock(const uint8_t block[64], uint8_t out[8]) {
+  int min_c[3] = { 255, 255, 255 };
+  int max_c[3] = { 0, 0, 0 };
+  for (int i = 0; i < 16; ++i) {
+    for (int c = 0; c < 3; ++c) {
+      min_c[c] = std::min(min_c[c], int(block[i * 4 + c]));
+      max_c[c] = std::max(max_c[c], int(block[i * 4 + c]));
+    }
+  }
+
+  // 範囲の両端を少し内側に寄せると誤差が減る
+  for (int c = 0; c < 3; ++c) {
+    int inset = (max_c[c] - min_c[c]) / 16;
+    min_c[c] += inset;
+    max_c[c] -= inset;
+  }
+
+  uint16_t c0 = packRGB565(max_c[0], max_c[1], max_c[2]);
+  uint16_t c1 = packRGB565(min_c[0], min_c[1], min_c[2]);
+  // 4色モードにするには c0 > c1
+  if (c0 < c1) std::swap(c0, c1);
+
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    int palette[4][3];
+    unpackRGB565(c0, palette[0]);
+    unpackRGB565(c1, palette[1]);
+    for (int c = 0; c < 3; ++c) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    for (int i = 0; i < 16; ++i) {
+      int best = 0;
+      int best_error = std::numeric_limits<int>::max();
+      for (int p = 0; p < 4; ++p) {
+        int error = 0;
+        for (int c = 0; c < 3; ++c) {
+          int d = int(block[i * 4 + c]) - palette[p][c];
+          error += d * d;
+        }
+        if (error < best_error) {
+          best = p;
+          best_error = error;
+        }
+      }
+      indices |= uint32_t(best) << (i * 2);
+    }
+  }
+
+  out[0] = uint8_t(c0);
+  out[1] = uint8_t(c0 >> 8);
+  out[2] = uint8_t(c1);
+  out[3] = uint8_t(c1 >> 8);
+  for (int i = 0; i < 4; ++i) {
+    out[4 + i] = uint8_t(indices >> (i * 8));
+  }
+}
+
+// BC3のアルファブロック(8段階)
+void encodeAlphaBlock(const uint8_t block[64], uint8_t out[8]) {
+  int a0 = 0;
+  int a1 = 255;
+  for (int i = 0; i < 16; ++i) {
+    a0 = std::max(a0, int(block[i * 4 + 3]));
+    a1 = std::min(a1, int(block[i * 4 + 3]));
+  }
+
+  uint64_t indices = 0;
+  if (a0 > a1) {
+    int palette[8];
+    palette[0] = a0;
+    palette[1] = a1;
+    for (int p = 1; p < 7; ++p) {
+      palette[p + 1] = ((7 - p) * a0 + p * a1) / 7;
+    }
+
+    for (int i = 0; i < 16; ++i) {
+      int a = block[i * 4 + 3];
+      int best = 0;
+      for (int p = 1; p < 8; ++p) {
+        if (std::abs(a - palette[p]) < std::abs(a - palette[best])) best = p;
+      }
+      indices |= uint64_t(best) << (i * 3);
+    }
+  }
+
+  out[0] = uint8_t(a0);
+  out[1] = uint8_t(a1);
+  for (int i = 0; i < 6; ++i) {
+    out[2 + i] = uint8_t(indices >> (i * 8));
+  }
+}
+
+// 一枚分をBC1(アルファ無し)かBC3(アルファ有り)へ
+std::vector<uint8_t> encodeBCn(const std::vector<uint8_t>& rgba, const u_int width, const u_int height, const bool has_alpha) {
+  u_int block_w = std::max((width + 3) / 4, 1u);
+  u_int block_h = std::max((height + 3) / 4, 1u);
+  u_int block_bytes = has_alpha ? 16 : 8;
+
+  std::vector<uint8_t> out(size_t(block_w) * block_h * block_bytes);
+  uint8_t block[64];
+  for (u_int by = 0; by < block_h; ++by) {
+    for (u_int bx = 0; bx < block_w; ++bx) {
+      // 端は一番外側のピクセルを繰り返す
+      for (u_int y = 0; y < 4; ++y) {
+        for (u_int x = 0; x < 4; ++x) {
+          u_int px = std::min(bx * 4 + x, width - 1);
+          u_int py = std::min(by * 4 + y, height - 1);
+          std::memcpy(&block[(y * 4 + x) * 4], &rgba[(size_t(py) * width + px) * 4], 4);
+        }
+      }
+
+      uint8_t* dst = &out[(size_t(by) * block_w + bx) * block_bytes];
+      if (has_alpha) {
+        encodeAlphaBlock(block, dst);
+        encodeColorBlock(block, dst + 8);
+      }
+      else {
+        encodeColorBlock(block, dst);
+      }
+    }
+  }
+
+  return out;
+}
+
+void writeU32(std::ostream& out, const uint32_t value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// KTXを書き出す
+//   level は大きい順に並べたもの
+void writeKtx(std::ostream& out, const uint32_t format, const uint32_t base_format,
+              const u_int width, const u_int height, const std::vector<std::vector<uint8_t> >& level) {
+  out.write(reinterpret_cast<const char*>(ktx_identifier), sizeof(ktx_identifier));
+  writeU32(out, 0x04030201);
+  writeU32(out, 0);              // glType
+  writeU32(out, 1);              // glTypeSize
+  writeU32(out, 0);              // glFormat
+  writeU32(out, format);
+  writeU32(out, base_format);
+  writeU32(out, width);
+  writeU32(out, height);
+  writeU32(out, 0);              // pixelDepth
+  writeU32(out, 0);              // numberOfArrayElements
+  writeU32(out, 1);              // numberOfFaces
+  writeU32(out, u_int(level.size()));
+  writeU32(out, 0);              // bytesOfKeyValueData
+
+  const char padding[4] = {};
+  for (const auto& data : level) {
+    writeU32(out, uint32_t(data.size()));
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    out.write(padding, (4 - data.size() % 4) % 4);
+  }
+}
+
+// PNG/JPEGを圧縮済みのKTXへ変換する
+//   loadTexrtureと同じく、２のべき乗でなければ先にリサイズする
+bool convertTexture(const std::string& src_path, const std::string& dst_path) {
+  ci::Surface surface = ci::loadImage(src_path);
+  if (!surface) return false;
+
+  int w = surface.getWidth();
+  int h = surface.getHeight();
+  int pow_w = int2pow(w);
+  int pow_h = int2pow(h);
+  if ((w != pow_w) || (h != pow_h)) {
+    surface = ci::ip::resizeCopy(surface, ci::Area{0, 0, w - 1, h - 1}, ci::Vec2i{pow_w, pow_h});
+  }
+
+  bool has_alpha = surface.hasAlpha();
+  u_int width  = u_int(surface.getWidth());
+  u_int height = u_int(surface.getHeight());
+  auto rgba = getSurfaceRGBA(surface);
+
+  std::vector<std::vector<uint8_t> > level;
+  u_int lw = width;
+  u_int lh = height;
+  while (true) {
+    level.push_back(encodeBCn(rgba, lw, lh, has_alpha));
+    if ((lw == 1) && (lh == 1)) break;
+
+    rgba = downsampleRGBA(rgba, lw, lh);
+    lw = std::max(lw / 2, 1u);
+    lh = std::max(lh / 2, 1u);
+  }
+
+  std::ofstream out(dst_path, std::ios::binary);
+  if (!out) return false;
+
+  uint32_t format = has_alpha ? TEXTURE_RGBA_DXT5 : TEXTURE_RGB_DXT1;
+  writeKtx(out, format, has_alpha ? TEXTURE_BASE_RGBA : TEXTURE_BASE_RGB, width, height, level);
+
+  size_t bytes = 0;
+  for (const auto& data : level) {
+    bytes += data.size();
+  }
+  ci::app::console() << "Texture convert:" << src_path << " -> " << dst_path
+                     << " " << width << "x" << height << " levels:" << level.size()
+                     << " " << size_t(width) * height * 4 << " -> " << bytes << " bytes" << std::endl;
+
+  return true;
+}
@@ -0,0 +1,115 @@
+﻿#pragma once
+
+//
+// 視錐台カリング
+//   投影行列 * ビュー行列 * モデル行列 から6平面を取り出し
+//   モデル空間のAABBが完全に外側にあるかを調べる
+//
+
+#include <cinder/Matrix44.h>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "affine.hpp"
+
+
+// 軸に沿った箱(最小値と最大値)
+struct Bounds {
+  ci::Vec3f min;
+  ci::Vec3f max;
+
+  static Bounds empty() {
+    float value = std::numeric_limits<float>::max();
+    return Bounds{ ci::Vec3f{ value, value, value }, ci::Vec3f{ -value, -value, -value } };
+  }
+
+  bool isEmpty() const { return min.x > max.x; }
+
+  void include(const ci::Vec3f& v) {
+    for (int i = 0; i < 3; ++i) {
+      min[i] = std::min(min[i], v[i]);
+      max[i] = std::max(max[i], v[i]);
+    }
+  }
+
+  void include(const Bounds& b) {
+    if (b.isEmpty()) return;
+    include(b.min);
+    include(b.max);
+  }
+
+  void inflate(const float value) {
+    min -= ci::Vec3f{ value, value, value };
+    max += ci::Vec3f{ value, value, value };
+  }
+};
+
+// 変換後の箱を囲む箱
+//   中心を変換し、半分の大きさは行列の各成分の絶対値で広げる
+Bounds transformBounds(const Affine& m, const Bounds& b) {
+  if (b.isEmpty()) return b;
+
+  ci::Vec3f center = (b.min + b.max) * 0.5f;
+  ci::Vec3f extent = (b.max - b.min) * 0.5f;
+
+  ci::Vec3f c = m.transformPoint(center);
+  ci::Vec3f e;
+  for (int i = 0; i < 3; ++i) {
+    e[i] = std::abs(m.m[i][0]) * extent.x + std::abs(m.m[i][1]) * extent.y + std::abs(m.m[i][2]) * extent.z;
+  }
+
+  return Bounds{ c - e, c + e };
+}
+
+
+struct Frustum {
+  Frustum()
+    : enable(false)
+  {}
+
+  // 無効な場合は全て見えているとみなす
+  bool enable;
+
+  // ax + by + cz + d >= 0 が内側
+  float plane[6][4];
+};
+
+// 行列から平面を取り出す
+//   matrix は 投影行列 * ビュー行列 * モデル行列
+//   取り出した平面はモデル空間になる
+Frustum createFrustum(const ci::Matrix44f& matrix) {
+  Frustum frustum;
+  frustum.enable = true;
+
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      frustum.plane[i * 2 + 0][j] = matrix.at(3, j) + matrix.at(i, j);
+      frustum.plane[i * 2 + 1][j] = matrix.at(3, j) - matrix.at(i, j);
+    }
+  }
+
+  return frustum;
+}
+
+// 箱の一部でも内側にあればtrue
+bool isVisible(const Frustum& frustum, const Bounds& b) {
+  if (!frustum.enable) return true;
+  if (b.isEmpty()) return false;
+
+  ci::Vec3f center = (b.min + b.max) * 0.5f;
+  ci::Vec3f extent = (b.max - b.min) * 0.5f;
+
+  for (const auto& p : frustum.plane) {
+    float distance = p[0] * center.x + p[1] * center.y + p[2] * center.z + p[3];
+    float radius   = std::abs(p[0]) * extent.x + std::abs(p[1]) * extent.y + std::abs(p[2]) * extent.z;
+    if (distance < -radius) return false;
+  }
+
+  return true;
+}
+
+// ノード空間の箱を、ノードの行列で変換してから調べる
+bool isVisible(const Frustum& frustum, const Affine& matrix, const Bounds& b) {
+  if (!frustum.enable) return true;
+  return isVisible(frustum, transformBounds(matrix, b));
+}
@@ -0,0 +1,195 @@
+﻿#pragma once
+
+//
+// 読み込み設定
+//   Assimpの後処理の組み合わせと、各処理にかかった時間の計測
+//
+
+#include <assimp/postprocess.h>
+#include <assimp/config.h>
+#include <assimp/DefaultLogger.hpp>
+#include <assimp/LogStream.hpp>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include "misc.hpp"
+#include "allocator.hpp"
+#include "perfcounter.hpp"
+
+
+// 読み込みプリセット
+enum ImportPresetType {
+  // 確認用。最低限の後処理だけ行う
+  IMPORT_PRESET_PREVIEW,
+  // 従来の設定
+  IMPORT_PRESET_STANDARD,
+  // 最適化を全て行い、独自の後処理も適用
+  IMPORT_PRESET_PRODUCTION,
+
+  IMPORT_PRESET_NUM
+};
+
+struct ImportPreset {
+  const char* name;
+  u_int flags;
+
+  // 独自の後処理(ウェイトの正規化など)を行う
+  bool cook;
+};
+
+const ImportPreset& getImportPreset(const int type) {
+  static const ImportPreset presets[] = {
+    {
+      "Preview",
+      aiProcess_Triangulate
+      | aiProcess_FlipUVs
+      | aiProcess_LimitBoneWeights,
+      false
+    },
+    {
+      "Standard",
+      aiProcess_Triangulate
+      | aiProcess_FlipUVs
+      | aiProcess_JoinIdenticalVertices
+      | aiProcess_OptimizeMeshes
+      | aiProcess_LimitBoneWeights
+      | aiProcess_RemoveRedundantMaterials,
+      true
+    },
+    {
+      "Production",
+      aiProcess_Triangulate
+      | aiProcess_FlipUVs
+      | aiProcess_JoinIdenticalVertices
+      | aiProcess_OptimizeMeshes
+      | aiProcess_LimitBoneWeights
+      | aiProcess_RemoveRedundantMaterials
+      | aiProcess_ImproveCacheLocality
+      | aiProcess_FindInvalidData
+      | aiProcess_ValidateDataStructure,
+      true
+    },
+  };
+
+  return presets[type];
+}
+
+// ダイアログ向けのプリセット名一覧
+std::vector<std::string> getImportPresetNames() {
+  std::vector<std::string> names;
+  for (int i = 0; i < IMPORT_PRESET_NUM; ++i) {
+    names.push_back(getImportPreset(i).name);
+  }
+
+  return names;
+}
+
+
+// 処理時間
+struct ImportTiming {
+  std::string name;
+  double seconds;
+};
+
+
+// Assimpのログから処理時間を拾う
+//   AI_CONFIG_GLOB_MEASURE_TIMEを有効にすると
+//   "END   `postprocess`, dt= 0.01 s" のような計測結果がログに出力される
+//   後処理は全て同じ名前で計測されるので、直前の "XXXProcess begin" から処理名を割り出す
+class ImportTimingStream : public Assimp::LogStream {
+  std::string step_name;
+
+public:
+  std::vector<ImportTiming> timing;
+
+  void write(const char* message) override {
+    const char* begin = std::strstr(message, "Process begin");
+    if (begin) {
+      // 処理名はメッセージ先頭からの単語
+      const char* top = begin;
+      while ((top > message) && (top[-1] != ' ')) --top;
+      step_name.assign(top, begin + std::strlen("Process"));
+      return;
+    }
+
+    const char* end = std::strstr(message, "END   `");
+    if (!end) return;
+
+    const char* name = end + std::strlen("END   `");
+    const char* name_end = std::strchr(name, '`');
+    const char* dt = std::strstr(message, "dt= ");
+    if (!name_end || !dt) return;
+
+    std::string region(name, name_end);
+    if ((region == "postprocess") && !step_name.empty()) {
+      region = step_name;
+      step_name.clear();
+    }
+
+    timing.push_back({ region, std::atof(dt + std::strlen("dt= ")) });
+  }
+};
+
+// 読み込み中だけAssimpのログを有効にする
+//   処理時間はデバッグ出力なので、VERBOSEにしないと捨てられる
+//   既にロガーがあれば、それに繋いで終わったら元の設定に戻す
+struct ScopedImportLog {
+  ImportTimingStream stream;
+  bool created;
+  Assimp::Logger::LogSeverity severity;
+
+  ScopedImportLog()
+    : created(Assimp::DefaultLogger::isNullLogger()),
+      severity(Assimp::Logger::NORMAL)
+  {
+    if (created) {
+      Assimp::DefaultLogger::create(nullptr, Assimp::Logger::VERBOSE);
+    }
+    else {
+      severity = Assimp::DefaultLogger::get()->getLogSeverity();
+      Assimp::DefaultLogger::get()->setLogSeverity(Assimp::Logger::VERBOSE);
+    }
+    Assimp::DefaultLogger::get()->attachStream(&stream, Assimp::Logger::Debugging | Assimp::Logger::Info);
+  }
+
+  ~ScopedImportLog() {
+    // 破棄時にstreamがdeleteされないよう、先に外しておく
+    Assimp::DefaultLogger::get()->detatchStream(&stream, Assimp::Logger::Debugging | Assimp::Logger::Info);
+    if (created) {
+      Assimp::DefaultLogger::kill();
+    }
+    else {
+      Assimp::DefaultLogger::get()->setLogSeverity(severity);
+    }
+  }
+};
+
+
+// 読み込み段階ごとの処理時間
+thread_local double load_stage_time[LOAD_STAGE_NUM];
+
+void resetLoadStageTime() {
+  std::fill(std::begin(load_stage_time), std::end(load_stage_time), 0.0);
+}
+
+// スコープ内をその段階として、確保と処理時間とハードウェアカウンタを記録する
+struct ScopedLoadStage {
+  ScopedAllocStage alloc;
+  ScopedPerfCount perf;
+  int stage;
+  std::chrono::steady_clock::time_point start;
+
+  explicit ScopedLoadStage(const int stage_)
+    : alloc(stage_),
+      perf(load_stage_perf[stage_]),
+      stage(stage_),
+      start(std::chrono::steady_clock::now())
+  {}
+
+  ~ScopedLoadStage() {
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+    load_stage_time[stage] += dt.count();
+  }
+};
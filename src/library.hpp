@@ -0,0 +1,127 @@
+﻿#pragma once
+
+//
+// アニメーションライブラリ
+//   アニメーションだけのファイルを読み込んでおき、ノード名が一致するモデルへ束縛する
+//   キーフレームと展開元は全てのモデルで一つを共有する
+//   チャンネル→ノードの対応表は、アニメーションと骨格の組ごとに一度だけ作る
+//
+
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "model.hpp"
+
+
+struct AnimLibrary {
+  // 読み込んだアニメーション
+  //   ここでは展開せず、束縛したモデルが初めて使う時に展開する
+  std::vector<AnimClip> clip;
+
+  // (骨格, アニメーション)ごとの対応表
+  //   束縛できなかった組はnullを記録しておく
+  std::map<std::pair<uint64_t, size_t>, std::shared_ptr<const std::vector<u_int> > > remap;
+};
+
+
+// 骨格の識別値
+//   ノード名を Model::node_list 順に並べたもののハッシュ値(FNV-1a 64bit)
+//   同じファイルから読んだモデル同士は同じ値になる
+uint64_t getSkeletonHash(const Model& model) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const auto& node : model.node_list) {
+    for (char c : node->name) {
+      hash ^= uint8_t(c);
+      hash *= 1099511628211ULL;
+    }
+    // 名前の区切り
+    hash ^= 0xff;
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+// アニメーションだけのファイルを読み込む
+//   ノードの変換をモデルと揃えるため、Assimpの後処理はモデルと同じプリセットを指定する
+//   読み込んだアニメーションの数を返す
+size_t loadAnimLibrary(AnimLibrary& library, const std::string& path, const int preset = IMPORT_PRESET_STANDARD) {
+  Assimp::Importer importer;
+  const aiScene* scene = importer.ReadFile(path, getImportPreset(preset).flags);
+  if (!scene || !scene->HasAnimations()) {
+    ci::app::console() << "Anim library: no animation in " << path << std::endl;
+    return 0;
+  }
+
+  // 展開元としてaiSceneを引き取る(同じファイルを読んだモデルがあれば共有する)
+  std::string asset_key = getSceneKey(path, getImportPreset(preset).flags);
+  aiScene* orphan = importer.GetOrphanedScene();
+  releaseSceneMeshes(orphan);
+  auto source = shareAnimationSource(asset_key, std::shared_ptr<const aiScene>(orphan));
+
+  ci::app::console() << "Anim library:" << path << " animations:" << source->mNumAnimations << std::endl;
+
+  for (u_int i = 0; i < source->mNumAnimations; ++i) {
+    AnimClip clip = registerAnimation(source->mAnimations[i]);
+    clip.owner = source;
+    if (!asset_key.empty()) clip.cache_key = asset_key + "/anim" + std::to_string(i);
+    library.clip.push_back(clip);
+  }
+
+  return source->mNumAnimations;
+}
+
+// アニメーションをモデルへ束縛する
+//   skeleton は getSkeletonHash の値
+//   モデルに無いノードを動かすアニメーションは束縛しない
+bool bindLibraryClip(AnimLibrary& library, const size_t index, Model& model, const uint64_t skeleton) {
+  const auto& src = library.clip[index];
+
+  auto key = std::make_pair(skeleton, index);
+  auto it = library.remap.find(key);
+  if (it == library.remap.end()) {
+    it = library.remap.insert(std::make_pair(key, createChannelRemap(model, src.source))).first;
+  }
+  if (!it->second) {
+    ci::app::console() << "Anim library: " << src.name << " does not match the skeleton" << std::endl;
+    return false;
+  }
+  // 読み込み時にまとめたメッシュは動かせない
+  if (isStaticBatchAnimated(model, *it->second)) {
+    ci::app::console() << "Anim library: " << src.name << " moves batched static meshes" << std::endl;
+    return false;
+  }
+
+  AnimClip clip = src;
+  clip.channel_node = it->second;
+  model.animation.push_back(clip);
+  model.has_anim = true;
+
+  ci::app::console() << "Anim bind:" << clip.name << std::endl;
+  return true;
+}
+
+// 束縛できるアニメーションを全てモデルへ束縛する
+//   既に束縛してあるものは除く
+//   束縛した数を返す
+size_t bindAnimLibrary(AnimLibrary& library, Model& model) {
+  uint64_t skeleton = getSkeletonHash(model);
+
+  size_t num = 0;
+  for (size_t i = 0; i < library.clip.size(); ++i) {
+    bool bound = false;
+    for (const auto& clip : model.animation) {
+      if (clip.source == library.clip[i].source) {
+        bound = true;
+        break;
+      }
+    }
+    if (bound) continue;
+
+    if (bindLibraryClip(library, i, model, skeleton)) num += 1;
+  }
+
+  return num;
+}
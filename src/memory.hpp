@@ -0,0 +1,168 @@
+﻿#pragma once
+
+//
+// メモリ使用量の内訳
+//   コンテナの確保済みサイズを種類ごとに合計する
+//   アロケーターやmapの管理領域は含まないので、ヒーププロファイラの結果より少し小さくなる
+//
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "misc.hpp"
+
+
+enum MemoryCategory {
+  // 初期姿勢の頂点、法線、UV、頂点カラー、インデックス
+  MEMORY_MESH,
+  // スキニング結果(SkinBufferのダブルバッファと補間用)とボーン行列
+  MEMORY_SKIN,
+  // ボーンとウェイト
+  MEMORY_WEIGHT,
+  // モーフターゲットの差分と適用後の頂点
+  MEMORY_MORPH,
+  // ピッキング用のBVHと頂点ごとのウェイト
+  MEMORY_PICK,
+  // ノードの階層と検索用の索引
+  MEMORY_NODE,
+  // ノード、メッシュ、ボーンなどの名前
+  MEMORY_NAME,
+  // 展開済みのキーフレーム
+  MEMORY_KEYFRAME,
+  // ボーン行列のベイク結果
+  MEMORY_BAKE,
+  // GLのテクスチャ(読み込みに使ったSurfaceは転送後に破棄している)
+  //   圧縮済みのファイルから読んだものは、全ミップマップの圧縮後のサイズ
+  MEMORY_TEXTURE,
+
+  MEMORY_CATEGORY_NUM
+};
+
+const char* getMemoryCategoryName(const int category) {
+  static const char* const names[] = {
+    "Mesh",
+    "Skin",
+    "Weight",
+    "Morph",
+    "Pick",
+    "Node",
+    "Name",
+    "Keyframe",
+    "Bake",
+    "Texture",
+  };
+
+  return names[category];
+}
+
+// アニメーション一つ分
+struct ClipMemory {
+  std::string name;
+
+  bool resident;
+  // 展開済みならキーフレームのサイズ、未展開なら展開後の見積もり
+  size_t keyframe_bytes;
+  size_t bake_bytes;
+};
+
+struct MemoryReport {
+  MemoryReport()
+    : bytes(MEMORY_CATEGORY_NUM, 0),
+      arena_used(0),
+      arena_reserved(0)
+  {}
+
+  std::vector<size_t> bytes;
+  std::vector<ClipMemory> clip;
+
+  // ノードとウェイトを確保しているアリーナ(bytesの内訳と重複する)
+  size_t arena_used;
+  size_t arena_reserved;
+};
+
+
+// コンテナが確保している領域
+template <typename T>
+size_t getVectorBytes(const T& v) {
+  return v.capacity() * sizeof(typename T::value_type);
+}
+
+// 文字列がヒープに確保している領域
+//   短い文字列はオブジェクト内に収まる(SSO)ので0
+size_t getStringBytes(const std::string& s) {
+  static const size_t local_capacity = std::string().capacity();
+  return (s.capacity() > local_capacity) ? s.capacity() + 1 : 0;
+}
+
+size_t getMemoryTotal(const MemoryReport& report) {
+  size_t total = 0;
+  for (auto b : report.bytes) {
+    total += b;
+  }
+  return total;
+}
+
+
+void printMemoryReport(std::ostream& out, const MemoryReport& report) {
+  out << "Memory:" << std::endl;
+  for (int i = 0; i < MEMORY_CATEGORY_NUM; ++i) {
+    out << "  " << getMemoryCategoryName(i) << ": " << report.bytes[i] << " bytes" << std::endl;
+  }
+  out << "  Total: " << getMemoryTotal(report) << " bytes" << std::endl;
+
+  for (const auto& clip : report.clip) {
+    out << "  Anim:" << clip.name
+        << (clip.resident ? " resident " : " evicted (estimate) ") << clip.keyframe_bytes << " bytes";
+    if (clip.bake_bytes) out << " bake " << clip.bake_bytes << " bytes";
+    out << std::endl;
+  }
+
+  out << "  Arena: used " << report.arena_used << " / reserved " << report.arena_reserved << " bytes" << std::endl;
+}
+
+// JSON文字列のエスケープ
+void writeJsonString(std::ostream& out, const std::string& s) {
+  out << '"';
+  for (char c : s) {
+    switch (c) {
+    case '"':  out << "\\\""; break;
+    case '\\': out << "\\\\"; break;
+    case '\n': out << "\\n"; break;
+    case '\t': out << "\\t"; break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        static const char hex[] = "0123456789abcdef";
+        out << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+      }
+      else {
+        out << c;
+      }
+      break;
+    }
+  }
+  out << '"';
+}
+
+// 集計用のJSON出力
+//   { "total": n, "category": { "Mesh": n, ... }, "clip": [ ... ], "arena": { ... } }
+void writeMemoryReportJson(std::ostream& out, const MemoryReport& report) {
+  out << "{\"total\":" << getMemoryTotal(report) << ",\"category\":{";
+  for (int i = 0; i < MEMORY_CATEGORY_NUM; ++i) {
+    if (i) out << ',';
+    out << '"' << getMemoryCategoryName(i) << "\":" << report.bytes[i];
+  }
+
+  out << "},\"clip\":[";
+  for (size_t i = 0; i < report.clip.size(); ++i) {
+    const auto& clip = report.clip[i];
+    if (i) out << ',';
+    out << "{\"name\":";
+    writeJsonString(out, clip.name);
+    out << ",\"resident\":" << (clip.resident ? "true" : "false")
+        << ",\"keyframe\":" << clip.keyframe_bytes
+        << ",\"bake\":" << clip.bake_bytes << '}';
+  }
+
+  out << "],\"arena\":{\"used\":" << report.arena_used
+      << ",\"reserved\":" << report.arena_reserved << "}}";
+}
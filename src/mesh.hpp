@@ -8,8 +8,15 @@
 #include <cinder/Matrix44.h>
 #include <assimp/scene.h>
 #include <string>
+#include <limits>
+#include <algorithm>
+#include <cmath>
 #include "common.hpp"
 #include "misc.hpp"
+#include "allocator.hpp"
+#include "affine.hpp"
+#include "frustum.hpp"
+#include "bvh.hpp"
 
 
 struct Weight {
@@ -17,38 +24,218 @@ struct Weight {
   float value;
 };
 
+// 頂点ごとのウェイト(Mesh::bones の番号とウェイト)
+struct BoneInfluence {
+  u_int bone;
+  float value;
+};
+
+// 影響するボーンの数で分けた頂点の組
+//   0〜SKIN_GROUP_MAX_INFLUENCE はその数の組、SKIN_GROUP_GENERIC はそれより多い頂点と
+//   ウェイトが1でない一つだけのボーンに従う頂点
+const u_int SKIN_GROUP_MAX_INFLUENCE = 4;
+const u_int SKIN_GROUP_GENERIC = SKIN_GROUP_MAX_INFLUENCE + 1;
+const u_int SKIN_GROUP_NUM     = SKIN_GROUP_GENERIC + 1;
+
+// 一つのボーンにそのまま従う頂点か
+bool isRigidInfluence(const BoneInfluence* influence, const u_int num) {
+  return (num == 1) && (std::abs(influence[0].value - 1.0f) < 1.0e-4f);
+}
+
 struct Bone {
+  explicit Bone(const ArenaRef& arena = ArenaRef())
+    : weights(ArenaAllocator<Weight>(arena)),
+      vertex_begin(0),
+      vertex_end(0)
+  {}
+
+  std::string name;
+  Affine offset;
+
+  ArenaVector<Weight> weights;
+
+  // ウェイトを持つ頂点の初期姿勢での範囲
+  Bounds bounds;
+
+  // ウェイトを持つ頂点の番号の範囲 [begin, end)
+  u_int vertex_begin;
+  u_int vertex_end;
+};
+
+// スキニング結果の頂点
+//   座標と法線をインターリーブして16バイト境界に揃えてある
+//   そのままglVertexPointer/glNormalPointerやVBOへ渡せる
+struct alignas(16) SkinVertex {
+  ci::Vec3f position;
+  float pad0;
+  ci::Vec3f normal;
+  float pad1;
+};
+
+using SkinVertexArray = std::vector<SkinVertex, AlignedAllocator<SkinVertex, 16> >;
+
+// スキニング結果の書き出し先
+//   ダブルバッファ構成で、書き込みはback、描画やエクスポートはfrontを参照する
+struct SkinBuffer {
+  SkinBuffer()
+    : front(0),
+      use_blend(false),
+      serial(0)
+  {
+    dirty_begin[0] = dirty_begin[1] = 0;
+    dirty_end[0]   = dirty_end[1]   = 0;
+  }
+
+  SkinVertexArray body[2];
+
+  // 直前の書き込みで更新された頂点の範囲 [begin, end)
+  // VBOへ転送する時はこの範囲だけglBufferSubDataすれば良い
+  u_int dirty_begin[2];
+  u_int dirty_end[2];
+
+  u_int front;
+
+  // 間引き更新時、直前の二回の結果を補間したもの
+  SkinVertexArray blend;
+  bool use_blend;
+
+  // 表示に使う頂点を書き換えるたびに増やす
+  u_int serial;
+
+  const SkinVertexArray& getFront() const { return body[front]; }
+  const SkinVertexArray& getBackConst() const { return body[front ^ 1]; }
+
+  // 表示に使う頂点
+  const SkinVertexArray& getDisplay() const { return use_blend ? blend : body[front]; }
+  SkinVertexArray& getBack() { return body[front ^ 1]; }
+
+  u_int getDirtyBegin() const { return dirty_begin[front]; }
+  u_int getDirtyEnd() const { return dirty_end[front]; }
+
+  // 書き込みが終わったら入れ替える
+  void swap(const u_int begin, const u_int end) {
+    dirty_begin[front ^ 1] = begin;
+    dirty_end[front ^ 1]   = end;
+    front ^= 1;
+    serial += 1;
+  }
+};
+
+// モーフターゲット
+//   元の形状から動く頂点だけ、差分を持つ
+//   差分はSkinVertexと同じ並びにしておき、4要素単位でまとめて加算する
+struct MorphTarget {
+  explicit MorphTarget(const ArenaRef& arena = ArenaRef())
+    : index(ArenaAllocator<u_int>(arena)),
+      delta(ArenaAllocator<SkinVertex>(arena))
+  {}
+
   std::string name;
-  ci::Matrix44f offset;
 
-  std::vector<Weight> weights;
+  ArenaVector<u_int> index;
+  ArenaVector<SkinVertex> delta;
+};
+
+// 差分スキニング用
+//   SkinBuffer::body の片方を書いた時のボーン行列と、モーフターゲットの状態
+struct SkinHistory {
+  SkinHistory()
+    : morph_serial(0),
+      valid(false)
+  {}
+
+  std::vector<Affine> palette;
+  u_int morph_serial;
+  bool valid;
 };
 
 struct Mesh {
   Mesh()
-    : has_bone(false)
+    : has_bone(false),
+      has_morph(false),
+      morph_extent(0.0f),
+      morph_serial(0),
+      bind_bounds(Bounds::empty()),
+      bounds(Bounds::empty()),
+      culled(false),
+      skin_pending(false),
+      skin_begin(0),
+      skin_end(0),
+      bvh_serial(0),
+      skin_stamp(0)
   {}
 
+  std::string name;
+
+  // スキニングするメッシュでは初期姿勢のまま書き換えない
   ci::TriMesh body;
-  ci::TriMesh orig;
 
   u_int material_index;
 
   bool has_bone;
   std::vector<Bone> bones;
+
+  bool has_morph;
+  std::vector<MorphTarget> morph;
+  // 各ターゲットのウェイトと、前回適用したウェイト
+  std::vector<float> morph_weight;
+  std::vector<float> morph_applied;
+  // ターゲット適用後の頂点(スキニングの入力)
+  SkinVertexArray morph_vtx;
+  // 全ターゲットを適用した時に頂点が動く距離の上限
+  float morph_extent;
+  // ターゲットを適用するたびに増やす
+  u_int morph_serial;
+
+  // 初期姿勢での範囲と、現在の姿勢での範囲(どちらもノード空間)
+  Bounds bind_bounds;
+  Bounds bounds;
+
+  // 現在の姿勢のボーン行列(Mesh::bones 順)
+  std::vector<Affine> bone_matrix;
+
+  // 視錐台の外にあって描画しない
+  bool culled;
+  // 見えていなかったのでスキニングを後回しにしている
+  bool skin_pending;
+
+  // スキニング結果
+  SkinBuffer skin;
+  // ウェイトを持つ頂点の範囲 [begin, end)
+  u_int skin_begin;
+  u_int skin_end;
+
+  // ピッキング用
+  //   スキニングするメッシュは、SkinBuffer::serial が変わっていたら箱を作り直す
+  MeshBvh bvh;
+  u_int bvh_serial;
+
+  // 頂点ごとのウェイト [influence_offset[i], influence_offset[i + 1])
+  std::vector<u_int> influence_offset;
+  std::vector<BoneInfluence> influence;
+  // [skin_begin, skin_end) の頂点を、影響するボーンの数で分けたもの
+  std::vector<u_int> skin_group[SKIN_GROUP_NUM];
+
+  // 差分スキニング用
+  //   SkinBuffer::body と同じ番号で、それぞれを書いた時の状態を持つ
+  SkinHistory skin_history[2];
+  // 計算し直した頂点の印(skin_stamp と同じ値なら計算済み)
+  std::vector<u_int> skin_mark;
+  u_int skin_stamp;
 };
 
 
 // ボーンの情報を作成
-Bone createBone(const aiBone* b) {
-  Bone bone;
+Bone createBone(const aiBone* b, const ArenaRef& arena) {
+  Bone bone(arena);
 
   bone.name = b->mName.C_Str();
-  bone.offset.set(b->mOffsetMatrix[0], true);
+  bone.offset = fromAssimp(b->mOffsetMatrix);
 
   ci::app::console() << "bone:" << bone.name << " weights:" << b->mNumWeights << std::endl;
 
   const aiVertexWeight* w = b->mWeights;
+  bone.weights.reserve(b->mNumWeights);
   for (u_int i = 0; i < b->mNumWeights; ++i) {
     Weight weight{ w[i].mVertexId, w[i].mWeight };
     bone.weights.push_back(weight);
@@ -57,14 +244,262 @@ Bone createBone(const aiBone* b) {
   return bone;
 }
 
+// スキニング結果を初期姿勢で埋める
+void resetSkinBuffer(Mesh& mesh) {
+  const auto& vtx    = mesh.body.getVertices();
+  const auto& normal = mesh.body.getNormals();
+  bool has_normal = mesh.body.hasNormals();
+
+  for (auto& buffer : mesh.skin.body) {
+    buffer.resize(vtx.size());
+    for (size_t i = 0; i < vtx.size(); ++i) {
+      buffer[i].position = vtx[i];
+      buffer[i].pad0     = 1.0f;
+      buffer[i].normal   = has_normal ? normal[i] : ci::Vec3f::zero();
+      buffer[i].pad1     = 0.0f;
+    }
+  }
+
+  mesh.skin.use_blend = false;
+  mesh.skin.serial += 1;
+  mesh.skin_history[0].valid = mesh.skin_history[1].valid = false;
+
+  u_int num = u_int(vtx.size());
+  mesh.skin.dirty_begin[0] = mesh.skin.dirty_begin[1] = 0;
+  mesh.skin.dirty_end[0]   = mesh.skin.dirty_end[1]   = num;
+}
+
+// スキニング結果の書き出し先を用意
+void setupSkinBuffer(Mesh& mesh) {
+  resetSkinBuffer(mesh);
+
+  // ウェイトを持つ頂点と、モーフターゲットで動く頂点の範囲を調べておく
+  u_int begin = std::numeric_limits<u_int>::max();
+  u_int end   = 0;
+  for (const auto& bone : mesh.bones) {
+    for (const auto& weight : bone.weights) {
+      begin = std::min(begin, weight.vertex_id);
+      end   = std::max(end, weight.vertex_id + 1);
+    }
+  }
+  for (const auto& target : mesh.morph) {
+    if (target.index.empty()) continue;
+    begin = std::min(begin, target.index.front());
+    end   = std::max(end, target.index.back() + 1);
+  }
+  mesh.skin_begin = std::min(begin, end);
+  mesh.skin_end   = end;
+}
+
+// スキニングやモーフィングで頂点を書き換えるか
+bool isDynamicMesh(const Mesh& mesh) {
+  return mesh.has_bone || mesh.has_morph;
+}
+
+
+// モーフターゲットを作成
+//   aiAnimMeshは置き換え後の形状を持っているので、元の形状との差分を取る
+//   差分が epsilon 以下の頂点は持たない
+//   Assimp 3 のaiAnimMeshには名前が無いので、メッシュ内の番号で呼ぶ
+MorphTarget createMorphTarget(const aiAnimMesh* anim_mesh, const aiMesh* m, const u_int index,
+                              const ArenaRef& arena, const float epsilon = 1.0e-6f) {
+  MorphTarget target(arena);
+  target.name = "target" + std::to_string(index);
+
+  bool has_position = anim_mesh->HasPositions();
+  bool has_normal   = anim_mesh->HasNormals() && m->HasNormals();
+
+  // 先に動く頂点を数えて、必要な分だけ確保する
+  auto getDelta = [&](const u_int i, ci::Vec3f& dp, ci::Vec3f& dn) {
+    dp = has_position ? fromAssimp(anim_mesh->mVertices[i]) - fromAssimp(m->mVertices[i]) : ci::Vec3f::zero();
+    dn = has_normal   ? fromAssimp(anim_mesh->mNormals[i]) - fromAssimp(m->mNormals[i])   : ci::Vec3f::zero();
+    return (dp.lengthSquared() > epsilon * epsilon) || (dn.lengthSquared() > epsilon * epsilon);
+  };
+
+  u_int num_vtx = std::min(anim_mesh->mNumVertices, m->mNumVertices);
+  u_int count = 0;
+  ci::Vec3f dp;
+  ci::Vec3f dn;
+  for (u_int i = 0; i < num_vtx; ++i) {
+    if (getDelta(i, dp, dn)) count += 1;
+  }
+
+  target.index.reserve(count);
+  target.delta.reserve(count);
+  for (u_int i = 0; i < num_vtx; ++i) {
+    if (!getDelta(i, dp, dn)) continue;
+
+    target.index.push_back(i);
+    target.delta.push_back(SkinVertex{ dp, 0.0f, dn, 0.0f });
+  }
+
+  ci::app::console() << "morph:" << target.name << " vertices:" << count << "/" << num_vtx << std::endl;
+
+  return target;
+}
+
+// モーフターゲットを適用
+//   前回適用したターゲットの頂点を元に戻してから、ウェイトが0でないものだけ加算する
+//   ウェイトが前回と同じなら何もしない
+void applyMorphTargets(Mesh& mesh) {
+  if (mesh.morph_weight == mesh.morph_applied) return;
+
+  const auto& orig_vtx    = mesh.body.getVertices();
+  const auto& orig_normal = mesh.body.getNormals();
+  bool has_normal = mesh.body.hasNormals();
+
+  for (size_t t = 0; t < mesh.morph.size(); ++t) {
+    if (mesh.morph_applied[t] == 0.0f) continue;
+
+    for (auto i : mesh.morph[t].index) {
+      auto& v = mesh.morph_vtx[i];
+      v.position = orig_vtx[i];
+      v.normal   = has_normal ? orig_normal[i] : ci::Vec3f::zero();
+    }
+  }
+
+  for (size_t t = 0; t < mesh.morph.size(); ++t) {
+    float w = mesh.morph_weight[t];
+    if (w == 0.0f) continue;
+
+    const auto& target = mesh.morph[t];
+    size_t num = target.index.size();
+#if defined (USE_SSE)
+    // 座標と法線を、それぞれ4要素まとめて加算する
+    // (パディング部分の差分は0なので、wは変わらない)
+    __m128 weight = _mm_set1_ps(w);
+    for (size_t k = 0; k < num; ++k) {
+      float* dst = &mesh.morph_vtx[target.index[k]].position.x;
+      const float* src = &target.delta[k].position.x;
+
+      _mm_storeu_ps(dst,     _mm_add_ps(_mm_loadu_ps(dst),     _mm_mul_ps(weight, _mm_loadu_ps(src))));
+      _mm_storeu_ps(dst + 4, _mm_add_ps(_mm_loadu_ps(dst + 4), _mm_mul_ps(weight, _mm_loadu_ps(src + 4))));
+    }
+#else
+    for (size_t k = 0; k < num; ++k) {
+      auto& v = mesh.morph_vtx[target.index[k]];
+      v.position += w * target.delta[k].position;
+      v.normal   += w * target.delta[k].normal;
+    }
+#endif
+  }
+
+  mesh.morph_applied = mesh.morph_weight;
+  mesh.morph_serial += 1;
+}
+
+// 現在の姿勢での範囲を求める
+//   頂点はウェイトを付けたボーンの変換結果の重み付き平均なので
+//   各ボーンの初期姿勢の範囲を変換したものを全て囲めば、必ずその中に収まる
+void updateMeshBounds(Mesh& mesh) {
+  if (!mesh.has_bone) {
+    mesh.bounds = mesh.bind_bounds;
+    mesh.bounds.inflate(mesh.morph_extent);
+    return;
+  }
+
+  mesh.bounds = Bounds::empty();
+  for (size_t i = 0; i < mesh.bones.size(); ++i) {
+    Bounds b = mesh.bones[i].bounds;
+    if (b.isEmpty()) continue;
+
+    b.inflate(mesh.morph_extent);
+    mesh.bounds.include(transformBounds(mesh.bone_matrix[i], b));
+  }
+}
+
+// 頂点からボーンを引けるように並べ直す
+void createBoneInfluence(Mesh& mesh) {
+  if (!mesh.has_bone) return;
+
+  size_t num_vtx = mesh.body.getNumVertices();
+  mesh.influence_offset.assign(num_vtx + 1, 0);
+  for (const auto& bone : mesh.bones) {
+    for (const auto& weight : bone.weights) {
+      mesh.influence_offset[weight.vertex_id + 1] += 1;
+    }
+  }
+  for (size_t i = 0; i < num_vtx; ++i) {
+    mesh.influence_offset[i + 1] += mesh.influence_offset[i];
+  }
+
+  mesh.influence.resize(mesh.influence_offset.back());
+  std::vector<u_int> fill(mesh.influence_offset.begin(), mesh.influence_offset.end() - 1);
+  for (u_int i = 0; i < mesh.bones.size(); ++i) {
+    for (const auto& weight : mesh.bones[i].weights) {
+      mesh.influence[fill[weight.vertex_id]++] = BoneInfluence{ i, weight.value };
+    }
+  }
+
+  // 組ごとに頂点番号順に並べる
+  for (auto& group : mesh.skin_group) {
+    group.clear();
+  }
+  for (u_int i = mesh.skin_begin; i < mesh.skin_end; ++i) {
+    u_int num = mesh.influence_offset[i + 1] - mesh.influence_offset[i];
+    u_int group = num;
+    if ((num > SKIN_GROUP_MAX_INFLUENCE)
+        || ((num == 1) && !isRigidInfluence(&mesh.influence[mesh.influence_offset[i]], num))) {
+      group = SKIN_GROUP_GENERIC;
+    }
+    mesh.skin_group[group].push_back(i);
+  }
+}
+
+// 頂点、ボーン、モーフターゲットが揃ったメッシュの残りの準備
+//   カリング用の範囲、スキニング結果の書き出し先、ピッキング用のBVHを用意する
+void setupMesh(Mesh& mesh) {
+  const auto& body_vtx = mesh.body.getVertices();
+
+  // カリング用の範囲
+  mesh.bind_bounds = Bounds::empty();
+  for (const auto& v : body_vtx) {
+    mesh.bind_bounds.include(v);
+  }
+  mesh.bounds = mesh.bind_bounds;
+
+  for (auto& bone : mesh.bones) {
+    bone.bounds = Bounds::empty();
+    bone.vertex_begin = std::numeric_limits<u_int>::max();
+    bone.vertex_end   = 0;
+    for (const auto& weight : bone.weights) {
+      if (weight.value > 0.0f) bone.bounds.include(body_vtx[weight.vertex_id]);
+      bone.vertex_begin = std::min(bone.vertex_begin, weight.vertex_id);
+      bone.vertex_end   = std::max(bone.vertex_end, weight.vertex_id + 1);
+    }
+    bone.vertex_begin = std::min(bone.vertex_begin, bone.vertex_end);
+  }
+
+  if (isDynamicMesh(mesh)) {
+    setupSkinBuffer(mesh);
+    if (mesh.has_morph) mesh.morph_vtx = mesh.skin.getFront();
+  }
+
+  // ピッキング用のBVHは初期姿勢で作る
+  mesh.bvh = buildMeshBvh(mesh.body.getIndices(), [&body_vtx](const u_int i) { return body_vtx[i]; });
+  refitMeshBvh(mesh.bvh, mesh.body.getIndices(), [&body_vtx](const u_int i) { return body_vtx[i]; });
+  mesh.bvh_serial = mesh.skin.serial;
+
+  createBoneInfluence(mesh);
+  if (mesh.has_bone) mesh.skin_mark.assign(body_vtx.size(), 0);
+}
+
 // メッシュを生成
-Mesh createMesh(const aiMesh* const m) {
+Mesh createMesh(const aiMesh* const m, const ArenaRef& arena) {
   Mesh mesh;
+  mesh.name = m->mName.C_Str();
 
   // 頂点データを取り出す
   u_int num_vtx = m->mNumVertices;
   ci::app::console() << "Vertices:" << num_vtx << std::endl;
 
+  // 先に必要な分だけ確保しておく
+  mesh.body.getVertices().reserve(num_vtx);
+  if (m->HasNormals()) mesh.body.getNormals().reserve(num_vtx);
+  if (m->HasTextureCoords(0)) mesh.body.getTexCoords().reserve(num_vtx);
+  if (m->HasVertexColors(0)) mesh.body.getColorsRGBA().reserve(num_vtx);
+  if (m->HasFaces()) mesh.body.getIndices().reserve(m->mNumFaces * 3);
+
   const aiVector3D* vtx = m->mVertices;
   for (u_int h = 0; h < num_vtx; ++h) {
     mesh.body.appendVertex(fromAssimp(vtx[h]));
@@ -119,14 +554,37 @@ Mesh createMesh(const aiMesh* const m) {
     ci::app::console() << "Has Bones." << std::endl;
 
     aiBone** b = m->mBones;
+    mesh.bones.reserve(m->mNumBones);
     for (u_int i = 0; i < m->mNumBones; ++i) {
-      mesh.bones.push_back(createBone(b[i]));
+      mesh.bones.push_back(createBone(b[i], arena));
     }
+  }
+
+  // モーフターゲット
+  mesh.has_morph = m->mNumAnimMeshes > 0;
+  if (mesh.has_morph) {
+    ci::app::console() << "Has AnimMeshes:" << m->mNumAnimMeshes << std::endl;
 
-    // 骨アニメーションで書き換えるので、元を保存
-    mesh.orig = mesh.body;
+    aiAnimMesh** anim_mesh = m->mAnimMeshes;
+    mesh.morph.reserve(m->mNumAnimMeshes);
+    for (u_int i = 0; i < m->mNumAnimMeshes; ++i) {
+      mesh.morph.push_back(createMorphTarget(anim_mesh[i], m, i, arena));
+    }
+    mesh.morph_weight.assign(mesh.morph.size(), 0.0f);
+    mesh.morph_applied.assign(mesh.morph.size(), 0.0f);
+
+    // ウェイトは1を超えないものとして、各ターゲットの最大の移動量を足しておく
+    for (const auto& target : mesh.morph) {
+      float extent = 0.0f;
+      for (const auto& delta : target.delta) {
+        extent = std::max(extent, delta.position.length());
+      }
+      mesh.morph_extent += extent;
+    }
   }
 
+  setupMesh(mesh);
+
   mesh.material_index = m->mMaterialIndex;
 
   return mesh;
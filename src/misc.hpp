@@ -5,6 +5,15 @@
 //
 
 #include <string>
+#include <vector>
+#include <new>
+#include <cstdlib>
+
+// SSE2が使える環境
+#if defined (__SSE2__) || defined (_M_X64) || (defined (_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define USE_SSE
+#include <emmintrin.h>
+#endif
 
 #if defined (_MSC_VER)
 using u_int = unsigned int;
@@ -58,3 +67,43 @@ int int2pow(const int value) {
 
 	return res;
 }
+
+
+// アラインメント指定付きのアロケーター
+//   SIMDやGPU転送向けのバッファをstd::vectorで扱うために使う
+template <typename T, size_t Alignment>
+struct AlignedAllocator {
+  using value_type = T;
+
+  template <typename U>
+  struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+  AlignedAllocator() = default;
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+  T* allocate(const size_t n) {
+    void* p = nullptr;
+#if defined (_MSC_VER)
+    p = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+    if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) p = nullptr;
+#endif
+    if (!p) throw std::bad_alloc();
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, const size_t) {
+#if defined (_MSC_VER)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+  }
+};
+
+template <typename T, typename U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) { return true; }
+
+template <typename T, typename U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) { return false; }
@@ -25,6 +25,18 @@
 #define WEIGHT_WORKAROUND
 // フルパス指定
 #define USE_FULL_PATH
+// 読み込み時のメモリ確保を計測
+//   グローバルなnew/deleteを置き換えるので、計測する時だけ有効にする
+// #define ALLOC_COUNTER
+// 行列が変わったボーンの頂点だけスキニングし直す
+#define USE_DELTA_SKINNING
+// 影響するボーンの数ごとに分けてスキニングする
+#define USE_SKIN_GROUP
+// 動かないメッシュを読み込み時にまとめる
+#define USE_STATIC_BATCH
+// ハードウェアカウンタで各段階を計測(Linuxのみ)
+//   readのシステムコールが段階ごとに入るので、計測する時だけ有効にする
+// #define USE_PERF_COUNTER
 
 
 #include <map>
@@ -32,19 +44,56 @@
 #include <limits>
 
 #include "common.hpp"
+#include "allocator.hpp"
+#include "memory.hpp"
+#include "import.hpp"
 #include "material.hpp"
 #include "texture.hpp"
 #include "mesh.hpp"
 #include "texture.hpp"
+#include "skinning.hpp"
 #include "node.hpp"
+#include "batch.hpp"
 #include "animation.hpp"
+#include "sampler.hpp"
+#include "asset.hpp"
+#include "progressive.hpp"
 
 
 struct Model {
-  std::vector<Material> material;
+  Model()
+    : import_preset(IMPORT_PRESET_STANDARD),
+      has_anim(false),
+      anim_budget(64 * 1024 * 1024),
+      anim_resident_bytes(0),
+      anim_use_count(0)
+  {
+    std::fill(std::begin(alloc_stat), std::end(alloc_stat), AllocStat{ 0, 0 });
+    std::fill(std::begin(load_time), std::end(load_time), 0.0);
+    for (auto& stat : load_perf) {
+      clearPerfStat(stat);
+    }
+  }
+
+  // ノード、ボーンのウェイト、キーフレームはここから確保される
+  ArenaRef arena;
+
+  // 読み込み段階ごとのヒープ確保回数とサイズ
+  AllocStat alloc_stat[LOAD_STAGE_NUM];
+
+  // 読み込みに使ったプリセット
+  int import_preset;
+  // Assimpの各処理と、読み込み段階ごとの処理時間
+  std::vector<ImportTiming> import_timing;
+  double load_time[LOAD_STAGE_NUM];
+  PerfStat load_perf[LOAD_STAGE_NUM];
+
+  // マテリアル、テクスチャ、アニメーションは同じファイルを読んだ他のモデルと共有する
+  std::vector<std::shared_ptr<const Material> > material;
 
   // マテリアルからのテクスチャ参照は名前引き
-  std::map<std::string, ci::gl::TextureRef> textures;
+  //   段階的に読み込む場合は、画像が届くまで仮のテクスチャを指す
+  std::map<std::string, TextureSlotRef> textures;
 
   // 親子関係にあるノード
   std::shared_ptr<Node> node;
@@ -54,9 +103,31 @@ struct Model {
 
   // 親子関係を解除した状態(全ノードの行列を更新する時に使う)
   std::vector<std::shared_ptr<Node> > node_list;
+  // node_list での親の位置(ルートは-1)
+  std::vector<int> node_parent;
+
+  // 動かないメッシュをまとめたもの
+  //   まとめたメッシュはノードから取り除いてある
+  std::vector<StaticBatch> static_batch;
 
   bool has_anim;
-  std::vector<Anim> animation;
+  std::vector<AnimClip> animation;
+
+  // 展開したアニメーションの上限(バイト)
+  size_t anim_budget;
+  size_t anim_resident_bytes;
+  u_int anim_use_count;
+
+  // アニメーションのサンプリング用作業領域
+  AnimSampler sampler;
+
+  // スキニング時のカリングに使う視錐台(モデル空間)
+  //   無効なら全てのメッシュをスキニングする
+  Frustum frustum;
+
+  // アニメーションの展開元
+  //   メッシュなど読み込み後に不要なデータは解放してある
+  std::shared_ptr<const aiScene> source;
 
   ci::AxisAlignedBox3f aabb;
 
@@ -105,6 +176,10 @@ void normalizeMeshWeight(Model& model) {
           }
         }
       }
+
+      // 頂点ごとのウェイトも作り直す
+      createBoneInfluence(mesh);
+      mesh.skin_history[0].valid = mesh.skin_history[1].valid = false;
     }
   }
 }
@@ -123,73 +198,694 @@ std::pair<size_t, size_t> getMeshInfo(const Model& model) {
       triangle_num += mesh.body.getNumIndices() / 3;
     }
   }
+  for (const auto& batch : model.static_batch) {
+    vertex_num += batch.mesh.body.getNumVertices();
+    triangle_num += batch.mesh.body.getNumIndices() / 3;
+  }
 
   return std::make_pair(vertex_num, triangle_num);
 }
 
+// 展開済みのキーフレームのサイズ
+size_t getAnimationBytes(const Anim& animation, size_t& name_bytes) {
+  size_t bytes = sizeof(Anim) + getVectorBytes(animation.body) + getVectorBytes(animation.mesh_body);
+  for (const auto& node_anim : animation.body) {
+    bytes += getVectorBytes(node_anim.translate) + getVectorBytes(node_anim.scaling) + getVectorBytes(node_anim.rotation);
+    name_bytes += getStringBytes(node_anim.node_name);
+  }
+  for (const auto& mesh_anim : animation.mesh_body) {
+    bytes += getVectorBytes(mesh_anim.track);
+    for (const auto& track : mesh_anim.track) {
+      bytes += getVectorBytes(track.keys);
+    }
+    name_bytes += getStringBytes(mesh_anim.mesh_name);
+  }
 
-// 階層アニメーション用の行列を計算
-void updateNodeMatrix(Model& model, const double time, const Anim& animation) {
-  for (const auto& body : animation.body) {
-    ci::Matrix44f matrix;
+  return bytes;
+}
+
+// メッシュ一つ分
+void addMeshMemory(MemoryReport& report, const Mesh& mesh) {
+  auto& bytes = report.bytes;
+
+  const auto& body = mesh.body;
+  bytes[MEMORY_MESH] += getVectorBytes(body.getVertices())
+                      + getVectorBytes(body.getNormals())
+                      + getVectorBytes(body.getTexCoords())
+                      + getVectorBytes(body.getColorsRGBA())
+                      + getVectorBytes(body.getIndices());
+
+  bytes[MEMORY_SKIN] += getVectorBytes(mesh.skin.body[0])
+                      + getVectorBytes(mesh.skin.body[1])
+                      + getVectorBytes(mesh.skin.blend)
+                      + getVectorBytes(mesh.bone_matrix)
+                      + getVectorBytes(mesh.skin_history[0].palette)
+                      + getVectorBytes(mesh.skin_history[1].palette)
+                      + getVectorBytes(mesh.skin_mark);
+
+  bytes[MEMORY_WEIGHT] += getVectorBytes(mesh.bones);
+  for (const auto& bone : mesh.bones) {
+    bytes[MEMORY_WEIGHT] += getVectorBytes(bone.weights);
+    bytes[MEMORY_NAME]   += getStringBytes(bone.name);
+  }
+
+  bytes[MEMORY_MORPH] += getVectorBytes(mesh.morph)
+                       + getVectorBytes(mesh.morph_weight)
+                       + getVectorBytes(mesh.morph_applied)
+                       + getVectorBytes(mesh.morph_vtx);
+  for (const auto& target : mesh.morph) {
+    bytes[MEMORY_MORPH] += getVectorBytes(target.index) + getVectorBytes(target.delta);
+    bytes[MEMORY_NAME]  += getStringBytes(target.name);
+  }
+
+  for (const auto& group : mesh.skin_group) {
+    bytes[MEMORY_WEIGHT] += getVectorBytes(group);
+  }
+
+  bytes[MEMORY_PICK] += getVectorBytes(mesh.bvh.node)
+                      + getVectorBytes(mesh.bvh.triangle)
+                      + getVectorBytes(mesh.influence_offset)
+                      + getVectorBytes(mesh.influence);
+
+  bytes[MEMORY_NAME] += getStringBytes(mesh.name);
+}
+
+// モデルのメモリ使用量を種類ごとに集計する
+MemoryReport getModelMemory(const Model& model) {
+  MemoryReport report;
+  auto& bytes = report.bytes;
+
+  for (const auto& node : model.node_list) {
+    bytes[MEMORY_NODE] += sizeof(Node) + getVectorBytes(node->children);
+    bytes[MEMORY_NAME] += getStringBytes(node->name);
+
+    bytes[MEMORY_MESH] += getVectorBytes(node->mesh);
+    for (const auto& mesh : node->mesh) {
+      addMeshMemory(report, mesh);
+    }
+  }
+
+  bytes[MEMORY_MESH] += getVectorBytes(model.static_batch);
+  for (const auto& batch : model.static_batch) {
+    addMeshMemory(report, batch.mesh);
+
+    // 元のメッシュの対応表はピッキング用
+    bytes[MEMORY_PICK] += getVectorBytes(batch.source);
+    for (const auto& source : batch.source) {
+      bytes[MEMORY_NAME] += getStringBytes(source.name);
+    }
+  }
+
+  // 索引(mapの管理領域は含まない)
+  bytes[MEMORY_NODE] += getVectorBytes(model.node_list)
+                      + getVectorBytes(model.node_parent)
+                      + model.node_index.size() * sizeof(std::pair<const std::string, std::shared_ptr<Node> >);
+  for (const auto& it : model.node_index) {
+    bytes[MEMORY_NAME] += getStringBytes(it.first);
+  }
+
+  bytes[MEMORY_KEYFRAME] += getVectorBytes(model.animation);
+  for (const auto& clip : model.animation) {
+    ClipMemory info;
+    info.name           = clip.name;
+    info.resident       = bool(clip.body);
+    info.keyframe_bytes = clip.body ? getAnimationBytes(*clip.body, bytes[MEMORY_NAME]) : clip.bytes;
+    info.bake_bytes     = 0;
+    if (clip.palette) {
+      const auto& palette = *clip.palette;
+      info.bake_bytes = sizeof(PaletteBake)
+                      + getVectorBytes(palette.node)
+                      + getVectorBytes(palette.node_matrix)
+                      + getVectorBytes(palette.palette)
+                      + getVectorBytes(palette.morph_weight);
+    }
+    report.clip.push_back(info);
+
+    if (info.resident) bytes[MEMORY_KEYFRAME] += info.keyframe_bytes;
+    bytes[MEMORY_BAKE] += info.bake_bytes;
+    bytes[MEMORY_NAME] += getStringBytes(clip.name);
+  }
+
+  for (const auto& it : model.textures) {
+    bytes[MEMORY_NAME]    += getStringBytes(it.first);
+    bytes[MEMORY_TEXTURE] += it.second->bytes;
+  }
+  for (const auto& material : model.material) {
+    bytes[MEMORY_NAME] += getStringBytes(material->texture_name);
+  }
+
+  if (model.arena) {
+    report.arena_used     = model.arena->getUsedBytes();
+    report.arena_reserved = model.arena->getReservedBytes();
+  }
+
+  return report;
+}
+
+
+// チャンネルが書き換えるノードの対応表を作る
+//   モデルに無いノードを書き換えるチャンネルがあれば、束縛できないのでnull
+std::shared_ptr<const std::vector<u_int> > createChannelRemap(const Model& model, const aiAnimation* anim) {
+  std::map<const Node*, u_int> node_position;
+  for (u_int i = 0; i < model.node_list.size(); ++i) {
+    node_position.insert(std::make_pair(model.node_list[i].get(), i));
+  }
+
+  auto remap = std::make_shared<std::vector<u_int> >();
+  remap->reserve(anim->mNumChannels);
+  for (u_int i = 0; i < anim->mNumChannels; ++i) {
+    auto it = model.node_index.find(anim->mChannels[i]->mNodeName.C_Str());
+    if (it == model.node_index.end()) {
+      ci::app::console() << "Anim channel not found:" << anim->mChannels[i]->mNodeName.C_Str() << std::endl;
+      return std::shared_ptr<const std::vector<u_int> >();
+    }
+    remap->push_back(node_position.at(it->second.get()));
+  }
+
+  return remap;
+}
+
+
+// アニメーションで動くノード(Model::node_list 順)
+//   チャンネルが書き換えるノードと、その子孫
+std::vector<bool> getAnimatedNode(const Model& model) {
+  size_t node_num = model.node_list.size();
+  std::vector<bool> target(node_num, false);
+
+  std::map<const Node*, u_int> node_position;
+  for (u_int i = 0; i < node_num; ++i) {
+    node_position.insert(std::make_pair(model.node_list[i].get(), i));
+  }
+
+  for (const auto& clip : model.animation) {
+    if (clip.channel_node) {
+      for (auto i : *clip.channel_node) {
+        target[i] = true;
+      }
+      continue;
+    }
+
+    // 対応表が無ければ名前で探す
+    std::vector<std::string> names;
+    if (clip.body) {
+      for (const auto& node_anim : clip.body->body) {
+        names.push_back(node_anim.node_name);
+      }
+    }
+    else if (clip.source) {
+      for (u_int i = 0; i < clip.source->mNumChannels; ++i) {
+        names.push_back(clip.source->mChannels[i]->mNodeName.C_Str());
+      }
+    }
+    for (const auto& name : names) {
+      auto it = model.node_index.find(name);
+      if (it != model.node_index.end()) target[node_position.at(it->second.get())] = true;
+    }
+  }
+
+  // 祖先が動けば一緒に動く
+  std::vector<bool> animated(node_num, false);
+  for (size_t i = 0; i < node_num; ++i) {
+    for (int n = int(i); n >= 0; n = model.node_parent[n]) {
+      if (target[n]) {
+        animated[i] = true;
+        break;
+      }
+    }
+  }
+
+  return animated;
+}
+
+// 動かないメッシュをマテリアルごとにまとめる
+//   アニメーションで動かないノードの、スキニングもモーフターゲットも無いメッシュが対象
+//   ノードの行列は読み込み時の姿勢で求めておく
+void createStaticBatch(Model& model) {
+  auto animated = getAnimatedNode(model);
+
+  // まとめている途中のもの
+  std::map<u_int, size_t> open;
+  u_int mesh_num = 0;
+
+  for (u_int n = 0; n < model.node_list.size(); ++n) {
+    if (animated[n]) continue;
+
+    auto& node = *model.node_list[n];
+    if (node.mesh.empty()) continue;
+
+    std::vector<Mesh> keep;
+    for (u_int m = 0; m < node.mesh.size(); ++m) {
+      auto& mesh = node.mesh[m];
+      size_t vertex_num = mesh.body.getNumVertices();
+      if (isDynamicMesh(mesh) || !mesh.body.getNumIndices() || (vertex_num > STATIC_BATCH_VERTEX_MAX)) {
+        keep.push_back(std::move(mesh));
+        continue;
+      }
+
+      // 入りきらなければ新しく始める
+      u_int key = getBatchKey(mesh);
+      auto it = open.find(key);
+      if ((it == open.end())
+          || ((model.static_batch[it->second].mesh.body.getNumVertices() + vertex_num) > STATIC_BATCH_VERTEX_MAX)) {
+        open[key] = model.static_batch.size();
+
+        model.static_batch.emplace_back();
+        auto& batch = model.static_batch.back();
+        batch.mesh.name = "batch" + std::to_string(model.static_batch.size() - 1);
+        batch.mesh.material_index = mesh.material_index;
+      }
+
+      BatchSource source{ n, m, mesh.name, 0, 0 };
+      appendBatchMesh(model.static_batch[open[key]], mesh, node.global_matrix, node.invert_matrix, source);
+      mesh_num += 1;
+    }
+    node.mesh = std::move(keep);
+  }
 
-    // 階層アニメーションを取り出して行列を生成
-    ci::Vec3f transtate = getLerpValue(time, body.translate);
-    matrix.translate(transtate);
+  for (auto& batch : model.static_batch) {
+    setupMesh(batch.mesh);
+  }
+
+  ci::app::console() << "Static batch: " << mesh_num << " meshes -> " << model.static_batch.size() << " batches" << std::endl;
+}
+
+// チャンネルが、まとめたメッシュのノードを動かすか
+//   channel_node は Model::node_list の位置
+bool isStaticBatchAnimated(const Model& model, const std::vector<u_int>& channel_node) {
+  if (model.static_batch.empty()) return false;
+
+  std::vector<bool> target(model.node_list.size(), false);
+  for (auto i : channel_node) {
+    target[i] = true;
+  }
+
+  for (const auto& batch : model.static_batch) {
+    for (const auto& source : batch.source) {
+      for (int n = int(source.node); n >= 0; n = model.node_parent[n]) {
+        if (target[n]) return true;
+      }
+    }
+  }
+
+  return false;
+}
 
-    ci::Quatf rotation = getLerpValue(time, body.rotation);
-    matrix *= rotation;
 
-    ci::Vec3f scaling = getLerpValue(time, body.scaling);
-    matrix.scale(scaling);
+// 階層アニメーション用の行列を計算
+//   全チャンネルをまとめてサンプリングしてから行列を生成する
+//   channel_node があれば、ノードを名前で探さずに済ませる
+void updateNodeMatrix(Model& model, const double time, const Anim& animation,
+                      const std::vector<u_int>* channel_node = nullptr) {
+  ScopedAnimStage stage(ANIM_STAGE_SAMPLING);
+
+  auto& sampler = model.sampler;
+  if (channel_node) {
+    setupAnimSampler(sampler, model.node_list, *channel_node, animation);
+  }
+  else {
+    setupAnimSampler(sampler, model.node_index, animation);
+  }
+  sampleAnimation(sampler, animation, time);
 
+  for (size_t i = 0; i < sampler.channel_num; ++i) {
     // ノードの行列を書き換える
-    auto node = model.node_index.at(body.node_name);
-    node->matrix = matrix;
+    sampler.node[i]->matrix = composeAffine(getSampledTranslate(sampler, i),
+                                            getSampledRotation(sampler, i),
+                                            getSampledScaling(sampler, i));
+  }
+}
+
+// 書き込み先の内容を作ったボーン行列を覚えておく
+void storeSkinHistory(Mesh& mesh, const Affine* bone_matrix) {
+  auto& history = mesh.skin_history[mesh.skin.front ^ 1];
+  history.palette.assign(bone_matrix, bone_matrix + mesh.bones.size());
+  history.morph_serial = mesh.morph_serial;
+  history.valid = true;
+}
+
+// スキニング
+//   bone_matrix は Mesh::bones 順
+//   結果はメッシュのSkinBufferへインターリーブ形式で書き出す
+void skinMesh(Mesh& mesh, const Affine* bone_matrix) {
+  // 変換結果を書き出す頂点配列
+  auto& skin_vtx = mesh.skin.getBack();
+
+#if defined (USE_SKIN_GROUP)
+  // 頂点ごとに、影響するボーンの数に合わせた処理で計算する
+  skinMeshGroups(mesh, bone_matrix, skin_vtx.data());
+#else
+  const SkinVertex zero{ ci::Vec3f::zero(), 1.0f, ci::Vec3f::zero(), 0.0f };
+  std::fill(skin_vtx.begin() + mesh.skin_begin, skin_vtx.begin() + mesh.skin_end, zero);
+
+  bool has_normal = mesh.body.hasNormals();
+
+  if (mesh.has_morph) {
+    // モーフターゲット適用後の頂点から
+    const auto& orig_vtx = mesh.morph_vtx;
+    for (u_int i = 0; i < mesh.bones.size(); ++i) {
+      const auto& bone = mesh.bones[i];
+      const auto& m    = bone_matrix[i];
+
+      for (const auto& weight : bone.weights) {
+        auto& v = skin_vtx[weight.vertex_id];
+        const auto& src = orig_vtx[weight.vertex_id];
+        v.position += weight.value * m.transformPoint(src.position);
+        if (has_normal) v.normal += weight.value * m.transformVec(src.normal);
+      }
+    }
+  }
+  else {
+    // オリジナルの頂点データ
+    const auto& orig_vtx    = mesh.body.getVertices();
+    const auto& orig_normal = mesh.body.getNormals();
+
+    // 全頂点の座標を再計算
+    for (u_int i = 0; i < mesh.bones.size(); ++i) {
+      const auto& bone = mesh.bones[i];
+      const auto& m    = bone_matrix[i];
+
+      if (has_normal) {
+        for (const auto& weight : bone.weights) {
+          auto& v = skin_vtx[weight.vertex_id];
+          v.position += weight.value * m.transformPoint(orig_vtx[weight.vertex_id]);
+          v.normal   += weight.value * m.transformVec(orig_normal[weight.vertex_id]);
+        }
+      }
+      else {
+        for (const auto& weight : bone.weights) {
+          skin_vtx[weight.vertex_id].position += weight.value * m.transformPoint(orig_vtx[weight.vertex_id]);
+        }
+      }
+    }
+  }
+#endif
+
+  // 描画側へ公開
+  storeSkinHistory(mesh, bone_matrix);
+  mesh.skin.swap(mesh.skin_begin, mesh.skin_end);
+}
+
+#if defined (USE_DELTA_SKINNING)
+
+// 行列の成分の差がこれ以下なら、変わっていないとみなす
+const float DELTA_SKIN_EPSILON = 1.0e-5f;
+// 計算し直すウェイトの割合がこれを超えたら全体をスキニングする
+const float DELTA_SKIN_THRESHOLD = 0.5f;
+
+// 差分スキニング
+//   書き込み先(back)を前回書いた時から行列が変わったボーンについて
+//   そのボーンのウェイトを持つ頂点だけを、頂点ごとのウェイトから計算し直す
+//   差分で済まない時は何もせずfalseを返す
+bool skinMeshDelta(Mesh& mesh, const Affine* bone_matrix) {
+  auto& back_history        = mesh.skin_history[mesh.skin.front ^ 1];
+  const auto& front_history = mesh.skin_history[mesh.skin.front];
+  if (!back_history.valid || (back_history.morph_serial != mesh.morph_serial)) return false;
+
+  // 変わったボーンを調べる
+  //   差が小さいボーンは記録を更新しないので、少しずつ動いても誤差は溜まらない
+  std::vector<u_int> changed;
+  size_t weight_num = 0;
+  for (u_int i = 0; i < mesh.bones.size(); ++i) {
+    if (isNearlyEqual(bone_matrix[i], back_history.palette[i], DELTA_SKIN_EPSILON)) continue;
+
+    changed.push_back(i);
+    weight_num += mesh.bones[i].weights.size();
+  }
+  if (weight_num > mesh.influence.size() * DELTA_SKIN_THRESHOLD) return false;
+
+  // 表示中(front)から変わった頂点の範囲
+  //   backとfrontで姿勢が違うボーンも含める
+  u_int dirty_begin = mesh.skin_begin;
+  u_int dirty_end   = mesh.skin_end;
+  if (front_history.valid && (front_history.morph_serial == mesh.morph_serial)) {
+    dirty_begin = std::numeric_limits<u_int>::max();
+    dirty_end   = 0;
+    for (u_int i = 0; i < mesh.bones.size(); ++i) {
+      const auto& bone = mesh.bones[i];
+      if (bone.vertex_begin == bone.vertex_end) continue;
+      if (isNearlyEqual(bone_matrix[i], front_history.palette[i], DELTA_SKIN_EPSILON)
+          && isNearlyEqual(bone_matrix[i], back_history.palette[i], DELTA_SKIN_EPSILON)) continue;
+
+      dirty_begin = std::min(dirty_begin, bone.vertex_begin);
+      dirty_end   = std::max(dirty_end, bone.vertex_end);
+    }
+    dirty_begin = std::min(dirty_begin, dirty_end);
+  }
+
+  // 計算済みの印を付け直す
+  mesh.skin_stamp += 1;
+  if (mesh.skin_stamp == 0) {
+    std::fill(mesh.skin_mark.begin(), mesh.skin_mark.end(), 0);
+    mesh.skin_stamp = 1;
+  }
+
+  auto& skin_vtx = mesh.skin.getBack();
+#if !defined (USE_SKIN_GROUP)
+  bool has_normal = mesh.body.hasNormals();
+  const auto& orig_vtx    = mesh.body.getVertices();
+  const auto& orig_normal = mesh.body.getNormals();
+#endif
+
+  for (auto b : changed) {
+    for (const auto& weight : mesh.bones[b].weights) {
+      u_int id = weight.vertex_id;
+      if (mesh.skin_mark[id] == mesh.skin_stamp) continue;
+      mesh.skin_mark[id] = mesh.skin_stamp;
+
+#if defined (USE_SKIN_GROUP)
+      skinMeshVertex(mesh, id, bone_matrix, skin_vtx[id]);
+#else
+      ci::Vec3f src_position = mesh.has_morph ? mesh.morph_vtx[id].position : orig_vtx[id];
+      ci::Vec3f src_normal   = mesh.has_morph ? mesh.morph_vtx[id].normal
+                                              : (has_normal ? orig_normal[id] : ci::Vec3f::zero());
+
+      auto& v = skin_vtx[id];
+      v.position = ci::Vec3f::zero();
+      v.normal   = ci::Vec3f::zero();
+      for (u_int k = mesh.influence_offset[id]; k < mesh.influence_offset[id + 1]; ++k) {
+        const auto& influence = mesh.influence[k];
+        const auto& m = bone_matrix[influence.bone];
+        v.position += influence.value * m.transformPoint(src_position);
+        if (has_normal) v.normal += influence.value * m.transformVec(src_normal);
+      }
+#endif
+    }
+
+    back_history.palette[b] = bone_matrix[b];
+  }
+
+  mesh.skin.swap(dirty_begin, dirty_end);
+  return true;
+}
+
+#endif
+
+// メッシュのボーン行列を求める
+void getBoneMatrix(const Model& model, const Node& node, const Mesh& mesh, std::vector<Affine>& bone_matrix) {
+  for (const auto& bone : mesh.bones) {
+    auto local_node = model.node_index.at(bone.name);
+    bone_matrix.push_back(node.invert_matrix * local_node->global_matrix * bone.offset);
   }
 }
 
+// モーフターゲットの結果をそのまま書き出す(骨を持たないメッシュ用)
+void copyMorphMesh(Mesh& mesh) {
+  auto& skin_vtx = mesh.skin.getBack();
+  std::copy(mesh.morph_vtx.begin() + mesh.skin_begin, mesh.morph_vtx.begin() + mesh.skin_end,
+            skin_vtx.begin() + mesh.skin_begin);
+
+  mesh.skin.swap(mesh.skin_begin, mesh.skin_end);
+}
+
+// スキニング(モーフターゲットの適用を含む)
+//   Mesh::bone_matrix は事前に求めておく
+void skinDynamicMesh(Mesh& mesh) {
+  // スキニングの前にモーフターゲットを適用
+  if (mesh.has_morph) applyMorphTargets(mesh);
+
+  if (mesh.has_bone) {
+#if defined (USE_DELTA_SKINNING)
+    bool skinned = skinMeshDelta(mesh, mesh.bone_matrix.data());
+#else
+    bool skinned = false;
+#endif
+    if (!skinned) skinMesh(mesh, mesh.bone_matrix.data());
+  }
+  else {
+    copyMorphMesh(mesh);
+  }
+  mesh.skin_pending = false;
+}
+
+// 現在の姿勢での範囲を求めて、見えていればスキニング
+//   見えていなければ後回しにする
+void updateDynamicMesh(const Frustum& frustum, const Node& node, Mesh& mesh) {
+  updateMeshBounds(mesh);
+
+  mesh.culled = !isVisible(frustum, node.global_matrix, mesh.bounds);
+  if (mesh.culled) {
+    mesh.skin_pending = true;
+    return;
+  }
+
+  skinDynamicMesh(mesh);
+}
+
+// 全メッシュのボーン行列を求めてから、まとめてスキニングする
 void updateMesh(Model& model) {
+  {
+    ScopedAnimStage stage(ANIM_STAGE_PALETTE);
+    for (const auto& node : model.node_list) {
+      for (auto& mesh : node->mesh) {
+        if (!isDynamicMesh(mesh)) continue;
+
+        // 座標変換に必要な行列を用意
+        mesh.bone_matrix.clear();
+        getBoneMatrix(model, *node, mesh, mesh.bone_matrix);
+      }
+    }
+  }
+
+  ScopedAnimStage stage(ANIM_STAGE_SKINNING);
   for (const auto& node : model.node_list) {
     for (auto& mesh : node->mesh) {
-      if (!mesh.has_bone) continue;
+      if (!isDynamicMesh(mesh)) continue;
 
-      // 座標変換に必要な行列を用意
-      std::vector<ci::Matrix44f> bone_matrix;
-      bone_matrix.reserve(mesh.bones.size());
-      for (auto& bone : mesh.bones) {
-        auto local_node = model.node_index.at(bone.name);
-        bone_matrix.push_back(node->invert_matrix * local_node->global_matrix * bone.offset);
+      updateDynamicMesh(model.frustum, *node, mesh);
+      if (!mesh.culled) stage.vertex_num += mesh.body.getNumVertices();
+    }
+  }
+}
+
+// 視錐台カリング
+//   スキニングを後回しにしていたメッシュが見えるようになっていたら、ここでスキニングする
+void cullModel(Model& model, const Frustum& frustum) {
+  for (const auto& node : model.node_list) {
+    for (auto& mesh : node->mesh) {
+      if (isDynamicMesh(mesh)) {
+        mesh.culled = !isVisible(frustum, node->global_matrix, mesh.bounds);
+        if (!mesh.culled && mesh.skin_pending) skinDynamicMesh(mesh);
+      }
+      else {
+        mesh.culled = !isVisible(frustum, node->global_matrix, mesh.bind_bounds);
       }
+    }
+  }
+
+  // まとめたメッシュはモデル空間
+  for (auto& batch : model.static_batch) {
+    batch.mesh.culled = !isVisible(frustum, batch.mesh.bind_bounds);
+  }
+}
+
+// モーフターゲットのウェイトを更新
+//   アニメーションに含まれないメッシュのウェイトは0にする
+void updateMorphWeight(Model& model, const double time, const Anim& animation) {
+  for (const auto& node : model.node_list) {
+    for (auto& mesh : node->mesh) {
+      std::fill(mesh.morph_weight.begin(), mesh.morph_weight.end(), 0.0f);
+    }
+  }
 
-      // 変換結果を書き出す頂点配列
-      auto& body_vtx    = mesh.body.getVertices();
-      auto& body_normal = mesh.body.getNormals();
+  for (const auto& mesh_anim : animation.mesh_body) {
+    for (const auto& node : model.node_list) {
+      for (auto& mesh : node->mesh) {
+        if (!mesh.has_morph || (mesh.name != mesh_anim.mesh_name)) continue;
 
-      std::fill(body_vtx.begin(), body_vtx.end(), ci::Vec3f::zero());
-      if (mesh.body.hasNormals()) {
-        std::fill(body_normal.begin(), body_normal.end(), ci::Vec3f::zero());
+        for (const auto& track : mesh_anim.track) {
+          if (track.target >= mesh.morph_weight.size()) continue;
+          mesh.morph_weight[track.target] = getLerpValue(time, track.keys);
+        }
       }
+    }
+  }
+}
 
-      // オリジナルの頂点データ
-      const auto& orig_vtx    = mesh.orig.getVertices();
-      const auto& orig_normal = mesh.orig.getNormals();
+// 上限を超えていたら、しばらく使っていないアニメーションから追い出す
+//   keep は追い出さない
+void evictAnimation(Model& model, const size_t keep) {
+  while (model.anim_resident_bytes > model.anim_budget) {
+    AnimClip* oldest = nullptr;
+    for (size_t i = 0; i < model.animation.size(); ++i) {
+      auto& clip = model.animation[i];
+      if ((i == keep) || !clip.body) continue;
+      if (!oldest || (clip.last_use < oldest->last_use)) oldest = &clip;
+    }
+    if (!oldest) break;
 
-      // 全頂点の座標を再計算
-      for (u_int i = 0; i < mesh.bones.size(); ++i) {
-        const auto& bone = mesh.bones[i];
-        const auto& m    = bone_matrix[i];
+    ci::app::console() << "Anim evict:" << oldest->name << std::endl;
+    oldest->body.reset();
+    model.anim_resident_bytes -= oldest->bytes;
+  }
+}
 
-        for (const auto& weight : bone.weights) {
-          body_vtx[weight.vertex_id] += weight.value * (m * orig_vtx[weight.vertex_id]);
-        }
+// 使う前にアニメーションを展開しておく
+void prefetchAnimation(Model& model, const size_t index) {
+  auto& clip = model.animation[index];
+  if (clip.body) return;
 
-        if (mesh.body.hasNormals()) {
-          for (const auto& weight : bone.weights) {
-            body_normal[weight.vertex_id] += weight.value * m.transformVec(orig_normal[weight.vertex_id]);
-          }
+  decodeSharedAnimation(clip);
+  model.anim_resident_bytes += clip.bytes;
+  clip.last_use = model.anim_use_count;
+
+  evictAnimation(model, index);
+}
+
+// アニメーションを取り出す
+//   未展開ならここで展開する
+std::shared_ptr<const Anim> getAnimation(Model& model, const size_t index) {
+  prefetchAnimation(model, index);
+
+  model.anim_use_count += 1;
+  auto& clip = model.animation[index];
+  clip.last_use = model.anim_use_count;
+
+  return clip.body;
+}
+
+// ボーン行列のベイク結果で更新
+//   ノード階層は計算せず、補間した行列で直接スキニングする
+void updateModel(Model& model, const double time, const PaletteBake& bake) {
+  u_int frame0;
+  u_int frame1;
+  float alpha;
+  getBakedFrame(bake.duration, bake.rate, bake.frame_num, time, frame0, frame1, alpha);
+
+  size_t node_num = bake.node.size();
+  for (size_t i = 0; i < node_num; ++i) {
+    model.node_list[bake.node[i]]->global_matrix = lerpAffine(bake.node_matrix[frame0 * node_num + i],
+                                                              bake.node_matrix[frame1 * node_num + i],
+                                                              alpha);
+  }
+
+  const Affine* palette0 = &bake.palette[size_t(frame0) * bake.bone_num];
+  const Affine* palette1 = &bake.palette[size_t(frame1) * bake.bone_num];
+
+  const float* weight0 = bake.morph_num ? &bake.morph_weight[size_t(frame0) * bake.morph_num] : nullptr;
+  const float* weight1 = bake.morph_num ? &bake.morph_weight[size_t(frame1) * bake.morph_num] : nullptr;
+
+  u_int bone_index  = 0;
+  u_int morph_index = 0;
+  for (const auto& node : model.node_list) {
+    for (auto& mesh : node->mesh) {
+      if (!isDynamicMesh(mesh)) continue;
+
+      if (mesh.has_morph) {
+        for (size_t i = 0; i < mesh.morph_weight.size(); ++i) {
+          float w0 = weight0[morph_index + i];
+          float w1 = weight1[morph_index + i];
+          mesh.morph_weight[i] = w0 + (w1 - w0) * alpha;
         }
+        morph_index += u_int(mesh.morph_weight.size());
+      }
+
+      mesh.bone_matrix.resize(mesh.bones.size());
+      for (size_t i = 0; i < mesh.bones.size(); ++i) {
+        mesh.bone_matrix[i] = lerpAffine(palette0[bone_index + i], palette1[bone_index + i], alpha);
       }
+      bone_index += u_int(mesh.bones.size());
+
+      updateDynamicMesh(model.frustum, *node, mesh);
     }
   }
 }
@@ -198,26 +894,101 @@ void updateMesh(Model& model) {
 void updateModel(Model& model, const double time, const size_t index) {
   if (!model.has_anim) return;
 
+  // ボーン行列をベイクしてあればそちらを使う
+  if (model.animation[index].palette) {
+    updateModel(model, time, *model.animation[index].palette);
+    return;
+  }
+
+  auto animation = getAnimation(model, index);
+
   // 最大時間でループさせている
-  double current_time = std::fmod(time, model.animation[index].duration);
+  double current_time = std::fmod(time, animation->duration);
 
   // アニメーションで全ノードの行列を更新
-  updateNodeMatrix(model, current_time, model.animation[index]);
+  updateNodeMatrix(model, current_time, *animation, model.animation[index].channel_node.get());
+  updateMorphWeight(model, current_time, *animation);
 
   // ノードの行列を再計算
-  updateNodeDerivedMatrix(model.node, ci::Matrix44f::identity());
+  {
+    ScopedAnimStage stage(ANIM_STAGE_HIERARCHY);
+    updateNodeDerivedMatrix(model.node, Affine::identity());
+  }
 
   // メッシュアニメーションを適用
   updateMesh(model);
 }
 
+// ボーン行列をベイクしてアニメーションに持たせる
+//   rate は単位時間あたりのフレーム数
+//   モデルのノードとスキニング結果は書き換わる
+void bakeBonePalette(Model& model, const size_t index, const double rate) {
+  assert(model.has_anim);
+  assert(rate > 0.0);
+
+  auto& clip = model.animation[index];
+  clip.palette.reset();
+
+  auto bake = std::make_shared<PaletteBake>();
+  bake->duration  = clip.duration;
+  bake->rate      = rate;
+  bake->frame_num = std::max(u_int(std::ceil(clip.duration * rate)), u_int(1));
+
+  for (u_int i = 0; i < model.node_list.size(); ++i) {
+    const auto& node = model.node_list[i];
+    if (node->mesh.empty()) continue;
+
+    bake->node.push_back(i);
+    for (const auto& mesh : node->mesh) {
+      if (mesh.has_bone) bake->bone_num += u_int(mesh.bones.size());
+      if (mesh.has_morph) bake->morph_num += u_int(mesh.morph.size());
+    }
+  }
+
+  bake->node_matrix.reserve(bake->node.size() * bake->frame_num);
+  bake->palette.reserve(size_t(bake->bone_num) * bake->frame_num);
+  for (u_int f = 0; f < bake->frame_num; ++f) {
+    updateModel(model, f / rate, index);
+
+    for (auto i : bake->node) {
+      bake->node_matrix.push_back(model.node_list[i]->global_matrix);
+    }
+
+    for (const auto& node : model.node_list) {
+      for (const auto& mesh : node->mesh) {
+        if (mesh.has_bone) getBoneMatrix(model, *node, mesh, bake->palette);
+        if (mesh.has_morph) {
+          bake->morph_weight.insert(bake->morph_weight.end(), mesh.morph_weight.begin(), mesh.morph_weight.end());
+        }
+      }
+    }
+  }
+
+  bake->bytes = (bake->node_matrix.size() + bake->palette.size()) * sizeof(Affine)
+              + bake->morph_weight.size() * sizeof(float);
+  clip.palette = bake;
+
+  ci::app::console() << "Palette bake:" << clip.name
+                     << " frames:" << bake->frame_num
+                     << " bones:" << bake->bone_num
+                     << " bytes:" << bake->bytes << std::endl;
+}
+
 // 全頂点を元に戻す
 void resetMesh(Model& model) {
   for (const auto& node : model.node_list) {
     for (auto& mesh : node->mesh) {
-      if (!mesh.has_bone) continue;
-
-      mesh.body = mesh.orig;
+      if (!isDynamicMesh(mesh)) continue;
+
+      resetSkinBuffer(mesh);
+      mesh.bounds       = mesh.bind_bounds;
+      mesh.culled       = false;
+      mesh.skin_pending = false;
+      if (mesh.has_morph) {
+        std::fill(mesh.morph_weight.begin(), mesh.morph_weight.end(), 0.0f);
+        std::fill(mesh.morph_applied.begin(), mesh.morph_applied.end(), 0.0f);
+        mesh.morph_vtx = mesh.skin.getFront();
+      }
     }
   }
 }
@@ -235,7 +1006,7 @@ void resetModelNodes(Model& model) {
 //   アニメーションで変化するのは考慮しない
 ci::AxisAlignedBox3f calcAABB(Model& model) {
   // ノードの行列を更新
-  updateNodeDerivedMatrix(model.node, ci::Matrix44f::identity());
+  updateNodeDerivedMatrix(model.node, Affine::identity());
 
   // スケルタルアニメーションを考慮
   updateModel(model, 0.0, 0);
@@ -252,10 +1023,26 @@ ci::AxisAlignedBox3f calcAABB(Model& model) {
   // 全頂点を調べてAABBの頂点座標を割り出す
   for (const auto& node : model.node_list) {
     for (const auto& mesh : node->mesh) {
+      if (isDynamicMesh(mesh)) {
+        // スキニング結果から求める
+        for (const auto& v : mesh.skin.getFront()) {
+          ci::Vec3f tv = node->global_matrix.transformPoint(v.position);
+
+          min_vtx.x = std::min(tv.x, min_vtx.x);
+          min_vtx.y = std::min(tv.y, min_vtx.y);
+          min_vtx.z = std::min(tv.z, min_vtx.z);
+
+          max_vtx.x = std::max(tv.x, max_vtx.x);
+          max_vtx.y = std::max(tv.y, max_vtx.y);
+          max_vtx.z = std::max(tv.z, max_vtx.z);
+        }
+        continue;
+      }
+
       const auto& verticies = mesh.body.getVertices();
       for (const auto v : verticies) {
         // ノードの行列でアフィン変換
-        ci::Vec3f tv = node->global_matrix * v;
+        ci::Vec3f tv = node->global_matrix.transformPoint(v);
 
         min_vtx.x = std::min(tv.x, min_vtx.x);
         min_vtx.y = std::min(tv.y, min_vtx.y);
@@ -268,26 +1055,135 @@ ci::AxisAlignedBox3f calcAABB(Model& model) {
     }
   }
 
+  // まとめたメッシュはモデル空間
+  for (const auto& batch : model.static_batch) {
+    for (const auto& v : batch.mesh.body.getVertices()) {
+      min_vtx.x = std::min(v.x, min_vtx.x);
+      min_vtx.y = std::min(v.y, min_vtx.y);
+      min_vtx.z = std::min(v.z, min_vtx.z);
+
+      max_vtx.x = std::max(v.x, max_vtx.x);
+      max_vtx.y = std::max(v.y, max_vtx.y);
+      max_vtx.z = std::max(v.z, max_vtx.z);
+    }
+  }
+
   return ci::AxisAlignedBox3f(min_vtx, max_vtx);
 }
 
 
+// アリーナに必要なサイズを見積もる
+//   アリーナから確保するのはノードとボーンのウェイト
+//   キーフレームはアニメーションごとのアリーナに置く
+size_t estimateArenaSize(const aiScene* scene) {
+  // アラインメントと共有ポインタの管理領域の分、少し多めに取っておく
+  const size_t margin = 64;
+
+  size_t size = countNode(scene->mRootNode) * (sizeof(Node) + margin);
+
+  for (u_int i = 0; i < scene->mNumMeshes; ++i) {
+    const aiMesh* m = scene->mMeshes[i];
+    for (u_int j = 0; j < m->mNumBones; ++j) {
+      size += m->mBones[j]->mNumWeights * sizeof(Weight) + margin;
+    }
+  }
+
+  return size;
+}
+
+// 読み込み後に不要になったデータを解放
+//   アニメーションの展開元として残すaiSceneから、メッシュと埋め込みテクスチャを取り除く
+void releaseSceneMeshes(aiScene* scene) {
+  for (u_int i = 0; i < scene->mNumMeshes; ++i) {
+    delete scene->mMeshes[i];
+  }
+  delete[] scene->mMeshes;
+  scene->mMeshes    = nullptr;
+  scene->mNumMeshes = 0;
+
+  for (u_int i = 0; i < scene->mNumTextures; ++i) {
+    delete scene->mTextures[i];
+  }
+  delete[] scene->mTextures;
+  scene->mTextures    = nullptr;
+  scene->mNumTextures = 0;
+}
+
+// 読み込み時のメモリ確保状況を表示
+void printAllocInfo(const Model& model) {
+#if defined (ALLOC_COUNTER)
+  ci::app::console() << "Heap allocation:" << std::endl;
+  printAllocStat(ci::app::console(), model.alloc_stat);
+#endif
+
+  ci::app::console() << "Arena: used " << model.arena->getUsedBytes()
+                     << " / reserved " << model.arena->getReservedBytes()
+                     << " bytes in " << model.arena->getBlockNum() << " blocks" << std::endl;
+}
+
+
+// 処理時間を表示
+void printImportTiming(const Model& model) {
+  ci::app::console() << "Import preset:" << getImportPreset(model.import_preset).name << std::endl;
+
+  for (const auto& t : model.import_timing) {
+    ci::app::console() << "  " << t.name << ": " << t.seconds * 1000.0 << " ms" << std::endl;
+  }
+  for (int i = 0; i < LOAD_STAGE_NUM; ++i) {
+    ci::app::console() << "  [" << getLoadStageName(i) << "]: " << model.load_time[i] * 1000.0 << " ms" << std::endl;
+  }
+
+  if (isPerfCounterAvailable()) {
+    ci::app::console() << "Load perf counter:" << std::endl;
+    for (int i = 0; i < LOAD_STAGE_NUM; ++i) {
+      printPerfStat(ci::app::console(), getLoadStageName(i), model.load_perf[i]);
+    }
+  }
+}
+
+
 // モデル読み込み
-Model loadModel(const std::string& path) {
+//   presetでAssimpの後処理と独自の後処理を切り替える
+//   streamer を指定すると、テクスチャは仮のものを用意するだけで読み込みを待たない
+//   decode_texture_only だとテクスチャは画像の展開だけ行い、GLを使わない(ベンチマーク用)
+Model loadModel(const std::string& path, const int preset = IMPORT_PRESET_STANDARD,
+                TextureStreamer* streamer = nullptr, const bool decode_texture_only = false) {
+  resetAllocStat();
+  resetLoadStageTime();
+  resetLoadStagePerf();
+
+  const auto& import_preset = getImportPreset(preset);
+
   Assimp::Importer importer;
 
-  const aiScene* scene = importer.ReadFile(path,
-                                           aiProcess_Triangulate
-                                           | aiProcess_FlipUVs
-                                           | aiProcess_JoinIdenticalVertices
-                                           | aiProcess_OptimizeMeshes
-                                           | aiProcess_LimitBoneWeights
-                                           | aiProcess_RemoveRedundantMaterials);
+  const aiScene* scene = nullptr;
+  std::vector<ImportTiming> import_timing;
+  {
+    ScopedLoadStage stage(LOAD_STAGE_IMPORT);
+
+    // Assimpの処理時間をログから拾う
+    ScopedImportLog log;
+    importer.SetPropertyInteger(AI_CONFIG_GLOB_MEASURE_TIME, 1);
+
+    scene = importer.ReadFile(path, import_preset.flags);
+
+    import_timing = std::move(log.stream.timing);
+  }
 
   assert(scene);
   
   Model model;
 
+  model.import_preset = preset;
+  model.import_timing = std::move(import_timing);
+
+  // 他のモデルと素材を共有するためのキー
+  //   同じファイルでもプリセットが違えば別物として扱う
+  std::string asset_key = getSceneKey(path, import_preset.flags);
+
+  // 読み込む前にまとめて確保しておく
+  model.arena = std::make_shared<Arena>(estimateArenaSize(scene));
+
 #if defined (USE_FULL_PATH)
   // ファイルの親ディレクトリを取得
   ci::fs::path full_path{ path };
@@ -299,95 +1195,198 @@ Model loadModel(const std::string& path) {
     ci::app::console() << "Materials:" << num << std::endl;
 
     aiMaterial** mat = scene->mMaterials;
+    model.material.reserve(num);
     for (u_int i = 0; i < num; ++i) {
-      model.material.push_back(createMaterial(mat[i]));
+      {
+        ScopedLoadStage stage(LOAD_STAGE_MATERIAL);
+        model.material.push_back(createSharedMaterial(asset_key, i, mat[i]));
+      }
 
       // テクスチャ読み込み
-      const auto& m = model.material.back();
+      const auto& m = *model.material.back();
       if (!m.has_texture) continue;
 
+      ScopedLoadStage stage(LOAD_STAGE_TEXTURE);
+
 #if defined (USE_FULL_PATH)
       std::string path = model.directory + "/" + PATH_WORKAROUND(m.texture_name);
-      auto texture = loadTexrture(path);
 #else
-      auto texture = loadTexrture(PATH_WORKAROUND(m.texture_name));
+      std::string path = PATH_WORKAROUND(m.texture_name);
 #endif
+      if (decode_texture_only) {
+        decodeModelTexture(path);
+        continue;
+      }
+
+      auto texture = streamer ? requestStreamTexture(*streamer, path) : loadSharedTexture(path);
 
       model.textures.insert(std::make_pair(m.texture_name, texture));
     }
   }
 
-  model.node = createNode(scene->mRootNode, scene->mMeshes);
+  {
+    ScopedLoadStage stage(LOAD_STAGE_NODE);
 
-  // ノードを名前から探せるようにする
-  createNodeInfo(model.node,
-                 model.node_index,
-                 model.node_list);
+    model.node = createNode(scene->mRootNode, scene->mMeshes, model.arena);
+
+    // ノードを名前から探せるようにする
+    model.node_list.reserve(countNode(scene->mRootNode));
+    createNodeInfo(model.node,
+                   model.node_index,
+                   model.node_list);
+    model.node_parent = createNodeParent(model.node_list);
+  }
 
   model.has_anim = scene->HasAnimations();
   if (model.has_anim) {
+    ScopedLoadStage stage(LOAD_STAGE_ANIMATION);
+
     ci::app::console() << "Animations:" << scene->mNumAnimations << std::endl;
 
-    aiAnimation** anim = scene->mAnimations;
-    for (u_int i = 0; i < scene->mNumAnimations; ++i) {
-      model.animation.push_back(createAnimation(anim[i]));
+    // 展開元としてaiSceneを引き取る
+    //   同じファイルを読んだモデルがあれば、そちらの展開元を使う
+    aiScene* source = importer.GetOrphanedScene();
+    releaseSceneMeshes(source);
+    model.source = shareAnimationSource(asset_key, std::shared_ptr<const aiScene>(source));
+
+    // ここでは登録だけ行い、展開は初めて使う時まで遅らせる
+    aiAnimation** anim = model.source->mAnimations;
+    model.animation.reserve(model.source->mNumAnimations);
+    for (u_int i = 0; i < model.source->mNumAnimations; ++i) {
+      model.animation.push_back(registerAnimation(anim[i]));
+      if (!asset_key.empty()) model.animation.back().cache_key = asset_key + "/anim" + std::to_string(i);
+      model.animation.back().channel_node = createChannelRemap(model, anim[i]);
     }
   }
 
+  {
+    ScopedLoadStage stage(LOAD_STAGE_POSTPROCESS);
+
 #if defined (WEIGHT_WORKAROUND)
-  normalizeMeshWeight(model);
+    if (import_preset.cook) normalizeMeshWeight(model);
 #endif
 
-  model.aabb = calcAABB(model);
+    model.aabb = calcAABB(model);
+
+#if defined (USE_STATIC_BATCH)
+    if (import_preset.cook) createStaticBatch(model);
+#endif
+  }
 
   auto info = getMeshInfo(model);
 
   ci::app::console() << "Total vertex num:" << info.first << " triangle num:" << info.second << std::endl;
 
+  std::copy(std::begin(alloc_stat), std::end(alloc_stat), std::begin(model.alloc_stat));
+  std::copy(std::begin(load_stage_time), std::end(load_stage_time), std::begin(model.load_time));
+  std::copy(std::begin(load_stage_perf), std::end(load_stage_perf), std::begin(model.load_perf));
+  printAllocInfo(model);
+  printImportTiming(model);
+  printMemoryReport(ci::app::console(), getModelMemory(model));
+  printAssetCache(ci::app::console());
+
   return model;
 }
 
 
+// スキニング済みメッシュの描画
+//   TriMeshを経由せず、SkinBufferをそのまま頂点配列として渡す
+//   UV、頂点カラー、インデックスは初期姿勢のものを共有
+void drawSkinMesh(const Mesh& mesh, const SkinVertexArray& skin) {
+  if (skin.empty() || !mesh.body.getNumIndices()) return;
+
+  GLsizei stride = sizeof(SkinVertex);
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(3, GL_FLOAT, stride, &skin[0].position);
+
+  if (mesh.body.hasNormals()) {
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glNormalPointer(GL_FLOAT, stride, &skin[0].normal);
+  }
+
+  if (mesh.body.hasColorsRGBA()) {
+    glEnableClientState(GL_COLOR_ARRAY);
+    glColorPointer(4, GL_FLOAT, 0, &(mesh.body.getColorsRGBA()[0]));
+  }
+
+  if (mesh.body.hasTexCoords()) {
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glTexCoordPointer(2, GL_FLOAT, 0, &(mesh.body.getTexCoords()[0]));
+  }
+
+  glDrawElements(GL_TRIANGLES, GLsizei(mesh.body.getNumIndices()), GL_UNSIGNED_INT, &(mesh.body.getIndices()[0]));
+
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+}
+
+
+// メッシュ描画
+//   スキニングするメッシュは skin の頂点で描画する
+void drawMesh(const Model& model, const Mesh& mesh, const SkinVertexArray& skin) {
+  const auto& material = *model.material[mesh.material_index];
+  if (mesh.body.hasColorsRGBA()) {
+    // 頂点カラー
+    ci::gl::enable(GL_COLOR_MATERIAL);
+#if !defined (CINDER_COCOA_TOUCH)
+    // OpenGL ESは未実装
+    glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+#endif
+  }
+  else {
+    material.body.apply();
+  }
+
+  if (material.has_texture) {
+    model.textures.at(material.texture_name)->texture->enableAndBind();
+  }
+
+  if (isDynamicMesh(mesh)) {
+    drawSkinMesh(mesh, skin);
+  }
+  else {
+    ci::gl::draw(mesh.body);
+  }
+
+  if (mesh.body.hasColorsRGBA()) {
+    ci::gl::disable(GL_COLOR_MATERIAL);
+  }
+
+  if (material.has_texture) {
+    const auto& texture = model.textures.at(material.texture_name)->texture;
+    texture->unbind();
+    texture->disable();
+  }
+}
+
 // モデル描画
 // TIPS:全ノード最終的な行列が計算されているので、再帰で描画する必要は無い
 void drawModel(const Model& model) {
+  ScopedAnimStage stage(ANIM_STAGE_DRAW);
+
   for (const auto& node : model.node_list) {
     if (node->mesh.empty()) continue;
     
     ci::gl::pushModelView();
-    ci::gl::multModelView(node->global_matrix);
+    ci::gl::multModelView(node->global_matrix.toMatrix44());
 
     for (const auto& mesh : node->mesh) {
-      const auto& material = model.material[mesh.material_index];
-      if (mesh.body.hasColorsRGBA()) {
-        // 頂点カラー
-        ci::gl::enable(GL_COLOR_MATERIAL);
-#if !defined (CINDER_COCOA_TOUCH)
-        // OpenGL ESは未実装
-        glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
-#endif
-      }
-      else {
-        material.body.apply();
-      }
-
-      if (material.has_texture) {
-        model.textures.at(material.texture_name)->enableAndBind();
-      }
-
-      ci::gl::draw(mesh.body);
-
-      if (mesh.body.hasColorsRGBA()) {
-        ci::gl::disable(GL_COLOR_MATERIAL);
-      }
-
-      if (material.has_texture) {
-        model.textures.at(material.texture_name)->unbind();
-        model.textures.at(material.texture_name)->disable();
-      }
+      if (mesh.culled) continue;
+      drawMesh(model, mesh, mesh.skin.getDisplay());
+      stage.vertex_num += mesh.body.getNumVertices();
     }
     ci::gl::popModelView();
   }
+
+  // まとめたメッシュは行列を積まずに描画できる
+  for (const auto& batch : model.static_batch) {
+    if (batch.mesh.culled) continue;
+    drawMesh(model, batch.mesh, batch.mesh.skin.getDisplay());
+    stage.vertex_num += batch.mesh.body.getNumVertices();
+  }
 }
 
 // 描画順を逆にする
@@ -397,4 +1396,31 @@ void reverseModelNode(Model& model) {
   }
   
   std::reverse(std::begin(model.node_list), std::end(model.node_list));
+  model.node_parent = createNodeParent(model.node_list);
+
+  // ノードの位置が変わったので、まとめたメッシュの元の位置と
+  // チャンネルの対応表も作り直す
+  //   (表は他のモデルと共有しているので、書き換えずに新しく作る)
+  u_int last = u_int(model.node_list.size()) - 1;
+  std::reverse(std::begin(model.static_batch), std::end(model.static_batch));
+  for (auto& batch : model.static_batch) {
+    for (auto& source : batch.source) {
+      source.node = last - source.node;
+    }
+  }
+
+  for (auto& clip : model.animation) {
+    if (!clip.channel_node) continue;
+
+    auto remap = std::make_shared<std::vector<u_int> >(*clip.channel_node);
+    for (auto& index : *remap) {
+      index = last - index;
+    }
+    clip.channel_node = remap;
+  }
+
+  // ボーン行列のベイク結果は node_list、Node::mesh 順なので捨てる
+  for (auto& clip : model.animation) {
+    clip.palette.reset();
+  }
 }
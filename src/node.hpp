@@ -12,37 +12,50 @@ struct Node {
 
   std::vector<Mesh> mesh;
 
-  ci::Matrix44f matrix;
-  ci::Matrix44f matrix_orig;
-  ci::Matrix44f global_matrix;
-  ci::Matrix44f invert_matrix;
+  Affine matrix;
+  Affine matrix_orig;
+  Affine global_matrix;
+  Affine invert_matrix;
 
   std::vector<std::shared_ptr<Node> > children;
 };
 
 
 // 再帰で子供のノードも生成
-std::shared_ptr<Node> createNode(const aiNode* const n, aiMesh** mesh) {
-  auto node = std::make_shared<Node>();
+//   ノード本体はモデルのアリーナから確保する
+std::shared_ptr<Node> createNode(const aiNode* const n, aiMesh** mesh, const ArenaRef& arena) {
+  auto node = std::allocate_shared<Node>(ArenaAllocator<Node>(arena));
 
   node->name = n->mName.C_Str();
 
   ci::app::console() << "Node:" << node->name << std::endl;
 
+  node->mesh.reserve(n->mNumMeshes);
   for (u_int i = 0; i < n->mNumMeshes; ++i) {
-    node->mesh.push_back(createMesh(mesh[n->mMeshes[i]]));
+    node->mesh.push_back(createMesh(mesh[n->mMeshes[i]], arena));
   }
-  node->matrix.set(n->mTransformation[0], true);
+  node->matrix = fromAssimp(n->mTransformation);
   // 初期値を保存しておく
   node->matrix_orig = node->matrix;
 
+  node->children.reserve(n->mNumChildren);
   for (u_int i = 0; i < n->mNumChildren; ++i) {
-    node->children.push_back(createNode(n->mChildren[i], mesh));
+    node->children.push_back(createNode(n->mChildren[i], mesh, arena));
   }
 
   return node;
 }
 
+// ノードの総数を数える
+size_t countNode(const aiNode* const n) {
+  size_t num = 1;
+  for (u_int i = 0; i < n->mNumChildren; ++i) {
+    num += countNode(n->mChildren[i]);
+  }
+
+  return num;
+}
+
 // 再帰を使って全ノード情報を生成
 void createNodeInfo(const std::shared_ptr<Node>& node,
                     std::map<std::string, std::shared_ptr<Node> >& node_index,
@@ -57,10 +70,28 @@ void createNodeInfo(const std::shared_ptr<Node>& node,
 }
 
 
+// ノード一覧の各ノードについて、親の位置を求める(ルートは-1)
+std::vector<int> createNodeParent(const std::vector<std::shared_ptr<Node> >& node_list) {
+  std::map<const Node*, int> position;
+  for (size_t i = 0; i < node_list.size(); ++i) {
+    position.insert(std::make_pair(node_list[i].get(), int(i)));
+  }
+
+  std::vector<int> parent(node_list.size(), -1);
+  for (size_t i = 0; i < node_list.size(); ++i) {
+    for (const auto& child : node_list[i]->children) {
+      parent[position.at(child.get())] = int(i);
+    }
+  }
+
+  return parent;
+}
+
+
 // 全ノードの親行列適用済み行列と、その逆行列を計算
 //   メッシュアニメーションで利用
 void updateNodeDerivedMatrix(const std::shared_ptr<Node>& node,
-                             const ci::Matrix44f& parent_matrix) {
+                             const Affine& parent_matrix) {
   node->global_matrix = parent_matrix * node->matrix;
   node->invert_matrix = node->global_matrix.inverted();
 
@@ -0,0 +1,344 @@
+﻿#pragma once
+
+//
+// ハードウェアカウンタによる計測
+//   Linuxの perf_event_open でサイクル数、命令数、L1/LLCミス、分岐予測ミスを数える
+//   処理時間だけではメモリ待ちなのか演算なのかが分からないので、段階ごとに IPC と頂点あたりのミス数を出す
+//   カウンタはスレッドごとに開く(ワーカースレッドの計測も、そのスレッドの分だけになる)
+//
+//   USE_PERF_COUNTER が無い環境や、権限が無くて開けない場合は何もしない
+//   (/proc/sys/kernel/perf_event_paranoid が2以下ならユーザー空間の分は計測できる)
+//
+
+#include <mutex>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "misc.hpp"
+#include "allocator.hpp"
+
+// perf_event_open はLinuxにしか無い
+#if defined (USE_PERF_COUNTER) && !defined (__linux__)
+#undef USE_PERF_COUNTER
+#endif
+
+#if defined (USE_PERF_COUNTER)
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+
+enum PerfEvent {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISS,
+  PERF_LLC_MISS,
+  PERF_BRANCH_MISS,
+
+  PERF_EVENT_NUM
+};
+
+// アニメーションの段階
+enum AnimStage {
+  // キーフレームのサンプリングとノード行列の生成
+  ANIM_STAGE_SAMPLING,
+  // ノード階層の行列の合成
+  ANIM_STAGE_HIERARCHY,
+  // ボーン行列
+  ANIM_STAGE_PALETTE,
+  // スキニング(モーフターゲットの適用を含む)
+  ANIM_STAGE_SKINNING,
+  // 描画命令の発行
+  ANIM_STAGE_DRAW,
+
+  ANIM_STAGE_NUM
+};
+
+const char* getAnimStageName(const int stage) {
+  static const char* const names[] = {
+    "Sampling",
+    "Hierarchy",
+    "Palette",
+    "Skinning",
+    "Draw",
+  };
+
+  return names[stage];
+}
+
+
+// 段階ごとの集計
+struct PerfStat {
+  uint64_t count[PERF_EVENT_NUM];
+  // 計測した回数と、その間に処理した頂点数
+  u_int calls;
+  uint64_t vertex_num;
+};
+
+void clearPerfStat(PerfStat& stat) {
+  std::fill(std::begin(stat.count), std::end(stat.count), 0);
+  stat.calls      = 0;
+  stat.vertex_num = 0;
+}
+
+void addPerfStat(PerfStat& stat, const uint64_t* count, const uint64_t vertex_num) {
+  for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+    stat.count[i] += count[i];
+  }
+  stat.calls      += 1;
+  stat.vertex_num += vertex_num;
+}
+
+
+#if defined (USE_PERF_COUNTER)
+
+// スレッドごとのカウンタ
+//   サイクル数を親にしたグループで開き、一度のreadで全ての値を読む
+//   開けなかったイベントは0のまま
+class PerfCounter {
+  int fd[PERF_EVENT_NUM];
+  // readで返ってくる順番
+  int slot[PERF_EVENT_NUM];
+  int slot_num;
+
+  static int openEvent(const uint32_t type, const uint64_t config, const int group) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size   = sizeof(attr);
+    attr.type   = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    // 親が有効になれば、子も一緒に数え始める
+    attr.disabled = (group < 0) ? 1 : 0;
+
+    return int(syscall(__NR_perf_event_open, &attr, 0, -1, group, 0));
+  }
+
+  static uint64_t getCacheConfig(const uint64_t cache) {
+    return cache | (uint64_t(PERF_COUNT_HW_CACHE_OP_READ) << 8) | (uint64_t(PERF_COUNT_HW_CACHE_RESULT_MISS) << 16);
+  }
+
+public:
+  PerfCounter()
+    : slot_num(0)
+  {
+    std::fill(std::begin(fd), std::end(fd), -1);
+    std::fill(std::begin(slot), std::end(slot), -1);
+
+    fd[PERF_CYCLES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (fd[PERF_CYCLES] < 0) return;
+    slot[PERF_CYCLES] = slot_num++;
+
+    const uint32_t type[] = {
+      PERF_TYPE_HARDWARE,
+      PERF_TYPE_HW_CACHE,
+      PERF_TYPE_HW_CACHE,
+      PERF_TYPE_HARDWARE,
+    };
+    const uint64_t config[] = {
+      PERF_COUNT_HW_INSTRUCTIONS,
+      getCacheConfig(PERF_COUNT_HW_CACHE_L1D),
+      getCacheConfig(PERF_COUNT_HW_CACHE_LL),
+      PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for (int i = PERF_INSTRUCTIONS; i < PERF_EVENT_NUM; ++i) {
+      fd[i] = openEvent(type[i - 1], config[i - 1], fd[PERF_CYCLES]);
+      if (fd[i] >= 0) slot[i] = slot_num++;
+    }
+
+    ioctl(fd[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fd[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  ~PerfCounter() {
+    for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+      if (fd[i] >= 0) close(fd[i]);
+    }
+  }
+
+  PerfCounter(const PerfCounter&) = delete;
+  PerfCounter& operator=(const PerfCounter&) = delete;
+
+  bool isValid() const { return fd[PERF_CYCLES] >= 0; }
+
+  // 開始からの累計
+  //   他の処理とカウンタを取り合って計測できなかった時間がある場合は、その分を補って推定する
+  bool read(uint64_t* count) const {
+    std::fill(count, count + PERF_EVENT_NUM, 0);
+    if (!isValid()) return false;
+
+    // nr, time_enabled, time_running, value[nr]
+    uint64_t data[3 + PERF_EVENT_NUM];
+    if (::read(fd[PERF_CYCLES], data, sizeof(data)) < ssize_t(sizeof(uint64_t) * 3)) return false;
+
+    double scale = (data[2] > 0) ? double(data[1]) / double(data[2]) : 0.0;
+    for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+      if ((slot[i] < 0) || (uint64_t(slot[i]) >= data[0])) continue;
+      count[i] = uint64_t(double(data[3 + slot[i]]) * scale);
+    }
+    return true;
+  }
+};
+
+PerfCounter& getPerfCounter() {
+  thread_local PerfCounter counter;
+  return counter;
+}
+
+bool isPerfCounterAvailable() {
+  return getPerfCounter().isValid();
+}
+
+#else
+
+bool isPerfCounterAvailable() {
+  return false;
+}
+
+#endif
+
+
+// アニメーションの段階ごとの集計
+//   ワーカースレッドと描画スレッドの両方から加算するので排他する
+struct PerfProfile {
+  std::mutex mutex;
+  PerfStat stage[ANIM_STAGE_NUM];
+};
+
+PerfProfile& getPerfProfile() {
+  static PerfProfile profile;
+  return profile;
+}
+
+void resetPerfProfile() {
+  auto& profile = getPerfProfile();
+  std::lock_guard<std::mutex> lock(profile.mutex);
+  for (auto& stat : profile.stage) {
+    clearPerfStat(stat);
+  }
+}
+
+
+// 読み込み段階ごとの集計
+//   load_stage_time と同じく、読み込んだスレッドの分だけ
+thread_local PerfStat load_stage_perf[LOAD_STAGE_NUM];
+
+void resetLoadStagePerf() {
+  for (auto& stat : load_stage_perf) {
+    clearPerfStat(stat);
+  }
+}
+
+
+// 計測の一時停止
+//   ベンチマーク中はカウンタの読み出しが計測時間に混ざらないようにする
+thread_local int perf_suspend = 0;
+
+struct ScopedPerfSuspend {
+  ScopedPerfSuspend() { ++perf_suspend; }
+  ~ScopedPerfSuspend() { --perf_suspend; }
+
+  ScopedPerfSuspend(const ScopedPerfSuspend&) = delete;
+  ScopedPerfSuspend& operator=(const ScopedPerfSuspend&) = delete;
+};
+
+
+// スコープ内の計測値を stat へ加算する
+//   ScopedPerfSuspend の間は何もしない
+//   vertex_num にはスコープ内で処理した頂点数を入れておく
+struct ScopedPerfCount {
+  PerfStat& stat;
+  std::mutex* mutex;
+  uint64_t vertex_num;
+#if defined (USE_PERF_COUNTER)
+  uint64_t start[PERF_EVENT_NUM];
+  bool valid;
+#endif
+
+  ScopedPerfCount(PerfStat& stat_, std::mutex* mutex_ = nullptr)
+    : stat(stat_),
+      mutex(mutex_),
+      vertex_num(0)
+  {
+#if defined (USE_PERF_COUNTER)
+    valid = !perf_suspend && getPerfCounter().read(start);
+#endif
+  }
+
+  ~ScopedPerfCount() {
+#if defined (USE_PERF_COUNTER)
+    if (!valid) return;
+
+    uint64_t count[PERF_EVENT_NUM];
+    getPerfCounter().read(count);
+    for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+      // 補正の誤差で減ることがある
+      count[i] = (count[i] > start[i]) ? count[i] - start[i] : 0;
+    }
+
+    if (mutex) {
+      std::lock_guard<std::mutex> lock(*mutex);
+      addPerfStat(stat, count, vertex_num);
+    }
+    else {
+      addPerfStat(stat, count, vertex_num);
+    }
+#endif
+  }
+};
+
+// アニメーションの段階
+struct ScopedAnimStage : public ScopedPerfCount {
+  explicit ScopedAnimStage(const int stage)
+    : ScopedPerfCount(getPerfProfile().stage[stage], &getPerfProfile().mutex)
+  {}
+};
+
+
+// 集計結果を表示
+//   calls が0の段階は表示しない
+void printPerfStat(std::ostream& out, const char* name, const PerfStat& stat) {
+  if (!stat.calls) return;
+
+  const auto* count = stat.count;
+  out << "  [" << name << "] calls " << stat.calls
+      << " cycles " << count[PERF_CYCLES] / stat.calls
+      << " IPC " << std::fixed << std::setprecision(2)
+      << (count[PERF_CYCLES] ? double(count[PERF_INSTRUCTIONS]) / double(count[PERF_CYCLES]) : 0.0);
+
+  if (stat.vertex_num) {
+    double vertex_num = double(stat.vertex_num);
+    out << " per vertex: cycles " << count[PERF_CYCLES] / vertex_num
+        << " L1D miss " << count[PERF_L1D_MISS] / vertex_num
+        << " LLC miss " << count[PERF_LLC_MISS] / vertex_num
+        << " branch miss " << count[PERF_BRANCH_MISS] / vertex_num;
+  }
+  else {
+    out << " per call: L1D miss " << count[PERF_L1D_MISS] / stat.calls
+        << " LLC miss " << count[PERF_LLC_MISS] / stat.calls
+        << " branch miss " << count[PERF_BRANCH_MISS] / stat.calls;
+  }
+  out.unsetf(std::ios::fixed);
+  out << std::setprecision(6) << std::endl;
+}
+
+void printPerfProfile(std::ostream& out) {
+  if (!isPerfCounterAvailable()) {
+    out << "Perf counter: not available" << std::endl;
+    return;
+  }
+
+  auto& profile = getPerfProfile();
+  std::lock_guard<std::mutex> lock(profile.mutex);
+
+  out << "Perf counter:" << std::endl;
+  for (int i = 0; i < ANIM_STAGE_NUM; ++i) {
+    printPerfStat(out, getAnimStageName(i), profile.stage[i]);
+  }
+}
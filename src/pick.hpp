@@ -0,0 +1,181 @@
+﻿#pragma once
+
+//
+// マウスピッキング
+//   モデル空間の光線と、現在の姿勢のメッシュとの一番近い交点を求める
+//   メッシュごとのBVHは、スキニング結果が変わっていた時だけ箱を作り直す
+//
+
+#include <string>
+#include <limits>
+#include "model.hpp"
+
+
+struct PickResult {
+  PickResult()
+    : hit(false),
+      distance(std::numeric_limits<float>::max()),
+      node(0),
+      mesh(0),
+      triangle(0),
+      batch(-1),
+      bone(-1)
+  {}
+
+  bool hit;
+  // 光線の方向ベクトルを単位とした距離
+  float distance;
+
+  // Model::node_list の番号と、Node::mesh の番号
+  size_t node;
+  size_t mesh;
+  u_int triangle;
+
+  // まとめたメッシュに当たった時は Model::static_batch の番号(無ければ-1)
+  //   node、mesh、triangle はまとめる前のもの
+  int batch;
+
+  // 三角形の3頂点それぞれの重み
+  ci::Vec3f barycentric;
+  // 交点(モデル空間)
+  ci::Vec3f position;
+
+  // 交点への影響が一番大きいボーン(Mesh::bones の番号、無ければ-1)
+  int bone;
+  std::string bone_name;
+};
+
+
+// 頂点の現在の座標
+//   スキニングするメッシュは表示中の結果、しないメッシュは元の頂点
+struct MeshPosition {
+  explicit MeshPosition(const Mesh& mesh)
+    : skin(isDynamicMesh(mesh) ? mesh.skin.getDisplay().data() : nullptr),
+      body(mesh.body.getVertices().data())
+  {}
+
+  const SkinVertex* skin;
+  const ci::Vec3f* body;
+
+  ci::Vec3f operator()(const u_int i) const { return skin ? skin[i].position : body[i]; }
+};
+
+// 姿勢が変わっていれば箱を作り直す
+void refitMeshBvh(Mesh& mesh) {
+  if (mesh.bvh_serial == mesh.skin.serial) return;
+
+  refitMeshBvh(mesh.bvh, mesh.body.getIndices(), MeshPosition(mesh));
+  mesh.bvh_serial = mesh.skin.serial;
+}
+
+// 交点に一番影響するボーン
+//   3頂点のウェイトを重心座標で重み付けして合計する
+int getDominantBone(const Mesh& mesh, const u_int triangle, const ci::Vec3f& barycentric) {
+  if (mesh.influence_offset.empty()) return -1;
+
+  std::vector<float> total(mesh.bones.size(), 0.0f);
+  const auto& indices = mesh.body.getIndices();
+  for (u_int i = 0; i < 3; ++i) {
+    u_int v = indices[triangle * 3 + i];
+    for (u_int k = mesh.influence_offset[v]; k < mesh.influence_offset[v + 1]; ++k) {
+      total[mesh.influence[k].bone] += barycentric[i] * mesh.influence[k].value;
+    }
+  }
+
+  auto it = std::max_element(total.begin(), total.end());
+  if ((it == total.end()) || (*it <= 0.0f)) return -1;
+  return int(it - total.begin());
+}
+
+// モデル空間の光線で調べる
+//   描画していないメッシュは対象外
+PickResult pickModel(Model& model, const ci::Vec3f& origin, const ci::Vec3f& direction) {
+  PickResult result;
+
+  for (size_t n = 0; n < model.node_list.size(); ++n) {
+    const auto& node = model.node_list[n];
+    if (node->mesh.empty()) continue;
+
+    // ノード空間へ変換しても、光線上の距離の比は変わらない
+    Affine inv = node->global_matrix.inverted();
+    ci::Vec3f o = inv.transformPoint(origin);
+    ci::Vec3f d = inv.transformVec(direction);
+
+    for (size_t m = 0; m < node->mesh.size(); ++m) {
+      auto& mesh = node->mesh[m];
+      if (mesh.culled) continue;
+
+      refitMeshBvh(mesh);
+
+      u_int tri;
+      float u;
+      float v;
+      if (!intersectMeshBvh(mesh.bvh, mesh.body.getIndices(), MeshPosition(mesh),
+                            o, d, result.distance, tri, u, v)) continue;
+
+      result.hit         = true;
+      result.node        = n;
+      result.mesh        = m;
+      result.triangle    = tri;
+      result.batch       = -1;
+      result.barycentric = ci::Vec3f{ 1.0f - u - v, u, v };
+    }
+  }
+
+  // まとめたメッシュはモデル空間のまま調べて、元のメッシュへ戻す
+  for (size_t b = 0; b < model.static_batch.size(); ++b) {
+    auto& mesh = model.static_batch[b].mesh;
+    if (mesh.culled) continue;
+
+    u_int tri;
+    float u;
+    float v;
+    if (!intersectMeshBvh(mesh.bvh, mesh.body.getIndices(), MeshPosition(mesh),
+                          origin, direction, result.distance, tri, u, v)) continue;
+
+    const auto& source = findBatchSource(model.static_batch[b], tri);
+    result.hit         = true;
+    result.node        = source.node;
+    result.mesh        = source.mesh;
+    result.triangle    = tri - source.triangle_begin;
+    result.batch       = int(b);
+    result.barycentric = ci::Vec3f{ 1.0f - u - v, u, v };
+  }
+
+  if (result.hit && (result.batch >= 0)) {
+    // 骨を持たないメッシュだけをまとめている
+    result.position = origin + direction * result.distance;
+  }
+  else if (result.hit) {
+    const auto& mesh = model.node_list[result.node]->mesh[result.mesh];
+    result.position = origin + direction * result.distance;
+    result.bone = getDominantBone(mesh, result.triangle, result.barycentric);
+    if (result.bone >= 0) result.bone_name = mesh.bones[result.bone].name;
+  }
+
+  return result;
+}
+
+void printPickResult(const Model& model, const PickResult& result) {
+  if (!result.hit) {
+    ci::app::console() << "Pick: none" << std::endl;
+    return;
+  }
+
+  const auto& node = model.node_list[result.node];
+  std::string mesh_name;
+  if (result.batch >= 0) {
+    for (const auto& source : model.static_batch[result.batch].source) {
+      if ((source.node == result.node) && (source.mesh == result.mesh)) mesh_name = source.name;
+    }
+  }
+  else {
+    mesh_name = node->mesh[result.mesh].name;
+  }
+  ci::app::console() << "Pick: node:" << node->name
+                     << " mesh:" << mesh_name
+                     << " triangle:" << result.triangle
+                     << " barycentric:" << result.barycentric
+                     << " bone:" << (result.bone_name.empty() ? "-" : result.bone_name)
+                     << " position:" << result.position << std::endl;
+}
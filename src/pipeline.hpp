@@ -0,0 +1,319 @@
+﻿#pragma once
+
+//
+// アニメーションの更新と描画の並列化
+//   別スレッドで次のフレームの姿勢とスキニングを計算し
+//   メインスレッドは直前に出来上がった結果で描画する
+//   結果の受け渡しはロックを使わないトリプルバッファで行う
+//
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include "model.hpp"
+
+
+// トリプルバッファ
+//   書き込み側と読み出し側が一つずつの場合に使える
+//   書き込み側は back に書いて publish で middle と入れ替える
+//   読み出し側は新しいものがあれば front と middle を入れ替える
+//   どちらも相手を待つことはない
+template <typename T>
+class TripleBuffer {
+  enum : u_int {
+    INDEX_MASK = 3,
+    // middle に新しい内容が入っている
+    FRESH_BIT  = 4,
+  };
+
+  T body[3];
+
+  u_int back;
+  u_int front;
+  std::atomic<u_int> middle;
+
+public:
+  TripleBuffer()
+    : back(0),
+      front(1),
+      middle(2)
+  {}
+
+  T& getBack() { return body[back]; }
+  const T& getFront() const { return body[front]; }
+
+  void publish() {
+    back = middle.exchange(back | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+  }
+
+  // 新しいものを受け取ったらtrue
+  bool update() {
+    if (!(middle.load(std::memory_order_relaxed) & FRESH_BIT)) return false;
+
+    front = middle.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+    return true;
+  }
+};
+
+
+// 描画に必要な計算結果
+//   node_matrix は Model::node_list 順
+//   skin はスキニングするメッシュを node_list、Node::mesh 順に並べたもの
+struct PoseFrame {
+  PoseFrame()
+    : time(0.0),
+      serial(0)
+  {}
+
+  double time;
+  u_int serial;
+
+  std::vector<Affine> node_matrix;
+  std::vector<SkinVertexArray> skin;
+
+  // 描画するかどうか(node_list、Node::mesh 順の全メッシュに続けて、Model::static_batch 順)
+  std::vector<uint8_t> visible;
+};
+
+// 更新の依頼
+//   アニメーション時間はメインスレッドで進めて、ここで明示的に渡す
+struct AnimRequest {
+  // falseならアニメーションを進めない
+  bool animate;
+
+  double time;
+  double delta;
+  double speed;
+  float screen_size;
+
+  // スキニングと描画のカリングに使う視錐台(モデル空間)
+  Frustum frustum;
+};
+
+struct AnimPipeline {
+  AnimPipeline()
+    : model(nullptr),
+      has_request(false),
+      quit(false),
+      running(false),
+      serial(0),
+      eval_seconds(0.0)
+  {}
+
+  ~AnimPipeline() {
+    // 止め忘れてもスレッドを残さない
+    if (worker.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+      }
+      cond.notify_one();
+      worker.join();
+    }
+  }
+
+  Model* model;
+
+  // ワーカースレッドで行う更新処理
+  std::function<void (const AnimRequest&)> job;
+
+  TripleBuffer<PoseFrame> frames;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cond;
+
+  // 処理待ちの依頼は常に最新の一つだけ
+  AnimRequest request;
+  bool has_request;
+  bool quit;
+  bool running;
+
+  u_int serial;
+
+  // 直前の更新にかかった時間(秒)
+  std::atomic<double> eval_seconds;
+};
+
+
+// 現在のモデルの状態を書き出す
+//   スキニング結果は、更新された範囲だけをコピーする
+void captureAnimFrame(const Model& model, PoseFrame& frame, const double time, const u_int serial) {
+  frame.time   = time;
+  frame.serial = serial;
+
+  size_t node_num = model.node_list.size();
+  frame.node_matrix.resize(node_num);
+
+  frame.visible.clear();
+
+  size_t skin_index = 0;
+  for (size_t i = 0; i < node_num; ++i) {
+    const auto& node = model.node_list[i];
+    frame.node_matrix[i] = node->global_matrix;
+
+    for (const auto& mesh : node->mesh) {
+      frame.visible.push_back(!mesh.culled);
+      if (!isDynamicMesh(mesh)) continue;
+
+      if (skin_index == frame.skin.size()) frame.skin.emplace_back();
+      auto& dst = frame.skin[skin_index];
+      const auto& src = mesh.skin.getDisplay();
+      if (dst.size() != src.size()) {
+        dst = src;
+      }
+      else {
+        std::copy(src.begin() + mesh.skin_begin, src.begin() + mesh.skin_end, dst.begin() + mesh.skin_begin);
+      }
+      skin_index += 1;
+    }
+  }
+  frame.skin.resize(skin_index);
+
+  for (const auto& batch : model.static_batch) {
+    frame.visible.push_back(!batch.mesh.culled);
+  }
+}
+
+void runAnimPipeline(AnimPipeline& pipeline) {
+  while (true) {
+    AnimRequest request;
+    {
+      std::unique_lock<std::mutex> lock(pipeline.mutex);
+      pipeline.cond.wait(lock, [&pipeline]() { return pipeline.has_request || pipeline.quit; });
+      if (pipeline.quit) break;
+
+      request = pipeline.request;
+      pipeline.has_request = false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    pipeline.job(request);
+    pipeline.serial += 1;
+    captureAnimFrame(*pipeline.model, pipeline.frames.getBack(), request.time, pipeline.serial);
+    pipeline.frames.publish();
+
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+    pipeline.eval_seconds = dt.count();
+  }
+}
+
+// ワーカースレッドを開始
+//   開始時点の状態を最初の結果として書き出しておくので
+//   描画側はすぐに結果を受け取れる
+void startAnimPipeline(AnimPipeline& pipeline, Model& model, std::function<void (const AnimRequest&)> job) {
+  assert(!pipeline.running);
+
+  pipeline.model = &model;
+  pipeline.job   = std::move(job);
+  pipeline.has_request = false;
+  pipeline.quit        = false;
+
+  captureAnimFrame(model, pipeline.frames.getBack(), 0.0, pipeline.serial);
+  pipeline.frames.publish();
+
+  pipeline.worker  = std::thread(runAnimPipeline, std::ref(pipeline));
+  pipeline.running = true;
+}
+
+// ワーカースレッドを終了
+//   処理中の更新が終わるまで待つ
+//   モデルをメインスレッドで書き換える前には必ず呼ぶ
+void stopAnimPipeline(AnimPipeline& pipeline) {
+  if (!pipeline.running) return;
+
+  {
+    std::lock_guard<std::mutex> lock(pipeline.mutex);
+    pipeline.quit = true;
+  }
+  pipeline.cond.notify_one();
+  pipeline.worker.join();
+  pipeline.running = false;
+}
+
+// 次のフレームの更新を依頼する
+//   前の依頼が処理されていなければ置き換える
+void requestAnimPipeline(AnimPipeline& pipeline, const AnimRequest& request) {
+  if (!pipeline.running) return;
+
+  {
+    std::lock_guard<std::mutex> lock(pipeline.mutex);
+    pipeline.request     = request;
+    pipeline.has_request = true;
+  }
+  pipeline.cond.notify_one();
+}
+
+// 描画に使う結果を取り出す
+const PoseFrame& acquireAnimFrame(AnimPipeline& pipeline) {
+  pipeline.frames.update();
+  return pipeline.frames.getFront();
+}
+
+// スコープ内だけワーカースレッドを止める
+struct ScopedAnimPipelinePause {
+  AnimPipeline& pipeline;
+  bool resume;
+
+  explicit ScopedAnimPipelinePause(AnimPipeline& pipeline_)
+    : pipeline(pipeline_),
+      resume(pipeline_.running)
+  {
+    stopAnimPipeline(pipeline);
+  }
+
+  ~ScopedAnimPipelinePause() {
+    if (resume) startAnimPipeline(pipeline, *pipeline.model, pipeline.job);
+  }
+};
+
+
+// 計算結果を使ったモデル描画
+void drawModel(const Model& model, const PoseFrame& frame) {
+  // ワーカー停止中にノード構成が変わった直後は、モデルの状態で描画する
+  if (frame.node_matrix.size() != model.node_list.size()) {
+    drawModel(model);
+    return;
+  }
+
+  ScopedAnimStage stage(ANIM_STAGE_DRAW);
+
+  size_t skin_index = 0;
+  size_t mesh_index = 0;
+  for (size_t i = 0; i < model.node_list.size(); ++i) {
+    const auto& node = model.node_list[i];
+    if (node->mesh.empty()) continue;
+
+    ci::gl::pushModelView();
+    ci::gl::multModelView(frame.node_matrix[i].toMatrix44());
+
+    for (const auto& mesh : node->mesh) {
+      bool visible = (mesh_index >= frame.visible.size()) || frame.visible[mesh_index];
+      mesh_index += 1;
+
+      if (isDynamicMesh(mesh) && (skin_index < frame.skin.size())) {
+        if (visible) drawMesh(model, mesh, frame.skin[skin_index]);
+        skin_index += 1;
+      }
+      else if (visible) {
+        drawMesh(model, mesh, mesh.skin.getFront());
+      }
+      if (visible) stage.vertex_num += mesh.body.getNumVertices();
+    }
+    ci::gl::popModelView();
+  }
+
+  for (const auto& batch : model.static_batch) {
+    bool visible = (mesh_index >= frame.visible.size()) || frame.visible[mesh_index];
+    mesh_index += 1;
+    if (!visible) continue;
+
+    drawMesh(model, batch.mesh, batch.mesh.skin.getFront());
+    stage.vertex_num += batch.mesh.body.getNumVertices();
+  }
+}
@@ -0,0 +1,204 @@
+﻿#pragma once
+
+//
+// 姿勢の問い合わせ
+//   モデルを書き換えずに、任意の時刻でのノードの行列(モデル空間)を求める
+//   ノードから根までの祖先を動かすチャンネルだけをサンプリングして合成するので
+//   スキニングや他のノードの計算は行わない
+//
+//   preparePose で用意した PoseClip を使い回して問い合わせる
+//   アニメーションしないノードは読み込み時の行列(Node::matrix_orig)を使う
+//   モデルを更新しているスレッドとは同時に呼ばない事
+//
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <map>
+#include <cmath>
+#include <algorithm>
+#include "model.hpp"
+
+
+struct PoseQuery {
+  // Model::node_list の位置
+  size_t node;
+  double time;
+};
+
+
+// ノードの位置を名前から探す(無ければ-1)
+int findNodePosition(const Model& model, const std::string& name) {
+  auto it = model.node_index.find(name);
+  if (it == model.node_index.end()) return -1;
+
+  for (size_t i = 0; i < model.node_list.size(); ++i) {
+    if (model.node_list[i] == it->second) return int(i);
+  }
+  return -1;
+}
+
+// 問い合わせに使うクリップ
+//   展開したキーフレームを持ち続けるので、問い合わせのたびに展開し直さない
+//   チャンネルの対応表もここで一度だけ作る
+//   作業用の配列を持つので、スレッドごとに用意する
+//   ノードの並びが変わったら(reverseModelNode)作り直す事
+struct PoseClip {
+  std::shared_ptr<const Anim> animation;
+  // ノードを動かすチャンネル(無ければ-1)
+  //   Model::node_list 順
+  std::vector<int> node_channel;
+
+  // 作業用
+  std::vector<int> chain;
+  std::vector<Affine> world;
+  std::vector<u_int> stamp;
+  u_int current;
+};
+
+// 展開済みのアニメーション
+//   モデル側で未展開なら共有キャッシュから取り出すか展開する(モデルは書き換えない)
+std::shared_ptr<const Anim> getAnimationBody(const AnimClip& clip) {
+  if (clip.body) return clip.body;
+
+  AnimClip decoded = clip;
+  decodeSharedAnimation(decoded);
+  return decoded.body;
+}
+
+// ノードを動かすチャンネル(無ければ-1)
+//   Model::node_list 順
+std::vector<int> getNodeChannel(const Model& model, const AnimClip& clip, const Anim& animation) {
+  std::vector<int> node_channel(model.node_list.size(), -1);
+
+  if (clip.channel_node) {
+    const auto& channel_node = *clip.channel_node;
+    for (size_t i = 0; i < channel_node.size(); ++i) {
+      node_channel[channel_node[i]] = int(i);
+    }
+    return node_channel;
+  }
+
+  // 対応表が無ければ名前で探す
+  std::map<const Node*, size_t> position;
+  for (size_t i = 0; i < model.node_list.size(); ++i) {
+    position.insert(std::make_pair(model.node_list[i].get(), i));
+  }
+  for (size_t i = 0; i < animation.body.size(); ++i) {
+    auto it = model.node_index.find(animation.body[i].node_name);
+    if (it == model.node_index.end()) continue;
+    node_channel[position.at(it->second.get())] = int(i);
+  }
+
+  return node_channel;
+}
+
+// 問い合わせの準備
+//   clip は Model::animation の位置
+PoseClip preparePose(const Model& model, const size_t clip) {
+  const auto& anim_clip = model.animation[clip];
+
+  PoseClip pose;
+  pose.animation    = getAnimationBody(anim_clip);
+  pose.node_channel = getNodeChannel(model, anim_clip, *pose.animation);
+  pose.current      = 0;
+
+  return pose;
+}
+
+// ノードの行列(親の空間)
+Affine getPoseLocal(const Model& model, const PoseClip& pose, const int node, const double time) {
+  int channel = pose.node_channel[node];
+  return (channel >= 0) ? sampleNodeAnim(pose.animation->body[channel], time)
+                        : model.node_list[node]->matrix_orig;
+}
+
+
+// 一つだけ問い合わせる
+//   祖先のチャンネルだけをサンプリングする
+//   node は Model::node_list の位置
+Affine worldTransform(const Model& model, PoseClip& pose, const size_t node, const double time) {
+  // updateModel と同じくループさせる
+  double current_time = std::fmod(time, pose.animation->duration);
+
+  pose.chain.clear();
+  for (int n = int(node); n >= 0; n = model.node_parent[n]) {
+    pose.chain.push_back(n);
+  }
+
+  Affine matrix = Affine::identity();
+  for (auto it = pose.chain.rbegin(); it != pose.chain.rend(); ++it) {
+    matrix = matrix * getPoseLocal(model, pose, *it, current_time);
+  }
+
+  return matrix;
+}
+
+// まとめて問い合わせる
+//   同じ時刻の問い合わせが続く場合は、求めた祖先の行列を使い回す
+//   (同じ時刻のものを並べておくと速い)
+void worldTransform(const Model& model, PoseClip& pose, const std::vector<PoseQuery>& query,
+                    std::vector<Affine>& result) {
+  result.resize(query.size());
+  if (query.empty()) return;
+
+  // 求めた行列の置き場所は最初に一度だけ確保する
+  //   今の時刻で求めた行列には印を付けておく
+  size_t node_num = model.node_list.size();
+  if (pose.world.size() != node_num) {
+    pose.world.resize(node_num);
+    pose.stamp.assign(node_num, 0);
+    pose.current = 0;
+  }
+
+  // 前回の呼び出しで求めたものは使わない
+  pose.current += 1;
+  double current_time = std::fmod(query[0].time, pose.animation->duration);
+
+  for (size_t q = 0; q < query.size(); ++q) {
+    double time = std::fmod(query[q].time, pose.animation->duration);
+    if (time != current_time) {
+      pose.current += 1;
+      current_time = time;
+    }
+
+    // 求めてある祖先まで遡る
+    pose.chain.clear();
+    int n = int(query[q].node);
+    while ((n >= 0) && (pose.stamp[n] != pose.current)) {
+      pose.chain.push_back(n);
+      n = model.node_parent[n];
+    }
+
+    Affine matrix = (n >= 0) ? pose.world[n] : Affine::identity();
+    for (auto it = pose.chain.rbegin(); it != pose.chain.rend(); ++it) {
+      matrix = matrix * getPoseLocal(model, pose, *it, current_time);
+      pose.world[*it] = matrix;
+      pose.stamp[*it] = pose.current;
+    }
+
+    result[q] = pose.world[query[q].node];
+  }
+}
+
+
+// 問い合わせの結果と updateModel の結果の差(行列の要素の差の最大)
+//   モデルのノードとスキニング結果は time の姿勢に書き換わる
+//   ボーン行列をベイクしたクリップは、ベイクの補間の分だけずれる
+float checkWorldTransform(Model& model, const size_t clip, const double time) {
+  updateModel(model, time, clip);
+
+  auto pose = preparePose(model, clip);
+  float diff = 0.0f;
+  for (size_t i = 0; i < model.node_list.size(); ++i) {
+    Affine matrix = worldTransform(model, pose, i, time);
+    const auto& global_matrix = model.node_list[i]->global_matrix;
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 4; ++c) {
+        diff = std::max(diff, std::abs(matrix.m[r][c] - global_matrix.m[r][c]));
+      }
+    }
+  }
+
+  return diff;
+}
@@ -0,0 +1,285 @@
+﻿#pragma once
+
+//
+// テクスチャの段階的な読み込み
+//   モデルの読み込み時は小さな仮のテクスチャだけを用意して、すぐに表示できるようにする
+//   本来の解像度の画像はワーカースレッドで展開し、1フレームに転送する量を制限しながらGLへ送る
+//   圧縮済みのファイル(KTX/DDS)は展開が不要なので、小さいミップマップだけを先に転送して仮のテクスチャにする
+//
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cinder/Surface.h>
+#include <cinder/gl/Texture.h>
+#include "misc.hpp"
+#include "compressed.hpp"
+#include "texture.hpp"
+#include "asset.hpp"
+
+
+// 仮のテクスチャに使うミップマップの大きさの上限
+const u_int TEXTURE_PLACEHOLDER_SIZE = 32;
+
+
+struct TextureJob {
+  TextureJob()
+    : compressed(false),
+      failed(false)
+  {}
+
+  // loadModelTexture と同じ指定
+  std::string path;
+
+  // 差し替え先(使うモデルがいなくなっていたら転送しない)
+  std::weak_ptr<TextureSlot> slot;
+
+  // 圧縮済みのファイルを読んだ
+  bool compressed;
+  CompressedImage image;
+
+  // 展開した画像
+  ci::Surface surface;
+  bool failed;
+};
+
+using TextureJobRef = std::shared_ptr<TextureJob>;
+
+struct TextureStreamer {
+  TextureStreamer()
+    : quit(false),
+      upload_budget(4 * 1024 * 1024),
+      uploaded_bytes(0),
+      uploaded_num(0)
+  {}
+
+  std::vector<std::thread> worker;
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool quit;
+
+  // 展開待ちと転送待ち
+  std::deque<TextureJobRef> request;
+  std::deque<TextureJobRef> ready;
+
+  // 1フレームに転送するバイト数の上限(最低でも一枚は転送する)
+  size_t upload_budget;
+
+  // これまでに転送した量
+  size_t uploaded_bytes;
+  u_int uploaded_num;
+};
+
+
+// 画像が届くまで使う仮のテクスチャ
+//   白にしておけば、マテリアルの色がそのまま見える
+ci::gl::TextureRef getPlaceholderTexture() {
+  static ci::gl::TextureRef texture;
+  if (!texture) {
+    static const unsigned char white[2 * 2 * 4] = {
+      255, 255, 255, 255, 255, 255, 255, 255,
+      255, 255, 255, 255, 255, 255, 255, 255,
+    };
+    texture = ci::gl::Texture::create(white, GL_RGBA, 2, 2);
+  }
+  return texture;
+}
+
+// 圧縮済みの画像から、size 以下のミップマップだけを取り出す
+//   該当するレベルが無ければ空
+CompressedImage getCompressedTail(const CompressedImage& image, const u_int size) {
+  CompressedImage tail;
+  for (size_t i = 0; i < image.level.size(); ++i) {
+    const auto& level = image.level[i];
+    if ((level.width > size) || (level.height > size)) continue;
+
+    tail = image;
+    tail.level.erase(tail.level.begin(), tail.level.begin() + i);
+    tail.width  = level.width;
+    tail.height = level.height;
+    break;
+  }
+
+  return tail;
+}
+
+
+// 画像を展開する(ワーカースレッド)
+void decodeTextureJob(TextureJob& job) {
+  try {
+    job.surface = loadTextureSurface(job.path);
+  }
+  catch (...) {
+    job.failed = true;
+  }
+}
+
+void runTextureStreamer(TextureStreamer& streamer) {
+  while (true) {
+    TextureJobRef job;
+    {
+      std::unique_lock<std::mutex> lock(streamer.mutex);
+      streamer.cond.wait(lock, [&streamer]() { return !streamer.request.empty() || streamer.quit; });
+      if (streamer.quit) break;
+
+      job = streamer.request.front();
+      streamer.request.pop_front();
+    }
+
+    // 使うモデルが無くなっていれば展開しない
+    if (job->slot.expired()) continue;
+
+    decodeTextureJob(*job);
+
+    std::lock_guard<std::mutex> lock(streamer.mutex);
+    streamer.ready.push_back(job);
+  }
+}
+
+void startTextureStreamer(TextureStreamer& streamer, const u_int thread_num = 2) {
+  if (!streamer.worker.empty()) return;
+
+  streamer.quit = false;
+  for (u_int i = 0; i < thread_num; ++i) {
+    streamer.worker.push_back(std::thread([&streamer]() { runTextureStreamer(streamer); }));
+  }
+}
+
+// 展開待ちは捨てる
+void stopTextureStreamer(TextureStreamer& streamer) {
+  {
+    std::lock_guard<std::mutex> lock(streamer.mutex);
+    streamer.quit = true;
+    streamer.request.clear();
+  }
+  streamer.cond.notify_all();
+
+  for (auto& t : streamer.worker) {
+    t.join();
+  }
+  streamer.worker.clear();
+
+  streamer.ready.clear();
+}
+
+
+// テクスチャの読み込みを依頼する
+//   仮のテクスチャを持つスロットをすぐに返し、画像は後で差し替える
+//   path は loadModelTexture と同じ指定
+TextureSlotRef requestStreamTexture(TextureStreamer& streamer, const std::string& path) {
+  std::string key = getTextureKey(path);
+  auto slot = findSharedTexture(key);
+  if (slot) {
+    ci::app::console() << "Texture shared:" << path << std::endl;
+    return slot;
+  }
+
+  slot = std::make_shared<TextureSlot>();
+
+  auto job = std::make_shared<TextureJob>();
+  job->path = path;
+  job->slot = slot;
+
+#if defined (USE_FULL_PATH)
+  std::string file_path = path;
+#else
+  std::string file_path = ci::app::getAssetPath(path).string();
+#endif
+
+  // 圧縮済みのファイルは、小さいミップマップで仮のテクスチャを作る
+  std::string compressed_path = file_path.empty() ? std::string() : findCompressedTexture(file_path);
+  if (!compressed_path.empty() && loadCompressedImage(compressed_path, job->image)) {
+    job->compressed = true;
+
+    auto tail = getCompressedTail(job->image, TEXTURE_PLACEHOLDER_SIZE);
+    slot->texture = createCompressedTexture(tail);
+    if (slot->texture) slot->bytes = getCompressedImageBytes(tail);
+  }
+
+  if (!slot->texture) {
+    slot->texture = getPlaceholderTexture();
+    slot->bytes   = 0;
+  }
+  storeSharedTexture(key, slot);
+
+  {
+    // 圧縮済みのファイルは展開が不要なので、そのまま転送待ちへ
+    std::lock_guard<std::mutex> lock(streamer.mutex);
+    if (job->compressed) {
+      streamer.ready.push_back(job);
+    }
+    else {
+      streamer.request.push_back(job);
+    }
+  }
+  streamer.cond.notify_one();
+
+  ci::app::console() << "Texture request:" << path << std::endl;
+  return slot;
+}
+
+// 届いた画像をGLへ転送して差し替える(メインスレッドで毎フレーム呼ぶ)
+//   転送量が upload_budget を超えたら、残りは次のフレームに回す
+void updateTextureStreamer(TextureStreamer& streamer) {
+  size_t bytes = 0;
+  while (bytes < streamer.upload_budget) {
+    TextureJobRef job;
+    {
+      std::lock_guard<std::mutex> lock(streamer.mutex);
+      if (streamer.ready.empty()) break;
+
+      job = streamer.ready.front();
+      streamer.ready.pop_front();
+    }
+
+    auto slot = job->slot.lock();
+    if (!slot) continue;
+
+    if (job->failed) {
+      ci::app::console() << "Texture read failed:" << job->path << std::endl;
+      continue;
+    }
+
+    ci::gl::TextureRef texture;
+    size_t size = 0;
+    if (job->compressed) {
+      texture = createCompressedTexture(job->image);
+      if (!texture) {
+        // ドライバが対応していない形式なので、元の画像を展開し直す
+        ci::app::console() << "Compressed texture not supported by driver:" << job->path << std::endl;
+        job->compressed = false;
+        job->image = CompressedImage();
+        {
+          std::lock_guard<std::mutex> lock(streamer.mutex);
+          streamer.request.push_back(job);
+        }
+        streamer.cond.notify_one();
+        continue;
+      }
+      size = getCompressedImageBytes(job->image);
+    }
+    else {
+      texture = ci::gl::Texture::create(job->surface);
+      size = getTextureBytes(*texture);
+    }
+
+    slot->texture  = texture;
+    slot->bytes    = size;
+    slot->resident = true;
+
+    bytes += size;
+    streamer.uploaded_bytes += size;
+    streamer.uploaded_num   += 1;
+    ci::app::console() << "Texture resident:" << job->path << " " << size << " bytes" << std::endl;
+  }
+}
+
+// 展開待ちと転送待ちの数
+size_t getTexturePendingNum(TextureStreamer& streamer) {
+  std::lock_guard<std::mutex> lock(streamer.mutex);
+  return streamer.request.size() + streamer.ready.size();
+}
@@ -0,0 +1,435 @@
+﻿#pragma once
+
+//
+// アニメーションの一括サンプリング
+//   全チャンネルの補間対象キーをSoA形式で並べ、
+//   平行移動、スケーリング、回転をまとめて補間する
+//
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "misc.hpp"
+#include "node.hpp"
+#include "animation.hpp"
+
+
+// 16バイト境界に揃えたfloat配列
+using FloatArray = std::vector<float, AlignedAllocator<float, 16> >;
+
+struct SoaVec3 {
+  FloatArray x, y, z;
+
+  void resize(const size_t n, const float value) {
+    x.assign(n, value);
+    y.assign(n, value);
+    z.assign(n, value);
+  }
+};
+
+struct SoaQuat {
+  FloatArray x, y, z, w;
+
+  void resize(const size_t n) {
+    x.assign(n, 0.0f);
+    y.assign(n, 0.0f);
+    z.assign(n, 0.0f);
+    w.assign(n, 1.0f);
+  }
+};
+
+
+// nlerpの誤差が大きくなる角度の境目
+//   二つの回転の内積がこれより小さければslerpで計算し直す
+const float SLERP_THRESHOLD = 0.95f;
+
+
+// サンプリングの作業領域
+//   モデルごとに持ち、アニメーションが切り替わったら作り直す
+struct AnimSampler {
+  AnimSampler()
+    : serial(0),
+      channel_num(0),
+      lane_num(0)
+  {}
+
+  // 対象のアニメーション(Anim::serial)
+  u_int serial;
+
+  size_t channel_num;
+  // SIMDの幅に揃えたチャンネル数
+  size_t lane_num;
+
+  // チャンネルが書き換えるノード
+  std::vector<Node*> node;
+
+  // 前回のキー位置(再生が連続していれば探索がほぼ不要になる)
+  std::vector<u_int> cursor_translate;
+  std::vector<u_int> cursor_scaling;
+  std::vector<u_int> cursor_rotation;
+
+  // 補間する二つのキーと補間係数
+  SoaVec3 translate0, translate1;
+  SoaVec3 scaling0, scaling1;
+  SoaQuat rotation0, rotation1;
+  FloatArray translate_t, scaling_t, rotation_t;
+
+  // 補間結果
+  SoaVec3 translate;
+  SoaVec3 scaling;
+  SoaQuat rotation;
+  FloatArray rotation_dot;
+};
+
+
+// 作業領域の大きさを揃える
+//   チャンネルが書き換えるノードは呼び出し側で用意する
+void resizeAnimSampler(AnimSampler& sampler, const Anim& animation) {
+  sampler.serial      = animation.serial;
+  sampler.channel_num = animation.body.size();
+  sampler.lane_num    = (sampler.channel_num + 3) & ~size_t(3);
+
+  size_t n = sampler.lane_num;
+  sampler.cursor_translate.assign(sampler.channel_num, 0);
+  sampler.cursor_scaling.assign(sampler.channel_num, 0);
+  sampler.cursor_rotation.assign(sampler.channel_num, 0);
+
+  // 余りのレーンは単位値で埋めておく
+  sampler.translate0.resize(n, 0.0f);
+  sampler.translate1.resize(n, 0.0f);
+  sampler.scaling0.resize(n, 1.0f);
+  sampler.scaling1.resize(n, 1.0f);
+  sampler.rotation0.resize(n);
+  sampler.rotation1.resize(n);
+  sampler.translate_t.assign(n, 0.0f);
+  sampler.scaling_t.assign(n, 0.0f);
+  sampler.rotation_t.assign(n, 0.0f);
+
+  sampler.translate.resize(n, 0.0f);
+  sampler.scaling.resize(n, 1.0f);
+  sampler.rotation.resize(n);
+  sampler.rotation_dot.assign(n, 1.0f);
+}
+
+// アニメーションに合わせて作業領域を用意する
+//   チャンネルのノードは名前で探す
+template <typename NodeIndex>
+void setupAnimSampler(AnimSampler& sampler, const NodeIndex& node_index, const Anim& animation) {
+  if (sampler.serial == animation.serial) return;
+
+  sampler.node.clear();
+  sampler.node.reserve(animation.body.size());
+  for (const auto& body : animation.body) {
+    sampler.node.push_back(node_index.at(body.node_name).get());
+  }
+
+  resizeAnimSampler(sampler, animation);
+}
+
+// 束縛時に作ったチャンネル→ノードの対応表で用意する
+//   channel_node はノード一覧での位置
+template <typename NodeList>
+void setupAnimSampler(AnimSampler& sampler, const NodeList& node_list, const std::vector<u_int>& channel_node,
+                      const Anim& animation) {
+  if (sampler.serial == animation.serial) return;
+  assert(channel_node.size() == animation.body.size());
+
+  sampler.node.clear();
+  sampler.node.reserve(channel_node.size());
+  for (auto index : channel_node) {
+    sampler.node.push_back(node_list[index].get());
+  }
+
+  resizeAnimSampler(sampler, animation);
+}
+
+
+// timeを挟むキーの位置を探す(std::upper_boundと同じ結果を返す)
+//   前回の位置から近ければ、二分探索せずに済ませる
+template <typename T>
+u_int findKey(const ArenaVector<T>& keys, const double time, const u_int cursor) {
+  u_int num = u_int(keys.size());
+
+  for (u_int i = cursor; (i <= num) && (i <= cursor + 1); ++i) {
+    bool after  = (i == 0)   || (keys[i - 1].time <= time);
+    bool before = (i == num) || (time < keys[i].time);
+    if (after && before) return i;
+  }
+
+  return u_int(std::upper_bound(keys.begin(), keys.end(), time, Comp<T>()) - keys.begin());
+}
+
+// 補間する二つのキーと係数を取り出す
+template <typename T>
+void findLerpKey(const ArenaVector<T>& keys, const double time, u_int& cursor,
+                 const T*& key0, const T*& key1, float& t) {
+  cursor = findKey(keys, time, cursor);
+
+  if (cursor == 0) {
+    // 先頭より小さい時間
+    key0 = key1 = &keys.front();
+    t = 0.0f;
+  }
+  else if (cursor == keys.size()) {
+    // 最後尾より大きい時間
+    key0 = key1 = &keys.back();
+    t = 0.0f;
+  }
+  else {
+    key0 = &keys[cursor - 1];
+    key1 = &keys[cursor];
+    t = float((time - key0->time) / (key1->time - key0->time));
+  }
+}
+
+void setSoa(SoaVec3& soa, const size_t i, const ci::Vec3f& v) {
+  soa.x[i] = v.x;
+  soa.y[i] = v.y;
+  soa.z[i] = v.z;
+}
+
+void setSoa(SoaQuat& soa, const size_t i, const ci::Quatf& q) {
+  soa.x[i] = q.v.x;
+  soa.y[i] = q.v.y;
+  soa.z[i] = q.v.z;
+  soa.w[i] = q.w;
+}
+
+// 全チャンネルの補間対象を集める
+void gatherAnimKeys(AnimSampler& sampler, const Anim& animation, const double time) {
+  for (size_t i = 0; i < sampler.channel_num; ++i) {
+    const auto& body = animation.body[i];
+
+    if (!body.translate.empty()) {
+      const VectorKey* key0;
+      const VectorKey* key1;
+      findLerpKey(body.translate, time, sampler.cursor_translate[i], key0, key1, sampler.translate_t[i]);
+      setSoa(sampler.translate0, i, key0->value);
+      setSoa(sampler.translate1, i, key1->value);
+    }
+
+    if (!body.scaling.empty()) {
+      const VectorKey* key0;
+      const VectorKey* key1;
+      findLerpKey(body.scaling, time, sampler.cursor_scaling[i], key0, key1, sampler.scaling_t[i]);
+      setSoa(sampler.scaling0, i, key0->value);
+      setSoa(sampler.scaling1, i, key1->value);
+    }
+
+    if (!body.rotation.empty()) {
+      const QuatKey* key0;
+      const QuatKey* key1;
+      findLerpKey(body.rotation, time, sampler.cursor_rotation[i], key0, key1, sampler.rotation_t[i]);
+      setSoa(sampler.rotation0, i, key0->value);
+      setSoa(sampler.rotation1, i, key1->value);
+    }
+  }
+}
+
+
+// out = a + (b - a) * t
+void lerpArray(const float* a, const float* b, const float* t, float* out, const size_t n) {
+#if defined (USE_SSE)
+  for (size_t i = 0; i < n; i += 4) {
+    __m128 va = _mm_load_ps(a + i);
+    __m128 vb = _mm_load_ps(b + i);
+    __m128 vt = _mm_load_ps(t + i);
+    _mm_store_ps(out + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), vt)));
+  }
+#else
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = a[i] + (b[i] - a[i]) * t[i];
+  }
+#endif
+}
+
+void lerpSoa(const SoaVec3& a, const SoaVec3& b, const FloatArray& t, SoaVec3& out, const size_t n) {
+  lerpArray(&a.x[0], &b.x[0], &t[0], &out.x[0], n);
+  lerpArray(&a.y[0], &b.y[0], &t[0], &out.y[0], n);
+  lerpArray(&a.z[0], &b.z[0], &t[0], &out.z[0], n);
+}
+
+// 回転をまとめてnlerpする
+//   遠回りしないよう内積が負ならb側を反転
+//   内積の絶対値はslerpで補正するかの判定に使う
+void nlerpSoa(const SoaQuat& a, const SoaQuat& b, const FloatArray& t,
+              SoaQuat& out, FloatArray& dot, const size_t n) {
+#if defined (USE_SSE)
+  const __m128 sign_bit = _mm_set1_ps(-0.0f);
+  const __m128 zero     = _mm_setzero_ps();
+
+  for (size_t i = 0; i < n; i += 4) {
+    __m128 ax = _mm_load_ps(&a.x[i]);
+    __m128 ay = _mm_load_ps(&a.y[i]);
+    __m128 az = _mm_load_ps(&a.z[i]);
+    __m128 aw = _mm_load_ps(&a.w[i]);
+    __m128 bx = _mm_load_ps(&b.x[i]);
+    __m128 by = _mm_load_ps(&b.y[i]);
+    __m128 bz = _mm_load_ps(&b.z[i]);
+    __m128 bw = _mm_load_ps(&b.w[i]);
+    __m128 vt = _mm_load_ps(&t[i]);
+
+    __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)),
+                          _mm_add_ps(_mm_mul_ps(az, bz), _mm_mul_ps(aw, bw)));
+
+    // 内積が負のレーンだけ符号を反転
+    __m128 flip = _mm_and_ps(_mm_cmplt_ps(d, zero), sign_bit);
+    bx = _mm_xor_ps(bx, flip);
+    by = _mm_xor_ps(by, flip);
+    bz = _mm_xor_ps(bz, flip);
+    bw = _mm_xor_ps(bw, flip);
+    _mm_store_ps(&dot[i], _mm_xor_ps(d, flip));
+
+    __m128 x = _mm_add_ps(ax, _mm_mul_ps(_mm_sub_ps(bx, ax), vt));
+    __m128 y = _mm_add_ps(ay, _mm_mul_ps(_mm_sub_ps(by, ay), vt));
+    __m128 z = _mm_add_ps(az, _mm_mul_ps(_mm_sub_ps(bz, az), vt));
+    __m128 w = _mm_add_ps(aw, _mm_mul_ps(_mm_sub_ps(bw, aw), vt));
+
+    __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+                                        _mm_add_ps(_mm_mul_ps(z, z), _mm_mul_ps(w, w))));
+
+    _mm_store_ps(&out.x[i], _mm_div_ps(x, len));
+    _mm_store_ps(&out.y[i], _mm_div_ps(y, len));
+    _mm_store_ps(&out.z[i], _mm_div_ps(z, len));
+    _mm_store_ps(&out.w[i], _mm_div_ps(w, len));
+  }
+#else
+  for (size_t i = 0; i < n; ++i) {
+    float d = a.x[i] * b.x[i] + a.y[i] * b.y[i] + a.z[i] * b.z[i] + a.w[i] * b.w[i];
+    float s = (d < 0.0f) ? -1.0f : 1.0f;
+    dot[i] = d * s;
+
+    float x = a.x[i] + (b.x[i] * s - a.x[i]) * t[i];
+    float y = a.y[i] + (b.y[i] * s - a.y[i]) * t[i];
+    float z = a.z[i] + (b.z[i] * s - a.z[i]) * t[i];
+    float w = a.w[i] + (b.w[i] * s - a.w[i]) * t[i];
+
+    float len = std::sqrt(x * x + y * y + z * z + w * w);
+    out.x[i] = x / len;
+    out.y[i] = y / len;
+    out.z[i] = z / len;
+    out.w[i] = w / len;
+  }
+#endif
+}
+
+// nlerpでは誤差が大きいチャンネルだけslerpで計算し直す
+void correctSlerp(AnimSampler& sampler) {
+  for (size_t i = 0; i < sampler.channel_num; ++i) {
+    float d = sampler.rotation_dot[i];
+    if (d >= SLERP_THRESHOLD) continue;
+
+    const auto& a = sampler.rotation0;
+    const auto& b = sampler.rotation1;
+    float s = 1.0f;
+    if ((a.x[i] * b.x[i] + a.y[i] * b.y[i] + a.z[i] * b.z[i] + a.w[i] * b.w[i]) < 0.0f) s = -1.0f;
+
+    float theta = std::acos(std::min(d, 1.0f));
+    float sin_theta = std::sin(theta);
+    float t  = sampler.rotation_t[i];
+    float ka = std::sin((1.0f - t) * theta) / sin_theta;
+    float kb = std::sin(t * theta) / sin_theta * s;
+
+    sampler.rotation.x[i] = a.x[i] * ka + b.x[i] * kb;
+    sampler.rotation.y[i] = a.y[i] * ka + b.y[i] * kb;
+    sampler.rotation.z[i] = a.z[i] * ka + b.z[i] * kb;
+    sampler.rotation.w[i] = a.w[i] * ka + b.w[i] * kb;
+  }
+}
+
+
+// 全チャンネルをまとめてサンプリング
+void sampleAnimation(AnimSampler& sampler, const Anim& animation, const double time) {
+  gatherAnimKeys(sampler, animation, time);
+
+  size_t n = sampler.lane_num;
+  if (n == 0) return;
+
+  lerpSoa(sampler.translate0, sampler.translate1, sampler.translate_t, sampler.translate, n);
+  lerpSoa(sampler.scaling0, sampler.scaling1, sampler.scaling_t, sampler.scaling, n);
+  nlerpSoa(sampler.rotation0, sampler.rotation1, sampler.rotation_t,
+           sampler.rotation, sampler.rotation_dot, n);
+  correctSlerp(sampler);
+}
+
+ci::Vec3f getSampledTranslate(const AnimSampler& sampler, const size_t i) {
+  return ci::Vec3f{ sampler.translate.x[i], sampler.translate.y[i], sampler.translate.z[i] };
+}
+
+ci::Vec3f getSampledScaling(const AnimSampler& sampler, const size_t i) {
+  return ci::Vec3f{ sampler.scaling.x[i], sampler.scaling.y[i], sampler.scaling.z[i] };
+}
+
+ci::Quatf getSampledRotation(const AnimSampler& sampler, const size_t i) {
+  return ci::Quatf{ sampler.rotation.w[i], sampler.rotation.x[i], sampler.rotation.y[i], sampler.rotation.z[i] };
+}
+
+
+// 回転の補間(一つ分)
+//   まとめて補間する時と同じく、nlerpの誤差が大きい時だけslerpで求める
+ci::Quatf lerpRotation(const ci::Quatf& a, const ci::Quatf& b, const float t) {
+  float d = a.v.x * b.v.x + a.v.y * b.v.y + a.v.z * b.v.z + a.w * b.w;
+  float s = (d < 0.0f) ? -1.0f : 1.0f;
+  d *= s;
+
+  float ka = 1.0f - t;
+  float kb = t * s;
+  if (d < SLERP_THRESHOLD) {
+    float theta = std::acos(std::min(d, 1.0f));
+    float sin_theta = std::sin(theta);
+    ka = std::sin((1.0f - t) * theta) / sin_theta;
+    kb = std::sin(t * theta) / sin_theta * s;
+  }
+
+  float x = a.v.x * ka + b.v.x * kb;
+  float y = a.v.y * ka + b.v.y * kb;
+  float z = a.v.z * ka + b.v.z * kb;
+  float w = a.w * ka + b.w * kb;
+  if (d >= SLERP_THRESHOLD) {
+    float len = std::sqrt(x * x + y * y + z * z + w * w);
+    x /= len;
+    y /= len;
+    z /= len;
+    w /= len;
+  }
+
+  return ci::Quatf{ w, x, y, z };
+}
+
+// 一チャンネルだけサンプリングして、ノードの行列を求める
+//   キーの無い成分は単位値
+Affine sampleNodeAnim(const NodeAnim& body, const double time) {
+  ci::Vec3f translate = ci::Vec3f::zero();
+  ci::Vec3f scaling   = ci::Vec3f::one();
+  ci::Quatf rotation  = ci::Quatf::identity();
+  u_int cursor;
+
+  if (!body.translate.empty()) {
+    const VectorKey* key0;
+    const VectorKey* key1;
+    float t;
+    cursor = 0;
+    findLerpKey(body.translate, time, cursor, key0, key1, t);
+    translate = key0->value + (key1->value - key0->value) * t;
+  }
+
+  if (!body.scaling.empty()) {
+    const VectorKey* key0;
+    const VectorKey* key1;
+    float t;
+    cursor = 0;
+    findLerpKey(body.scaling, time, cursor, key0, key1, t);
+    scaling = key0->value + (key1->value - key0->value) * t;
+  }
+
+  if (!body.rotation.empty()) {
+    const QuatKey* key0;
+    const QuatKey* key1;
+    float t;
+    cursor = 0;
+    findLerpKey(body.rotation, time, cursor, key0, key1, t);
+    rotation = lerpRotation(key0->value, key1->value, t);
+  }
+
+  return composeAffine(translate, rotation, scaling);
+}
@@ -0,0 +1,239 @@
+﻿#pragma once
+
+//
+// アニメーションの更新頻度の制御
+//   画面上の大きさや優先度から、毎フレーム/2フレームごと/4フレームごとの更新を選ぶ
+//   更新するフレームはモデルごとにずらし、1フレームあたりの処理時間の上限も守る
+//   更新しないフレームは、直前の二回の結果を補間して表示する
+//
+
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "model.hpp"
+
+
+// 更新対象のモデル
+struct AnimInstance {
+  AnimInstance()
+    : model(nullptr),
+      clip(0),
+      time(0.0),
+      speed(1.0),
+      priority(0.0f),
+      screen_size(1.0f),
+      interval(1),
+      next_frame(0),
+      eval_time(0.0),
+      prev_eval_time(0.0),
+      evaluated(false),
+      cost(0.0)
+  {}
+
+  Model* model;
+  size_t clip;
+
+  // 再生位置と再生速度
+  double time;
+  double speed;
+
+  // 優先度(0〜1)
+  float priority;
+  // 画面に占める大きさ(0〜1)
+  float screen_size;
+
+  // 更新間隔(フレーム)
+  u_int interval;
+  u_int next_frame;
+
+  // 直前の二回の評価時刻と、その時のノード行列
+  double eval_time;
+  double prev_eval_time;
+  bool evaluated;
+  std::vector<Affine> pose;
+  std::vector<Affine> prev_pose;
+
+  // 一回の評価にかかった時間(秒)
+  double cost;
+};
+
+struct AnimScheduler {
+  AnimScheduler()
+    : frame(0),
+      budget(0.004),
+      used_time(0.0),
+      evaluated_num(0),
+      deferred_num(0)
+  {}
+
+  std::vector<AnimInstance> instance;
+
+  u_int frame;
+
+  // 1フレームで評価に使える時間(秒)
+  double budget;
+
+  // 直前のフレームの統計
+  double used_time;
+  u_int evaluated_num;
+  u_int deferred_num;
+};
+
+
+// 登録
+//   更新フレームがずれるよう、登録順に開始フレームを散らす
+size_t addAnimInstance(AnimScheduler& scheduler, Model* model, const size_t clip, const float priority) {
+  AnimInstance instance;
+  instance.model      = model;
+  instance.clip       = clip;
+  instance.priority   = priority;
+  instance.next_frame = scheduler.frame + u_int(scheduler.instance.size() % 4);
+
+  scheduler.instance.push_back(instance);
+  return scheduler.instance.size() - 1;
+}
+
+// モデルを読み込み直した時などに、補間用の情報を捨てる
+void resetAnimInstance(AnimInstance& instance) {
+  instance.evaluated = false;
+  instance.pose.clear();
+  instance.prev_pose.clear();
+
+  if (!instance.model) return;
+  for (const auto& node : instance.model->node_list) {
+    for (auto& mesh : node->mesh) {
+      if (mesh.skin.use_blend) mesh.skin.serial += 1;
+      mesh.skin.use_blend = false;
+    }
+  }
+}
+
+// 画面上の大きさと優先度から更新間隔を決める
+u_int chooseUpdateInterval(const AnimInstance& instance) {
+  float importance = std::max(instance.screen_size, instance.priority);
+
+  if (importance > 0.25f) return 1;
+  if (importance > 0.08f) return 2;
+  return 4;
+}
+
+
+// 評価
+//   間引いて更新する場合は、次に更新するまでの時間分先の姿勢を求めておき
+//   間のフレームは直前の結果との補間で埋める
+void evaluateAnimInstance(AnimInstance& instance, const double frame_time) {
+  auto& model = *instance.model;
+
+  double target = instance.time;
+  if (instance.interval > 1) target += frame_time * instance.speed * instance.interval;
+
+  auto start = std::chrono::steady_clock::now();
+  updateModel(model, target, instance.clip);
+  std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+
+  // 毎回少しずつ追従させる
+  instance.cost = instance.evaluated ? (instance.cost * 0.75 + dt.count() * 0.25) : dt.count();
+
+  size_t node_num = model.node_list.size();
+  instance.prev_pose.swap(instance.pose);
+  instance.pose.resize(node_num);
+  for (size_t i = 0; i < node_num; ++i) {
+    instance.pose[i] = model.node_list[i]->global_matrix;
+  }
+
+  if (!instance.evaluated || (instance.prev_pose.size() != node_num)) {
+    instance.prev_pose = instance.pose;
+    instance.prev_eval_time = target;
+  }
+  else {
+    instance.prev_eval_time = instance.eval_time;
+  }
+  instance.eval_time = target;
+  instance.evaluated = true;
+}
+
+// 直前の二回の評価結果を補間して表示用の姿勢を作る
+void blendAnimInstance(AnimInstance& instance) {
+  auto& model = *instance.model;
+
+  bool blend = (instance.interval > 1) && (instance.eval_time > instance.prev_eval_time);
+
+  float alpha = 1.0f;
+  if (blend) {
+    alpha = float((instance.time - instance.prev_eval_time) / (instance.eval_time - instance.prev_eval_time));
+    alpha = std::min(std::max(alpha, 0.0f), 1.0f);
+  }
+
+  for (size_t i = 0; i < model.node_list.size(); ++i) {
+    auto& node = model.node_list[i];
+    node->global_matrix = blend ? lerpAffine(instance.prev_pose[i], instance.pose[i], alpha)
+                                : instance.pose[i];
+
+    for (auto& mesh : node->mesh) {
+      if (!isDynamicMesh(mesh)) continue;
+
+      auto& skin = mesh.skin;
+      if (skin.use_blend != blend) skin.serial += 1;
+      skin.use_blend = blend;
+      if (!blend) continue;
+
+      // スキニング結果は、直前の結果がback、最新の結果がfrontにある
+      const auto& prev = skin.getBackConst();
+      const auto& next = skin.getFront();
+      if (skin.blend.size() != next.size()) skin.blend = next;
+
+      for (u_int v = mesh.skin_begin; v < mesh.skin_end; ++v) {
+        skin.blend[v].position = prev[v].position.lerp(alpha, next[v].position);
+        skin.blend[v].normal   = prev[v].normal.lerp(alpha, next[v].normal);
+      }
+      skin.serial += 1;
+    }
+  }
+}
+
+
+// 1フレーム分の更新
+//   frame_time はフレーム間の経過時間(秒)
+void updateAnimScheduler(AnimScheduler& scheduler, const double frame_time) {
+  // 今回更新するものを、重要度と待たされたフレーム数で並べる
+  std::vector<std::pair<float, size_t> > due;
+  for (size_t i = 0; i < scheduler.instance.size(); ++i) {
+    auto& instance = scheduler.instance[i];
+    if (!instance.model || !instance.model->has_anim) continue;
+
+    instance.interval = chooseUpdateInterval(instance);
+    if (instance.evaluated && (scheduler.frame < instance.next_frame)) continue;
+
+    float importance = std::max(instance.screen_size, instance.priority);
+    float overdue    = float(scheduler.frame - std::min(scheduler.frame, instance.next_frame));
+    due.emplace_back((importance + 0.01f) * (1.0f + overdue), i);
+  }
+  std::sort(due.begin(), due.end(), std::greater<std::pair<float, size_t> >());
+
+  scheduler.used_time     = 0.0;
+  scheduler.evaluated_num = 0;
+  scheduler.deferred_num  = 0;
+
+  for (const auto& d : due) {
+    auto& instance = scheduler.instance[d.second];
+
+    // 上限を超えそうなら次のフレームへ回す(少なくとも一つは評価する)
+    if ((scheduler.evaluated_num > 0) && (scheduler.used_time + instance.cost > scheduler.budget)) {
+      scheduler.deferred_num += 1;
+      continue;
+    }
+
+    evaluateAnimInstance(instance, frame_time);
+    instance.next_frame = scheduler.frame + instance.interval;
+
+    scheduler.used_time     += instance.cost;
+    scheduler.evaluated_num += 1;
+  }
+
+  for (auto& instance : scheduler.instance) {
+    if (instance.evaluated) blendAnimInstance(instance);
+  }
+
+  scheduler.frame += 1;
+}
@@ -0,0 +1,140 @@
+﻿#pragma once
+
+//
+// 影響するボーンの数ごとのスキニング
+//   頂点を影響するボーンの数で組に分けておき、組ごとにボーン数と法線の有無を固定した処理で計算する
+//   一つのボーンだけに従う頂点(機械や鎧など)は、ウェイトを掛けずに行列で変換するだけで済む
+//   二つ以上のボーンに従う頂点は、ボーン行列をウェイトで合成してから一度だけ変換する
+//
+
+#include <vector>
+#include <cmath>
+#include "misc.hpp"
+#include "affine.hpp"
+#include "mesh.hpp"
+
+
+// スキニングの入力(初期姿勢)
+struct SkinSourceBody {
+  const ci::Vec3f* position;
+  const ci::Vec3f* normal;
+
+  const ci::Vec3f& getPosition(const u_int i) const { return position[i]; }
+  const ci::Vec3f& getNormal(const u_int i) const { return normal[i]; }
+};
+
+// スキニングの入力(モーフターゲット適用後)
+struct SkinSourceMorph {
+  const SkinVertex* vtx;
+
+  const ci::Vec3f& getPosition(const u_int i) const { return vtx[i].position; }
+  const ci::Vec3f& getNormal(const u_int i) const { return vtx[i].normal; }
+};
+
+
+// ボーン行列をウェイトで合成する
+Affine blendBoneMatrix(const BoneInfluence* influence, const u_int num, const Affine* bone_matrix) {
+  Affine r;
+  const auto& m0 = bone_matrix[influence[0].bone];
+  float w0 = influence[0].value;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      r.m[i][j] = m0.m[i][j] * w0;
+    }
+  }
+
+  for (u_int k = 1; k < num; ++k) {
+    const auto& m = bone_matrix[influence[k].bone];
+    float w = influence[k].value;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        r.m[i][j] += m.m[i][j] * w;
+      }
+    }
+  }
+
+  return r;
+}
+
+// 一つの頂点を計算する
+//   num は影響するボーンの数(rigid なら一つのボーンにウェイト1で従う)
+template <bool NORMAL, typename Source>
+void skinVertex(const Source& src, const u_int id, const BoneInfluence* influence, const u_int num,
+                const bool rigid, const Affine* bone_matrix, SkinVertex& v) {
+  if (!num) {
+    // ウェイトを持たない頂点
+    v.position = ci::Vec3f::zero();
+    if (NORMAL) v.normal = ci::Vec3f::zero();
+    return;
+  }
+
+  if (rigid) {
+    const auto& m = bone_matrix[influence[0].bone];
+    v.position = m.transformPoint(src.getPosition(id));
+    if (NORMAL) v.normal = m.transformVec(src.getNormal(id));
+    return;
+  }
+
+  Affine m = blendBoneMatrix(influence, num, bone_matrix);
+  v.position = m.transformPoint(src.getPosition(id));
+  if (NORMAL) v.normal = m.transformVec(src.getNormal(id));
+}
+
+// 組に含まれる頂点をまとめて計算する
+//   N は影響するボーンの数(SKIN_GROUP_GENERIC なら頂点ごとに調べる)
+template <u_int N, bool NORMAL, typename Source>
+void skinVertexGroup(const Mesh& mesh, const Source& src, const Affine* bone_matrix, SkinVertex* dst) {
+  const u_int* offset = mesh.influence_offset.data();
+  const BoneInfluence* influence = mesh.influence.data();
+
+  for (auto id : mesh.skin_group[N]) {
+    u_int num = (N == SKIN_GROUP_GENERIC) ? (offset[id + 1] - offset[id]) : N;
+    skinVertex<NORMAL>(src, id, influence + offset[id], num, N == 1, bone_matrix, dst[id]);
+  }
+}
+
+// 全ての組を計算する
+template <bool NORMAL, typename Source>
+void skinVertexGroups(const Mesh& mesh, const Source& src, const Affine* bone_matrix, SkinVertex* dst) {
+  skinVertexGroup<0, NORMAL>(mesh, src, bone_matrix, dst);
+  skinVertexGroup<1, NORMAL>(mesh, src, bone_matrix, dst);
+  skinVertexGroup<2, NORMAL>(mesh, src, bone_matrix, dst);
+  skinVertexGroup<3, NORMAL>(mesh, src, bone_matrix, dst);
+  skinVertexGroup<4, NORMAL>(mesh, src, bone_matrix, dst);
+  skinVertexGroup<SKIN_GROUP_GENERIC, NORMAL>(mesh, src, bone_matrix, dst);
+}
+
+// 入力と法線の有無で振り分ける
+void skinMeshGroups(const Mesh& mesh, const Affine* bone_matrix, SkinVertex* dst) {
+  bool has_normal = mesh.body.hasNormals();
+  if (mesh.has_morph) {
+    SkinSourceMorph src{ mesh.morph_vtx.data() };
+    if (has_normal) skinVertexGroups<true>(mesh, src, bone_matrix, dst);
+    else            skinVertexGroups<false>(mesh, src, bone_matrix, dst);
+  }
+  else {
+    SkinSourceBody src{ mesh.body.getVertices().data(), mesh.body.getNormals().data() };
+    if (has_normal) skinVertexGroups<true>(mesh, src, bone_matrix, dst);
+    else            skinVertexGroups<false>(mesh, src, bone_matrix, dst);
+  }
+}
+
+// 一つの頂点を計算し直す(差分スキニング用)
+//   組に分けた時と同じ判定で、全体を計算した時と同じ結果にする
+void skinMeshVertex(const Mesh& mesh, const u_int id, const Affine* bone_matrix, SkinVertex& v) {
+  const BoneInfluence* influence = &mesh.influence[mesh.influence_offset[id]];
+  u_int num  = mesh.influence_offset[id + 1] - mesh.influence_offset[id];
+  bool rigid = isRigidInfluence(influence, num);
+
+  bool has_normal = mesh.body.hasNormals();
+  if (mesh.has_morph) {
+    SkinSourceMorph src{ mesh.morph_vtx.data() };
+    if (has_normal) skinVertex<true>(src, id, influence, num, rigid, bone_matrix, v);
+    else            skinVertex<false>(src, id, influence, num, rigid, bone_matrix, v);
+  }
+  else {
+    SkinSourceBody src{ mesh.body.getVertices().data(), mesh.body.getNormals().data() };
+    if (has_normal) skinVertex<true>(src, id, influence, num, rigid, bone_matrix, v);
+    else            skinVertex<false>(src, id, influence, num, rigid, bone_matrix, v);
+  }
+}
@@ -0,0 +1,373 @@
+﻿#pragma once
+
+//
+// アニメーションのストリーミング再生
+//   キーフレームを一定時間ごとのブロックに分けてファイルに書き出し
+//   再生位置の少し先までを非同期で読み込んで使う
+//
+// ファイル構成
+//   ヘッダ
+//   チャンネル名
+//   ブロックの位置とサイズ
+//   ブロック本体(チャンネルごとに 平行移動 スケーリング 回転 のキー)
+//
+// 各ブロックは範囲の直前と直後のキーも含めて持っているので
+// ブロック単体で補間してもブロック境界で値が途切れない
+//
+
+#include <fstream>
+#include <future>
+#include <map>
+#include <set>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include "model.hpp"
+
+
+// ファイル識別子
+const uint32_t STREAM_CLIP_MAGIC   = 0x53414B53;    // "SKAS"
+const uint32_t STREAM_CLIP_VERSION = 1;
+
+
+template <typename T>
+void writeStreamValue(std::ostream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T readStreamValue(std::istream& in) {
+  T value;
+  in.read(reinterpret_cast<char*>(&value), sizeof(T));
+  return value;
+}
+
+void writeStreamKey(std::ostream& out, const VectorKey& key) {
+  writeStreamValue(out, key.time);
+  writeStreamValue(out, key.value.x);
+  writeStreamValue(out, key.value.y);
+  writeStreamValue(out, key.value.z);
+}
+
+void writeStreamKey(std::ostream& out, const QuatKey& key) {
+  writeStreamValue(out, key.time);
+  writeStreamValue(out, key.value.w);
+  writeStreamValue(out, key.value.v.x);
+  writeStreamValue(out, key.value.v.y);
+  writeStreamValue(out, key.value.v.z);
+}
+
+void readStreamKey(std::istream& in, VectorKey& key) {
+  key.time    = readStreamValue<double>(in);
+  key.value.x = readStreamValue<float>(in);
+  key.value.y = readStreamValue<float>(in);
+  key.value.z = readStreamValue<float>(in);
+}
+
+void readStreamKey(std::istream& in, QuatKey& key) {
+  key.time      = readStreamValue<double>(in);
+  key.value.w   = readStreamValue<float>(in);
+  key.value.v.x = readStreamValue<float>(in);
+  key.value.v.y = readStreamValue<float>(in);
+  key.value.v.z = readStreamValue<float>(in);
+}
+
+// [begin_time, end_time] の補間に必要なキーを書き出す
+//   範囲の直前と直後のキーを含める
+template <typename T>
+void writeStreamKeys(std::ostream& out, const ArenaVector<T>& keys,
+                     const double begin_time, const double end_time) {
+  if (keys.empty()) {
+    writeStreamValue(out, uint32_t(0));
+    return;
+  }
+
+  auto first = std::upper_bound(keys.begin(), keys.end(), begin_time, Comp<T>());
+  if (first != keys.begin()) --first;
+
+  auto last = std::lower_bound(first, keys.end(), end_time,
+                               [](const T& lhs, const double rhs) { return lhs.time < rhs; });
+  if (last == keys.end()) --last;
+
+  writeStreamValue(out, uint32_t(last - first + 1));
+  for (auto it = first; it <= last; ++it) {
+    writeStreamKey(out, *it);
+  }
+}
+
+template <typename T>
+void readStreamKeys(std::istream& in, ArenaVector<T>& keys) {
+  uint32_t num = readStreamValue<uint32_t>(in);
+  keys.resize(num);
+  for (auto& key : keys) {
+    readStreamKey(in, key);
+  }
+}
+
+
+// アニメーションをブロック分割してファイルに書き出す
+//   block_duration はアニメーションと同じ時間単位
+void writeStreamClip(const Anim& anim, const std::string& path, const double block_duration) {
+  assert(block_duration > 0.0);
+
+  std::ofstream out(path, std::ios::binary);
+  assert(out);
+
+  uint32_t block_num = std::max(uint32_t(std::ceil(anim.duration / block_duration)), uint32_t(1));
+
+  writeStreamValue(out, STREAM_CLIP_MAGIC);
+  writeStreamValue(out, STREAM_CLIP_VERSION);
+  writeStreamValue(out, anim.duration);
+  writeStreamValue(out, block_duration);
+  writeStreamValue(out, uint32_t(anim.body.size()));
+  writeStreamValue(out, block_num);
+
+  for (const auto& body : anim.body) {
+    writeStreamValue(out, uint32_t(body.node_name.size()));
+    out.write(body.node_name.data(), body.node_name.size());
+  }
+
+  // ブロックの位置は後で埋める
+  auto index_pos = out.tellp();
+  for (uint32_t i = 0; i < block_num; ++i) {
+    writeStreamValue(out, uint64_t(0));
+    writeStreamValue(out, uint64_t(0));
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t> > index;
+  for (uint32_t i = 0; i < block_num; ++i) {
+    double begin_time = i * block_duration;
+    double end_time   = std::min((i + 1) * block_duration, anim.duration);
+
+    auto begin_pos = out.tellp();
+    for (const auto& body : anim.body) {
+      writeStreamKeys(out, body.translate, begin_time, end_time);
+      writeStreamKeys(out, body.scaling, begin_time, end_time);
+      writeStreamKeys(out, body.rotation, begin_time, end_time);
+    }
+    auto end_pos = out.tellp();
+
+    index.emplace_back(uint64_t(begin_pos), uint64_t(end_pos - begin_pos));
+  }
+
+  out.seekp(index_pos);
+  for (const auto& i : index) {
+    writeStreamValue(out, i.first);
+    writeStreamValue(out, i.second);
+  }
+}
+
+
+// 読み込んだブロック
+//   ブロックの時間範囲分のキーを持ったAnimとして扱う
+using StreamBlockRef = std::shared_ptr<const Anim>;
+
+struct StreamClip {
+  StreamClip()
+    : duration(0.0),
+      block_duration(1.0),
+      budget(8 * 1024 * 1024),
+      prefetch_num(2),
+      resident_bytes(0),
+      use_count(0)
+  {}
+
+  std::string path;
+
+  double duration;
+  double block_duration;
+
+  std::vector<std::string> channel_name;
+
+  // ブロックのファイル内の位置とサイズ
+  std::vector<std::pair<uint64_t, uint64_t> > block_index;
+
+  // 常駐させるブロックの上限(バイト)
+  size_t budget;
+  // 再生位置から先読みするブロック数
+  u_int prefetch_num;
+
+  struct Resident {
+    StreamBlockRef block;
+    size_t bytes;
+    u_int last_use;
+  };
+
+  std::map<u_int, Resident> resident;
+  std::map<u_int, std::future<StreamBlockRef> > pending;
+  size_t resident_bytes;
+  u_int use_count;
+};
+
+
+// ストリーミング用ファイルを開く
+//   ここではヘッダとブロックの位置だけを読む
+StreamClip openStreamClip(const std::string& path) {
+  StreamClip clip;
+  clip.path = path;
+
+  std::ifstream in(path, std::ios::binary);
+  assert(in);
+
+  uint32_t magic   = readStreamValue<uint32_t>(in);
+  uint32_t version = readStreamValue<uint32_t>(in);
+  assert((magic == STREAM_CLIP_MAGIC) && (version == STREAM_CLIP_VERSION));
+
+  clip.duration       = readStreamValue<double>(in);
+  clip.block_duration = readStreamValue<double>(in);
+  uint32_t channel_num = readStreamValue<uint32_t>(in);
+  uint32_t block_num   = readStreamValue<uint32_t>(in);
+
+  clip.channel_name.resize(channel_num);
+  for (auto& name : clip.channel_name) {
+    name.resize(readStreamValue<uint32_t>(in));
+    in.read(&name[0], name.size());
+  }
+
+  clip.block_index.resize(block_num);
+  for (auto& i : clip.block_index) {
+    i.first  = readStreamValue<uint64_t>(in);
+    i.second = readStreamValue<uint64_t>(in);
+  }
+
+  ci::app::console() << "Stream clip:" << path
+                     << " channels:" << channel_num
+                     << " blocks:" << block_num << std::endl;
+
+  return clip;
+}
+
+// ブロックを一つ読み込む
+//   非同期読み込みから呼ばれるので、StreamClipには触らない
+StreamBlockRef readStreamBlock(const std::string& path,
+                               const std::vector<std::string>& channel_name,
+                               const double duration,
+                               const std::pair<uint64_t, uint64_t>& index) {
+  std::ifstream in(path, std::ios::binary);
+  in.seekg(index.first);
+
+  auto block = std::make_shared<Anim>();
+  block->duration = duration;
+  block->body.resize(channel_name.size());
+  for (size_t i = 0; i < channel_name.size(); ++i) {
+    auto& body = block->body[i];
+    body.node_name = channel_name[i];
+
+    readStreamKeys(in, body.translate);
+    readStreamKeys(in, body.scaling);
+    readStreamKeys(in, body.rotation);
+  }
+
+  return block;
+}
+
+u_int getStreamBlockIndex(const StreamClip& clip, const double time) {
+  u_int index = u_int(time / clip.block_duration);
+  return std::min(index, u_int(clip.block_index.size() - 1));
+}
+
+// ブロックの非同期読み込みを要求
+void requestStreamBlock(StreamClip& clip, const u_int index) {
+  if (clip.resident.count(index) || clip.pending.count(index)) return;
+
+  clip.pending.emplace(index, std::async(std::launch::async,
+                                         readStreamBlock,
+                                         clip.path, clip.channel_name, clip.duration,
+                                         clip.block_index[index]));
+}
+
+// 読み込みが終わったブロックを常駐させる
+void addStreamResident(StreamClip& clip, const u_int index, StreamBlockRef block) {
+  StreamClip::Resident resident;
+  resident.block    = std::move(block);
+  resident.bytes    = size_t(clip.block_index[index].second);
+  resident.last_use = clip.use_count;
+
+  clip.resident_bytes += resident.bytes;
+  clip.resident.emplace(index, std::move(resident));
+}
+
+// 上限を超えていたら、しばらく使っていないブロックから追い出す
+//   keep に含まれるブロックは残す
+void evictStreamBlock(StreamClip& clip, const std::set<u_int>& keep) {
+  while (clip.resident_bytes > clip.budget) {
+    auto oldest = clip.resident.end();
+    for (auto it = clip.resident.begin(); it != clip.resident.end(); ++it) {
+      if (keep.count(it->first)) continue;
+      if ((oldest == clip.resident.end()) || (it->second.last_use < oldest->second.last_use)) {
+        oldest = it;
+      }
+    }
+    if (oldest == clip.resident.end()) break;
+
+    clip.resident_bytes -= oldest->second.bytes;
+    clip.resident.erase(oldest);
+  }
+}
+
+// 再生位置のブロックを取り出す
+//   間に合っていなければその場で読み込む
+//   先のブロックの先読みと、不要なブロックの追い出しもここで行う
+StreamBlockRef updateStreamClip(StreamClip& clip, const double time) {
+  clip.use_count += 1;
+
+  // 読み込みが終わったものを受け取る
+  for (auto it = clip.pending.begin(); it != clip.pending.end(); ) {
+    if (it->second.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+      addStreamResident(clip, it->first, it->second.get());
+      it = clip.pending.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+
+  u_int index = getStreamBlockIndex(clip, time);
+  auto it = clip.resident.find(index);
+  if (it == clip.resident.end()) {
+    auto p = clip.pending.find(index);
+    if (p != clip.pending.end()) {
+      addStreamResident(clip, index, p->second.get());
+      clip.pending.erase(p);
+    }
+    else {
+      addStreamResident(clip, index,
+                        readStreamBlock(clip.path, clip.channel_name, clip.duration, clip.block_index[index]));
+    }
+    it = clip.resident.find(index);
+  }
+  it->second.last_use = clip.use_count;
+
+  // 先読み(ループ再生なので末尾から先頭へ回り込む)
+  std::set<u_int> keep;
+  keep.insert(index);
+  u_int block_num = u_int(clip.block_index.size());
+  for (u_int i = 1; i <= clip.prefetch_num; ++i) {
+    u_int next = (index + i) % block_num;
+    keep.insert(next);
+    requestStreamBlock(clip, next);
+  }
+
+  evictStreamBlock(clip, keep);
+
+  return it->second.block;
+}
+
+
+// ストリーミング再生によるノード更新
+void updateModel(Model& model, const double time, StreamClip& clip) {
+  // 最大時間でループさせている
+  double current_time = std::fmod(time, clip.duration);
+
+  auto block = updateStreamClip(clip, current_time);
+
+  updateNodeMatrix(model, current_time, *block);
+  {
+    ScopedAnimStage stage(ANIM_STAGE_HIERARCHY);
+    updateNodeDerivedMatrix(model.node, Affine::identity());
+  }
+  updateMesh(model);
+}
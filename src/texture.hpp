@@ -6,16 +6,36 @@
 
 #include <map>
 #include <string>
+#include <memory>
 #include <cinder/ImageIo.h>
 #include <cinder/gl/Texture.h>
 #include <cinder/ip/Resize.h>
 #include "misc.hpp"
+#include "compressed.hpp"
 
 
-// テクスチャを読み込む
-ci::gl::TextureRef loadTexrture(const std::string& path) {
-  ci::app::console() << "Texture read:" << path << std::endl;
+// モデルから参照するテクスチャ
+//   読み込み中は仮のテクスチャを指し、本来の解像度のものが届いたら差し替える
+//   同じテクスチャを使うモデル同士で共有する
+struct TextureSlot {
+  TextureSlot()
+    : bytes(0),
+      resident(false)
+  {}
+
+  ci::gl::TextureRef texture;
+  // GPU側のサイズ
+  size_t bytes;
+  // 本来の解像度のものが揃っている
+  bool resident;
+};
 
+using TextureSlotRef = std::shared_ptr<TextureSlot>;
+
+
+// テクスチャにする画像を読み込む
+//   GLを使わないので、ワーカースレッドからも呼べる
+ci::Surface loadTextureSurface(const std::string& path) {
 #if defined (USE_FULL_PATH)
   ci::Surface surface = ci::loadImage(path);
 #else
@@ -37,5 +57,67 @@ ci::gl::TextureRef loadTexrture(const std::string& path) {
     ci::app::console() << "Texture resize: " << w << "," << h << " -> " << pow_w << "," << pow_h << std::endl;
   }
 
-  return ci::gl::Texture::create(surface);
+  return surface;
+}
+
+// テクスチャを読み込む
+ci::gl::TextureRef loadTexrture(const std::string& path) {
+  ci::app::console() << "Texture read:" << path << std::endl;
+
+  return ci::gl::Texture::create(loadTextureSurface(path));
+}
+
+// 転送した画像のGPU側のサイズ
+size_t getTextureBytes(const ci::gl::Texture& texture) {
+  return size_t(texture.getWidth()) * texture.getHeight() * (texture.hasAlpha() ? 4 : 3);
+}
+
+// モデルのテクスチャを読み込む
+//   隣に圧縮済みのファイル(KTX/DDS)があればそちらを使い、画像の展開とリサイズを省く
+//   bytes にはGPU側のサイズを返す
+ci::gl::TextureRef loadModelTexture(const std::string& path, size_t& bytes) {
+#if defined (USE_FULL_PATH)
+  std::string file_path = path;
+#else
+  std::string file_path = ci::app::getAssetPath(path).string();
+#endif
+
+  std::string compressed_path = file_path.empty() ? std::string() : findCompressedTexture(file_path);
+  if (!compressed_path.empty()) {
+    CompressedImage image;
+    if (loadCompressedImage(compressed_path, image)) {
+      auto texture = createCompressedTexture(image);
+      if (texture) {
+        bytes = getCompressedImageBytes(image);
+        ci::app::console() << "Texture read:" << compressed_path
+                           << " levels:" << image.level.size() << " " << bytes << " bytes" << std::endl;
+        return texture;
+      }
+      ci::app::console() << "Compressed texture not supported by driver:" << compressed_path << std::endl;
+    }
+  }
+
+  auto texture = loadTexrture(path);
+  bytes = getTextureBytes(*texture);
+  return texture;
+}
+
+// モデルのテクスチャを展開だけする
+//   loadModelTexture と同じファイルを読むが、GLには転送しない
+//   展開した画像のサイズを返す
+size_t decodeModelTexture(const std::string& path) {
+#if defined (USE_FULL_PATH)
+  std::string file_path = path;
+#else
+  std::string file_path = ci::app::getAssetPath(path).string();
+#endif
+
+  std::string compressed_path = file_path.empty() ? std::string() : findCompressedTexture(file_path);
+  if (!compressed_path.empty()) {
+    CompressedImage image;
+    if (loadCompressedImage(compressed_path, image)) return getCompressedImageBytes(image);
+  }
+
+  ci::Surface surface = loadTextureSurface(path);
+  return size_t(surface.getWidth()) * surface.getHeight() * (surface.hasAlpha() ? 4 : 3);
 }